@@ -6,6 +6,8 @@
 #include <unistd.h>
 #include <sys/time.h>
 
+#define AIO_DEPTH	64
+
 int
 main(int argc, char *argv[])
 {
@@ -20,18 +22,30 @@ main(int argc, char *argv[])
 
 	uint32_t klen, vlen;
 
+	db_aio_t   aio;
+	db_aget_t *req;
+	db_aget_t  reqs[AIO_DEPTH];
+	uint8_t    keys[AIO_DEPTH][32];
+	uint8_t    vals[AIO_DEPTH][256];
+	int        n;
+
         struct timeval tv;
 	uint64_t start, end;
 	uint64_t size = 0;
 
-        if (argc != 4) {
-                fprintf(stderr, "usage: %s [datafile] [indexfile] [loop]\n", argv[0]);
+        if (argc != 4 && argc != 5) {
+                fprintf(stderr, "usage: %s [datafile] [indexfile] [loop] [pool MB]\n", argv[0]);
                 return 0;
         }
 
+        memset(&option, 0, sizeof(option));
         option.table  = 256;
         option.bucket = 256;
         option.rdonly = 0;
+	if (argc == 5) {
+		option.backend = DB_BACKEND_PREAD;
+		option.pool    = (uint64_t)atoi(argv[4]) << 20;
+	}
 	if (db_open(&db, argv[1], argv[2], &option) != DB_OK) {
                 fprintf(stderr, "open db %s failed\n", argv[1]);
                 return 0;
@@ -76,6 +90,46 @@ main(int argc, char *argv[])
         end = tv.tv_sec * 1000 + tv.tv_usec / 1000;
 	printf("read: %6.3f MB/s\n", size / 1024.0/1024.0 /(end - start) * 1000);
 	printf("read: %6.3f Keys/s\n",  (float)loop /(end - start) * 1000);
+
+	db_aio_open(&db, &aio, AIO_DEPTH);
+
+	n = 0;
+	size = 0;
+	start = end;
+	for (i = 0; i < loop || n > 0; ) {
+		if (i < loop && n < AIO_DEPTH) {
+			req = &reqs[n++];
+		} else if ((req = db_aio_next(&aio, 1)) != NULL) {
+			if (req->error != DB_OK) {
+				printf("db_aget error: %.*s\n", (int)req->klen,
+					(char *)req->key);
+				break;
+			}
+			size += req->klen + req->vlen;
+			if (i >= loop) {
+				n--;
+				continue;
+			}
+		} else {
+			break;
+		}
+
+		req->key  = keys[req - reqs];
+		req->klen = sprintf((char *)keys[req - reqs], "%016d", i++);
+		req->val  = vals[req - reqs];
+		req->vlen = sizeof(vals[0]);
+		if (db_aget(&aio, req) != DB_OK) {
+			printf("db_aget error: %s\n", keys[req - reqs]);
+			break;
+		}
+	}
+
+	db_aio_close(&aio);
+
+	gettimeofday(&tv, NULL);
+        end = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+	printf("aread: %6.3f MB/s\n", size / 1024.0/1024.0 /(end - start) * 1000);
+	printf("aread: %6.3f Keys/s\n",  (float)loop /(end - start) * 1000);
 	
 	db_close(&db);
 
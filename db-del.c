@@ -17,6 +17,7 @@ main(int argc, char *argv[])
 		return 0;
 	}
 
+        memset(&option, 0, sizeof(option));
         option.table  = 256;
         option.bucket = 256;
         option.rdonly = 0;
@@ -1,71 +1,191 @@
 #include "db.h"
+#include "dump.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+
+typedef struct export {
+	FILE            *fp;
+	db_dump_t       *dump;	/* NULL write hex		*/
+	pthread_mutex_t  lock;	/* hex lines from every worker	*/
+	uint32_t        *item;	/* records per worker		*/
+} export_t;
+
+static void
+hexline(FILE *fp, const void *buf, uint32_t len)
+{
+	uint32_t i;
+
+	for (i = 0; i < len; i++)
+		fprintf(fp, "%02x", ((const unsigned char *)buf)[i]);
+	fprintf(fp, "\n");
+}
+
+static int
+export_record(void *data, uint64_t worker, const db_view_t *view)
+{
+	int error;
+	export_t *export = data;
+
+	if (export->dump != NULL) {
+		error = db_dump_put(export->dump, view->key, view->klen,
+			view->val, view->vlen, &view->meta);
+	} else {
+		pthread_mutex_lock(&export->lock);
+		hexline(export->fp, view->key, view->klen);
+		hexline(export->fp, view->val, view->vlen);
+		pthread_mutex_unlock(&export->lock);
+		error = DB_OK;
+	}
+
+	if (error == DB_OK)
+		export->item[worker] += 1;
+	return error;
+}
 
 int
 main(int argc, char *argv[])
 {
-	int  i;
+	int  opt;
+	int  hex;
+	int  log;
+	int  flags;
+	int  threads;
+	int  error;
 	db_t db;
-	db_iter_t iter;
 	db_option_t option;
 
+	uint32_t i;
 	uint32_t item;
-	uint32_t klen;
-	uint32_t vlen;
-
-	char key[1024];
-	char val[1024];
 
 	FILE *fp;
+	FILE *out;
+	db_dump_t *dump;
+	export_t   export;
+
+	hex     = 0;
+	log     = 0;
+	flags   = 0;
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "xlzt:")) != -1) {
+		switch (opt) {
+		case 'x':
+			hex = 1;
+			break;
+		case 'l':
+			log = 1;
+			break;
+		case 'z':
+			flags |= DB_DUMP_ZLIB;
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
 
-	if (argc != 4) {
-		fprintf(stderr, "usage: %s [datafile] [indexfile] [file]\n", argv[0]);
+	if (argc - optind != 3) {
+usage:
+		fprintf(stderr, "usage: %s [-x hex] [-l log order] [-z compress] "
+			"[-t threads] "
+			"[datafile] [indexfile] [file|-]\n", argv[0]);
 		return 0;
 	}
+	argv += optind;
 
+        memset(&option, 0, sizeof(option));
         option.rdonly = 1;
-	if (db_open(&db, argv[1], argv[2], &option) != DB_OK) {
-		fprintf(stderr, "open db %s failed\n", argv[1]);
+	if (db_open(&db, argv[0], argv[1], &option) != DB_OK) {
+		fprintf(stderr, "open db %s failed\n", argv[0]);
 		return 0;
 	}
 
-	if (db_iter(&db, &iter, NULL, 0) != DB_OK) {
-		fprintf(stderr, "iter db %s failed\n", argv[1]);
+	/* the dump goes to stdout, so the count goes to stderr */
+	if (strcmp(argv[2], "-") == 0) {
+		fp  = stdout;
+		out = stderr;
+	} else {
+		fp  = fopen(argv[2], "w");
+		out = stdout;
+	}
+	if (fp == NULL) {
+		fprintf(stderr, "open file %s failed\n", argv[2]);
 		return 0;
 	}
+	setvbuf(fp, NULL, _IOFBF, 1 << 20);
 
-	fp = fopen(argv[3], "w");
-	if (fp == NULL) {
-		fprintf(stderr, "open file %s failed\n", argv[3]);
+	/* flags, expire time and version go with the records */
+	if (db.db_flags & DB_FLAG_EXPIRE)
+		flags |= DB_DUMP_META;
+	if (db.db_flags & DB_FLAG_CAS)
+		flags |= DB_DUMP_CAS;
+	if (hex && (flags & DB_DUMP_META))
+		fprintf(stderr, "hex dump keep no flags and expire time\n");
+
+	dump = NULL;
+	if (!hex && (dump = db_dump_open(fp, DB_DUMP_WRITE, flags, threads)) == NULL) {
+		fprintf(stderr, "open dump %s failed\n", argv[2]);
 		return 0;
 	}
 
-	item = 0;
-	klen = sizeof(key);
-	vlen = sizeof(val);
-	while (db_iter_next(&db, &iter, key, &klen, val, &vlen) == DB_OK) {
-		for (i = 0; i < klen; i++)
-			fprintf(fp, "%02x", key[i]);
-		fprintf(fp, "\n");
-		for (i = 0; i < vlen; i++)
-			fprintf(fp, "%02x", val[i]);
-		fprintf(fp, "\n");
-
-		klen = sizeof(key);
-		vlen = sizeof(val);
-		item += 1;
+	/* the same threads scan the tables and encode the blocks */
+	if (threads < 1)
+		threads = 1;
+	export.fp   = fp;
+	export.dump = dump;
+	export.item = calloc(threads, sizeof(uint32_t));
+	pthread_mutex_init(&export.lock, NULL);
+	if (export.item == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 0;
+	}
+
+	/* log order read the data file once front to back, one cursor */
+	if (log) {
+		int next;
+		db_iter_t iter;
+		db_view_t view;
+
+		error = DB_OK;
+		db_iter_log(&db, &iter);
+		while (error == DB_OK &&
+		       (next = db_iter_view(&db, &iter, &view)) != DB_ERROR)
+		{
+			if (next != DB_OK) {
+				error = next;
+				break;
+			}
+			error = export_record(&export, 0, &view);
+			db_view_release(&view);
+		}
+	} else {
+		error = db_scan(&db, threads, export_record, &export);
 	}
 
-	printf("%u", item);
-	
-	fclose(fp);
+	item = 0;
+	for (i = 0; i < (uint32_t)threads; i++)
+		item += export.item[i];
+	free(export.item);
+	pthread_mutex_destroy(&export.lock);
+
+	if (dump != NULL && db_dump_close(dump) != DB_OK)
+		error = DB_SYS_ERROR;
+	if (fflush(fp) != 0 || ferror(fp))
+		error = DB_SYS_ERROR;
+	if (error != DB_OK)
+		fprintf(stderr, "write file %s failed\n", argv[2]);
+
+	fprintf(out, "%u", item);
+
+	if (fp != stdout)
+		fclose(fp);
 	db_close(&db);
 
 	return 0;
 }
-
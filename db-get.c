@@ -12,22 +12,43 @@ main(int argc, char *argv[])
 	db_t db;
 	db_option_t option;
 
-	char val[1024];
+	char val[65536];
 	uint32_t vlen;
+	uint32_t off;
+	uint32_t end;
+	uint32_t n;
 
-	if (argc != 4) {
-		fprintf(stderr, "usage: %s [databfile] [indexfile] [key]\n", argv[0]);
+	if (argc != 4 && argc != 5 && argc != 6) {
+		fprintf(stderr, "usage: %s [databfile] [indexfile] [key] [offset] [len]\n", argv[0]);
 		return 0;
 	}
 
+        memset(&option, 0, sizeof(option));
         option.rdonly = 1;
 	if (db_open(&db, argv[1], argv[2], &option) != DB_OK) {
 		fprintf(stderr, "open db %s failed\n", argv[1]);
 		return 0;
 	}
-	
-	if ((vlen = db_get(&db, argv[3], strlen(argv[3]), val, sizeof(val))) != 0) {
-		fwrite(val, sizeof(char), vlen, stdout);
+
+	off = argc >= 5 ? strtoul(argv[4], NULL, 10) : 0;
+	end = argc == 6 ? off + strtoul(argv[5], NULL, 10) : UINT32_MAX;
+	if (end < off)
+		end = UINT32_MAX;
+
+	/* value go out in pieces, whatever its size */
+	n = end - off < sizeof(val) ? end - off : sizeof(val);
+	if ((vlen = db_get_range(&db, argv[3], strlen(argv[3]), off, val, n)) != 0) {
+		if (end > vlen)
+			end = vlen;
+		while (off < end) {
+			n = end - off < sizeof(val) ? end - off : sizeof(val);
+			fwrite(val, sizeof(char), n, stdout);
+			off += n;
+
+			n = end - off < sizeof(val) ? end - off : sizeof(val);
+			if (n > 0)
+				db_get_range(&db, argv[3], strlen(argv[3]), off, val, n);
+		}
 	} else {
 		fprintf(stderr, "NOT FOUND\n");
 	}
@@ -36,4 +57,3 @@ main(int argc, char *argv[])
 
 	return 0;
 }
-
@@ -1,4 +1,5 @@
 #include "db.h"
+#include "dump.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,85 +7,214 @@
 #include <string.h>
 #include <unistd.h>
 
+static int
+hex(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* decode hex line in place, return byte length, -1 not a hex line */
+static ssize_t
+unhex(char *line, ssize_t len)
+{
+	ssize_t i;
+
+	while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+		len--;
+	if (len % 2 != 0)
+		return -1;
+
+	for (i = 0; i < len; i += 2) {
+		int hi = hex((unsigned char)line[i]);
+		int lo = hex((unsigned char)line[i + 1]);
+
+		if (hi < 0 || lo < 0)
+			return -1;
+		line[i / 2] = hi << 4 | lo;
+	}
+
+	return len / 2;
+}
+
+/* hex text dump, two lines per record */
+static int
+load_hex(db_bulk_t *bulk, FILE *fp, uint32_t *item)
+{
+	char    *key;
+	char    *val;
+	size_t   keycap;
+	size_t   valcap;
+	ssize_t  klen;
+	ssize_t  vlen;
+	int      error;
+
+	key    = NULL;
+	val    = NULL;
+	keycap = 0;
+	valcap = 0;
+	error  = DB_OK;
+	while ((klen = getline(&key, &keycap, fp)) > 0 &&
+	       (vlen = getline(&val, &valcap, fp)) > 0)
+	{
+		if ((klen = unhex(key, klen)) < 0 || (vlen = unhex(val, vlen)) < 0) {
+			fprintf(stderr, "bad line after %u items\n", *item);
+			error = DB_ERROR;
+			break;
+		}
+		if (klen == 0)
+			continue;
+		if (db_bulk_put(bulk, key, klen, val, vlen) != DB_OK) {
+			fprintf(stderr, "db_bulk_put error\n");
+			error = DB_SYS_ERROR;
+			break;
+		}
+		*item += 1;
+	}
+	free(key);
+	free(val);
+
+	return error;
+}
+
+static int
+load_dump(db_bulk_t *bulk, db_dump_t *dump, uint32_t *item)
+{
+	int         error;
+	uint32_t    klen;
+	uint32_t    vlen;
+	const void *key;
+	const void *val;
+	db_meta_t   meta;
+
+	while ((error = db_dump_get(dump, &key, &klen, &val, &vlen,
+			&meta)) == DB_OK)
+	{
+		if (klen == 0)
+			continue;
+		if (db_bulk_put_meta(bulk, key, klen, val, vlen, &meta) != DB_OK) {
+			fprintf(stderr, "db_bulk_put error\n");
+			error = DB_SYS_ERROR;
+			break;
+		}
+		*item += 1;
+	}
+
+	/* DB_ERROR is the clean end of the dump */
+	if (error == DB_SYS_ERROR)
+		fprintf(stderr, "broken or truncated dump after %u items\n", *item);
+	db_dump_close(dump);
+
+	return error == DB_ERROR ? DB_OK : error;
+}
+
 int
 main(int argc, char *argv[])
 {
-	int  i;
+	int opt;
+	int error;
+	int threads;
 	db_t db;
+	db_bulk_t bulk;
+	db_dump_t *dump;
 	db_option_t option;
 
 	uint32_t item;
-	uint32_t klen;
-	uint32_t vlen;
-
-	char key[1024];
-	char val[1024];
+	uint64_t expect;
 
 	FILE *fp;
 
-	if (argc != 4) {
-		fprintf(stderr, "usage: %s [datafile] [indexfile] [file]\n", argv[0]);
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "t:")) != -1) {
+		switch (opt) {
+		case 't':
+			threads = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (argc - optind != 3 && argc - optind != 4) {
+usage:
+		fprintf(stderr, "usage: %s [-t threads] [datafile] [indexfile] "
+			"[file|-] [keys]\n", argv[0]);
+		return 0;
+	}
+	argc -= optind;
+	argv += optind;
+
+	expect = argc == 4 ? strtoull(argv[3], NULL, 10) : 0;
+
+	if (strcmp(argv[2], "-") == 0)
+		fp = stdin;
+	else
+		fp = fopen(argv[2], "r");
+	if (fp == NULL) {
+		fprintf(stderr, "open file %s failed\n", argv[2]);
+		return 0;
+	}
+	setvbuf(fp, NULL, _IOFBF, 1 << 20);
+
+	/* binary dump or the old hex text, told by the first byte */
+	dump = NULL;
+	if (db_dump_probe(fp) &&
+	    (dump = db_dump_open(fp, DB_DUMP_READ, 0, threads)) == NULL)
+	{
+		fprintf(stderr, "bad dump header\n");
 		return 0;
 	}
 
+        memset(&option, 0, sizeof(option));
         option.table  = 256;
         option.bucket = 256;
         option.rdonly = 0;
-	if (db_open(&db, argv[1], argv[2], &option) != DB_OK) {
-		fprintf(stderr, "open db %s failed\n", argv[1]);
+	if (dump != NULL) {	/* a new db keep what the dump carry */
+		option.expire = db_dump_flags(dump) & DB_DUMP_META ? 1 : 0;
+		option.cas    = db_dump_flags(dump) & DB_DUMP_CAS ? 1 : 0;
+	}
+	if (db_open(&db, argv[0], argv[1], &option) != DB_OK) {
+		fprintf(stderr, "open db %s failed\n", argv[0]);
+		return 0;
+	}
+	if (dump != NULL && (db_dump_flags(dump) & DB_DUMP_META) &&
+	    !(db.db_flags & DB_FLAG_EXPIRE))
+	{
+		fprintf(stderr, "db %s keep no flags and expire time, "
+			"import into a new db\n", argv[0]);
 		return 0;
 	}
 
-	fp = fopen(argv[3], "r");
-	if (fp == NULL) {
-		fprintf(stderr, "open file %s failed\n", argv[3]);
+	if (db_bulk_begin(&db, &bulk, expect) != DB_OK) {
+		fprintf(stderr, "bulk load %s failed\n", argv[0]);
 		return 0;
 	}
 
 	item = 0;
-	klen = 0;
-	vlen = 0;
-	while (!feof(fp)) {
-		char    *line = NULL;
-		size_t   linecap = 0;
-		ssize_t  linelen;
-
-		memset(key, 0, sizeof(key));
-		if ((linelen = getline(&line, &linecap, fp)) > 0) {
-			linelen -= linelen % 2;
-			for (i = 0; i < linelen; i+=2) {
-				char str[3];
-				str[2] = '\0';
-				memcpy(str, line + i, 2);
-				key[klen++] = strtol(str, NULL, 16);
-			}
-		}
-		line = NULL;
-		linecap = 0;
-		memset(val, 0, sizeof(val));
-		if ((linelen = getline(&line, &linecap, fp)) > 0) {
-			linelen -= linelen % 2;
-			for (i = 0; i < linelen; i+=2) {
-				char str[3];
-				str[2] = '\0';
-				memcpy(str, line + i, 2);
-				val[vlen++] = strtol(str, NULL, 16);
-			}
-		}
-		if (klen) {
-			if (db_put(&db, key, klen, val, vlen) == DB_OK) {
-				item += 1;
-			}
-		}
-		klen = 0;
-		vlen = 0;
+	if (dump != NULL)
+		error = load_dump(&bulk, dump, &item);
+	else
+		error = load_hex(&bulk, fp, &item);
+
+	/* a broken input publish nothing, the db stay as it was */
+	if (error != DB_OK) {
+		db_bulk_abort(&bulk);
+		fprintf(stderr, "import %s failed, nothing imported\n", argv[2]);
+		item = 0;
+	} else if (db_bulk_end(&bulk, threads > 0 ? threads : 1) != DB_OK) {
+		fprintf(stderr, "build index failed\n");
 	}
 
 	printf("%u", item);
-	
-	fclose(fp);
+
+	if (fp != stdin)
+		fclose(fp);
 	db_close(&db);
 
 	return 0;
 }
-
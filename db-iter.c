@@ -17,19 +17,28 @@ main(int argc, char *argv[])
 	char val[1024];
 	uint32_t klen, vlen;
 	uint64_t len;
+	int log;
+
+	/* -l walk the data file in order, not the tables */
+	log = argc == 4 && strcmp(argv[1], "-l") == 0;
+	if (log) {
+		argc--;
+		argv++;
+	}
 
 	if (argc != 3) {
-		fprintf(stderr, "usage: %s [datafile] [indexfile]\n", argv[0]);
+		fprintf(stderr, "usage: %s [-l] [datafile] [indexfile]\n", argv[0]);
 		return 0;
 	}
 
+        memset(&option, 0, sizeof(option));
         option.rdonly = 1;
 	if (db_open(&db, argv[1], argv[2], &option) != DB_OK) {
 		fprintf(stderr, "open db %s failed\n", argv[1]);
 		return 0;
 	}
 
-	if (db_iter(&db, &iter, NULL, 0) != DB_OK) {
+	if ((log ? db_iter_log(&db, &iter) : db_iter(&db, &iter, NULL, 0)) != DB_OK) {
 		fprintf(stderr, "iter db %s failed\n", argv[1]);
 		return 0;
 	}
@@ -5,6 +5,29 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
+
+/* stdin is a regular file, its size is known, stream it in */
+static int
+put_stream(db_t *db, const char *key, uint64_t size)
+{
+	char buf[65536];
+	size_t n;
+	db_stream_t stream;
+
+	if (size > UINT32_MAX)
+		return DB_ERROR;
+
+	if (db_put_begin(db, &stream, key, strlen(key), size) != DB_OK)
+		return DB_ERROR;
+
+	while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0) {
+		if (db_put_write(&stream, buf, n) != DB_OK)
+			return DB_ERROR;
+	}
+
+	return db_put_end(&stream);
+}
 
 int
 main(int argc, char *argv[])
@@ -21,6 +44,7 @@ main(int argc, char *argv[])
 		return 0;
 	}
 
+	memset(&option, 0, sizeof(option));
 	option.table  = 256;
 	option.bucket = 256;
 	option.rdonly = 0;
@@ -30,16 +54,29 @@ main(int argc, char *argv[])
 	}
 
 	if (argc == 4) {
-		int n = 0;
+		struct stat st;
+		int c;
+		size_t n = 0;
+
+		if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode)) {
+			if (put_stream(&db, argv[3], st.st_size) == DB_OK)
+				fprintf(stderr, "OK\n");
+			else
+				fprintf(stderr, "NOT OK\n");
+			db_close(&db);
+			return 0;
+		}
+
 		vlen = 4096;
 		val = malloc(vlen);
-		while ((val[n++] = getchar()) != EOF) {
+		while ((c = getchar()) != EOF) {
+			val[n++] = c;
 			if (n >= vlen) {
 				vlen *= 2;
 				val = realloc(val, vlen);
 			}
 		}
-		vlen = n - 1;
+		vlen = n;
 	} else {
 		vlen = strlen(argv[4]);
 		val = malloc(vlen);
@@ -51,6 +88,7 @@ main(int argc, char *argv[])
 	} else {
 		fprintf(stderr, "NOT OK\n");
 	}
+	free(val);
 	
 	db_close(&db);
 
@@ -0,0 +1,36 @@
+#include "db.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+int
+main(int argc, char *argv[])
+{
+	db_option_t option;
+	uint64_t    threads;
+
+	if (argc != 3 && argc != 4) {
+		fprintf(stderr, "usage: %s [datafile] [indexfile] [threads]\n", argv[0]);
+		return 0;
+	}
+
+	if (argc == 4)
+		threads = atoi(argv[3]);
+	else
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+        memset(&option, 0, sizeof(option));
+        option.table  = 256;
+        option.bucket = 256;
+        option.rdonly = 0;
+	if (db_rebuild_index(argv[1], argv[2], &option, threads) == DB_OK) {
+		fprintf(stderr, "OK\n");
+	} else {
+		fprintf(stderr, "NOT OK\n");
+	}
+
+	return 0;
+}
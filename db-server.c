@@ -1,14 +1,21 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <endian.h>
+#include <pthread.h>
 #include <sys/uio.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -23,6 +30,17 @@ typedef struct sockaddr_in      si_t;
 typedef struct sockaddr_in6     s6_t;
 typedef struct sockaddr_storage ss_t;
 
+#define SLAB_MIN_SHIFT	12			/* 4KB smallest buffer	  */
+#define SLAB_MAX_SHIFT	27			/* 128MB biggest buffer	  */
+#define SLAB_CLASSES	(SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_CACHE	(1 << 20)		/* free bytes kept a class */
+
+/* power of two buffers, a free list a size, one per thread no lock */
+typedef struct slab {
+	void     *free[SLAB_CLASSES];	/* linked through the first word */
+	uint32_t  count[SLAB_CLASSES];
+} slab_t;
+
 typedef struct sbuf {
 	int   max;
 	int   off;
@@ -30,49 +48,246 @@ typedef struct sbuf {
 	char *buf;
 } sbuf_t;
 
+/* counters, only the owner thread write them */
+typedef struct stats {
+	uint64_t curr_connections;
+	uint64_t total_connections;
+	uint64_t cmd_get;
+	uint64_t get_hits;
+	uint64_t get_misses;
+	uint64_t cmd_set;
+	uint64_t cmd_delete;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+} stats_t;
+
+#define MGET_BATCH	64			/* keys a batched lookup   */
+#define MGET_VALUE	(1 << 10)		/* value read with the key */
+						/* a bigger one sent in place */
+#define MGET_BUF	(MGET_BATCH * MGET_VALUE)
+
+/* one per thread, own listener, epoll and buffers, the db is shared */
+typedef struct worker {
+	int        id;
+	int        epfd;
+	int        socketfd;
+	pthread_t  tid;
+	db_t      *db;
+
+	char  *valbuf;
+	slab_t slab;
+
+	db_aio_t  aio;
+	db_aget_t mget[MGET_BATCH];
+
+	stats_t stat;
+} worker_t;
+
+/* a value sent from the db, pinned by its view, after out->buf[at] */
+typedef struct zref {
+	int       at;
+	db_view_t view;
+} zref_t;
+
+/* one per connection, the epoll event point at it */
 typedef struct conn {
-	sbuf_t in;
-	sbuf_t out;
+	int       fd;
+	int       proto;	/* PROTO_, from the first byte */
+	int       part;	/* multi-get line answered up to here */
+	int       scan;	/* line searched for its end up to here */
+	sbuf_t    in;
+	sbuf_t    out;
+	worker_t *w;
+
+	zref_t   *zref;
+	int       nzref;
+	int       maxzref;
+	int       zoff;	/* zref sent up to, zpos bytes in it */
+	uint32_t  zpos;
+	int64_t   zbytes;	/* value bytes in zref */
 } conn_t;
 
-conn_t conn[FD_SETSIZE];	/* FD_SETSIZE not a big number anyway */
+#define EVENT_MAX		1024		/* events a epoll_wait	  */
 
-#define INBUF_LEN		(1 << 26)	/* 64MB for read request  */
-#define OUTBUF_LEN		(1 << 26)	/* 64MB for send response */
+#define INBUF_MAX		(1 << 26)	/* 64MB biggest request	  */
+#define OUTBUF_MAX		(1 << 27)	/* a 64MB value and more  */
+#define OUTBUF_BATCH		(1 << 20)	/* send before growing past */
 
-#define VALBUF_LEN		(1 << 26)	/* 64MB for read database */
+#define IOV_BATCH		64		/* pieces a sendmsg	  */
+#define ZREF_MIN		16
 
-char *inbuf;
-char *outbuf;
+/*
+ * the engine has no lock, get share it, set, delete and maintenance
+ * own it.  writers queue on wrmutex first, one at a time wait on the
+ * writer preferring dblock and hold gets back
+ */
+pthread_rwlock_t dblock;
+pthread_mutex_t  wrmutex = PTHREAD_MUTEX_INITIALIZER;
 
-char *valbuf;
+worker_t *workers;
+int       nworkers;
+int       syncsec;	/* seconds between syncs, 0 never */
+
+/* stats read other threads counters, no torn words */
+#define STAT_ADD(w, name, n) \
+	__atomic_store_n(&(w)->stat.name, \
+		__atomic_load_n(&(w)->stat.name, __ATOMIC_RELAXED) + (n), \
+		__ATOMIC_RELAXED)
+#define STAT_GET(w, name) __atomic_load_n(&(w)->stat.name, __ATOMIC_RELAXED)
 
 enum {HANDLE_CLOSE, HANDLE_FINISH, HANDLE_NEEDMOREIN, HANDLE_NEEDMOREOUT};
 
-#define ARGC_MAX	6
-#define ARGV_MAX	1024			/* also max key size */
+#define REAP_BUCKETS	(1 << 12)		/* index slots reaped a read lock */
+#define REAP_USEC	1000			/* us a reap slice read data */
+#define RESERVE_ROOM	(1 << 26)		/* file room kept, a biggest set */
+#define RESERVE_TABLES	64			/* index tables looked at a slice */
+#define RESERVE_BUCKETS	(1 << 12)		/* index slots rehashed a read lock */
+#define RESERVE_SLICES	256			/* rehash slices a time round */
+#define MAINT_BUSY	1000000			/* ns between busy slices */
+#define MAINT_IDLE	10000000		/* ns between idle looks */
+#define EXPTIME_REL	(60 * 60 * 24 * 30)	/* memcached, up to 30 days is relative */
+
+#define TOKEN_MAX	8			/* tokens kept, get walk its line */
+#define RESPONSE_MIN	64			/* room for a reply line */
+#define STATS_LINES	9			/* counters per thread */
+
+enum {PROTO_UNKNOWN, PROTO_TEXT, PROTO_BINARY};
+
+#define BIN_REQ		0x80			/* magic */
+#define BIN_RES		0x81
+#define BIN_HEADER	24
+#define BIN_GET_EXTRAS	4			/* flags */
+#define BIN_SET_EXTRAS	8			/* flags, exptime */
+#define BIN_INCR_EXTRAS	20			/* delta, initial, exptime */
+#define BIN_INCR_NONE	0xffffffff		/* exptime, don't create */
+
+enum {
+	BIN_GET      = 0x00,
+	BIN_SET      = 0x01,
+	BIN_ADD      = 0x02,
+	BIN_REPLACE  = 0x03,
+	BIN_DELETE   = 0x04,
+	BIN_INCR     = 0x05,
+	BIN_DECR     = 0x06,
+	BIN_GETQ     = 0x09,
+	BIN_NOOP     = 0x0a,
+	BIN_GETK     = 0x0c,
+	BIN_GETKQ    = 0x0d,
+	BIN_APPEND   = 0x0e,
+	BIN_PREPEND  = 0x0f,
+	BIN_SETQ     = 0x11,
+	BIN_ADDQ     = 0x12,
+	BIN_REPLACEQ = 0x13,
+	BIN_DELETEQ  = 0x14,
+	BIN_INCRQ    = 0x15,
+	BIN_DECRQ    = 0x16,
+	BIN_APPENDQ  = 0x19,
+	BIN_PREPENDQ = 0x1a
+};
+
+enum {
+	BIN_OK         = 0x00,
+	BIN_NOT_FOUND  = 0x01,
+	BIN_EXISTS     = 0x02,
+	BIN_EINVAL     = 0x04,
+	BIN_NOT_STORED = 0x05,
+	BIN_BAD_DELTA  = 0x06,
+	BIN_UNKNOWN    = 0x81,
+	BIN_EINTERNAL  = 0x84
+};
+
+/* the same 24 bytes as the wire, no padding */
+typedef struct bin_header {
+	uint8_t  magic;
+	uint8_t  opcode;
+	uint16_t klen;
+	uint8_t  extlen;
+	uint8_t  type;
+	uint16_t status;	/* vbucket in a request */
+	uint32_t blen;		/* extras, key and value */
+	uint32_t opaque;
+	uint64_t cas;
+} bin_header_t;
+
+/* a word of the request, in the input buffer */
+typedef struct token {
+	char *buf;
+	int   len;
+} token_t;
+
+/* len is the line in, all the command consumed out */
+typedef int (*command_fn)(conn_t *c, token_t *tok, int ntok, char *line, int *len);
 
-ssize_t
-sbuf_send(const int fd, sbuf_t *buf, ssize_t *snd)
+typedef struct command {
+	const char *name;
+	int         len;
+	int         ntok;	/* tokens at least */
+	int         noreply;	/* a last noreply token drop the answer */
+	command_fn  fn;
+} command_t;
+
+void
+write_lock(void)
 {
-	ssize_t len;
+	pthread_mutex_lock(&wrmutex);
+	pthread_rwlock_wrlock(&dblock);
+}
 
-	assert(buf->len <= buf->max);
-	assert(buf->off <  buf->len);
+void
+write_unlock(void)
+{
+	pthread_rwlock_unlock(&dblock);
+	pthread_mutex_unlock(&wrmutex);
+}
 
-	*snd = 0;
-	do {
-		len = send(fd, buf->buf + buf->off, buf->len - buf->off, 0);
-		if (len > 0) {
-			*snd     += len;
-			buf->off += len;
-		}
-	} while (buf->off > 0 && buf->off < buf->len && len > 0);
+int
+slab_class(const int64_t len)
+{
+	int c;
 
-	if (len == -1 && errno == EWOULDBLOCK)
-		len = 1;	/* don't error when recv block */
+	for (c = 0; ((int64_t)1 << (c + SLAB_MIN_SHIFT)) < len; c++)
+		;
+	return c;
+}
 
-	return len;	/* err */
+/* a buffer of the class of len, max set to its size */
+char *
+slab_alloc(slab_t *slab, const int64_t len, int *max)
+{
+	int   c;
+	void *p;
+
+	if (len > ((int64_t)1 << SLAB_MAX_SHIFT))
+		return NULL;
+
+	c = slab_class(len);
+	if ((p = slab->free[c]) != NULL) {
+		slab->free[c]   = *(void **)p;
+		slab->count[c] -= 1;
+	} else if ((p = malloc((size_t)1 << (c + SLAB_MIN_SHIFT))) == NULL) {
+		return NULL;
+	}
+
+	*max = 1 << (c + SLAB_MIN_SHIFT);
+
+	return p;
+}
+
+/* up to SLAB_CACHE bytes a class kept, the rest back to malloc */
+void
+slab_free(slab_t *slab, char *buf, const int max)
+{
+	int c;
+
+	c = slab_class(max);
+	if (((int64_t)slab->count[c] + 1) * max > SLAB_CACHE) {
+		free(buf);
+		return;
+	}
+
+	*(void **)buf   = slab->free[c];
+	slab->free[c]   = buf;
+	slab->count[c] += 1;
 }
 
 ssize_t
@@ -97,13 +312,16 @@ sbuf_recv(const int fd, sbuf_t *buf, ssize_t *rcv)
 	return len;	/* err */
 }
 
+/* drop what was consumed, the rest to the front */
 void
-sbuf_allocate(sbuf_t *buf, char *data, const ssize_t size)
+sbuf_compact(sbuf_t *buf)
 {
-	buf->max = size;
-	buf->len = 0;
-	buf->off = 0;
-	buf->buf = data;
+	if (buf->off == 0)
+		return;
+
+	memmove(buf->buf, buf->buf + buf->off, buf->len - buf->off);
+	buf->len -= buf->off;
+	buf->off  = 0;
 }
 
 void
@@ -115,313 +333,1572 @@ sbuf_release(sbuf_t *buf)
 	buf->buf = NULL;
 }
 
+/* room for len more bytes, grown from the slab, -1 past limit */
+int
+sbuf_reserve(slab_t *slab, sbuf_t *buf, const int64_t len, const int64_t limit)
+{
+	int   max;
+	char *p;
+
+	if (buf->max - buf->len >= len)
+		return 0;
+
+	if (buf->len + len > limit)
+		return -1;
+
+	if ((p = slab_alloc(slab, buf->len + len, &max)) == NULL)
+		return -1;
+
+	if (buf->buf != NULL) {
+		memcpy(p, buf->buf, buf->len);
+		slab_free(slab, buf->buf, buf->max);
+	}
+	buf->buf = p;
+	buf->max = max;
+
+	return 0;
+}
+
+/* empty go back to the slab, mostly empty move to a smaller class */
+void
+sbuf_shrink(slab_t *slab, sbuf_t *buf)
+{
+	int   max;
+	char *p;
+
+	if (buf->buf == NULL || buf->off != 0)
+		return;
+
+	if (buf->len == 0) {
+		slab_free(slab, buf->buf, buf->max);
+		sbuf_release(buf);
+		return;
+	}
+
+	if (buf->max <= (1 << SLAB_MIN_SHIFT) || buf->len > buf->max / 4)
+		return;
+
+	if ((p = slab_alloc(slab, (int64_t)buf->len * 2, &max)) == NULL)
+		return;
+
+	memcpy(p, buf->buf, buf->len);
+	slab_free(slab, buf->buf, buf->max);
+
+	buf->buf = p;
+	buf->max = max;
+}
+
+/* a reply not all sent, a value may be the last piece */
+int
+conn_pending(const conn_t *c)
+{
+	return c->out.off < c->out.len || c->zoff < c->nzref;
+}
+
+/* the next text or value to send, what conn_send and conn_advance walk */
+int
+conn_piece(conn_t *c, char **base, size_t *len)
+{
+	sbuf_t *out = &c->out;
+	zref_t *z;
+	int     end;
+
+	if (c->zoff == c->nzref) {
+		end = out->len;
+	} else if (out->off == (z = &c->zref[c->zoff])->at) {
+		*base = (char *)z->view.val + c->zpos;
+		*len  = z->view.vlen - c->zpos;
+		return 1;
+	} else {
+		end = z->at;
+	}
+
+	*base = out->buf + out->off;
+	*len  = end - out->off;
+	return 0;
+}
+
+void
+conn_advance(conn_t *c, size_t len)
+{
+	char  *base;
+	size_t n;
+
+	while (len > 0) {
+		if (conn_piece(c, &base, &n)) {
+			n = n < len ? n : len;
+			c->zpos += n;
+			if (c->zpos == c->zref[c->zoff].view.vlen) {
+				c->zoff += 1;
+				c->zpos  = 0;
+			}
+		} else {
+			n = n < len ? n : len;
+			c->out.off += n;
+		}
+		len -= n;
+	}
+}
+
+/*
+ * the text in out with the values spliced in at their offsets, one
+ * sendmsg for up to IOV_BATCH pieces, the return is sbuf_recv's
+ */
+ssize_t
+conn_send(conn_t *c, ssize_t *snd)
+{
+	sbuf_t *out = &c->out;
+
+	int     n;
+	ssize_t len;
+
+	struct msghdr msg;
+	struct iovec  iov[IOV_BATCH];
+
+	assert(conn_pending(c));
+
+	*snd = 0;
+	do {
+		int    zoff = c->zoff;
+		int    off  = out->off;
+		size_t zpos = c->zpos;
+
+		/* walk the pieces ahead, then rewind for conn_advance */
+		for (n = 0; n < IOV_BATCH && conn_pending(c); n++) {
+			char  *base;
+			size_t piece;
+
+			conn_piece(c, &base, &piece);
+			iov[n].iov_base = base;
+			iov[n].iov_len  = piece;
+			conn_advance(c, piece);
+		}
+		c->zoff  = zoff;
+		c->zpos  = zpos;
+		out->off = off;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov    = iov;
+		msg.msg_iovlen = n;
+
+		/* a peer gone is an error, not a SIGPIPE */
+		len = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+		if (len > 0) {
+			*snd += len;
+			conn_advance(c, len);
+		}
+	} while (conn_pending(c) && len > 0);
+
+	if (len == -1 && errno == EWOULDBLOCK)
+		len = 1;	/* don't error when send block */
+
+	return len;	/* err */
+}
+
+/* all sent, the values unpinned */
+void
+conn_sent(conn_t *c)
+{
+	int i;
+
+	for (i = 0; i < c->nzref; i++)
+		db_view_release(&c->zref[i].view);
+
+	c->nzref  = 0;
+	c->zoff   = 0;
+	c->zpos   = 0;
+	c->zbytes = 0;
+
+	c->out.off = 0;
+	c->out.len = 0;
+}
+
+/* a value to send from where it is, after the text so far */
+zref_t *
+conn_zref(conn_t *c)
+{
+	zref_t *zref;
+	int     max;
+
+	if (c->nzref == c->maxzref) {
+		max = c->maxzref ? c->maxzref * 2 : ZREF_MIN;
+		if ((zref = realloc(c->zref, max * sizeof(zref_t))) == NULL)
+			return NULL;
+		c->zref    = zref;
+		c->maxzref = max;
+	}
+
+	c->zref[c->nzref].at = c->out.len;
+
+	return &c->zref[c->nzref++];
+}
+
+/*
+ * one request line, the tokens point into buf, nothing is copied.
+ * memchr find the end and the spaces a word at a time.
+ * the line length with \r\n back, 0 not all here, -1 malformed
+ */
+int
+tokenize(char *buf, const int buflen, int *scan, token_t *tok, int *ntok)
+{
+	int   n;
+	char *p;
+	char *nl;
+	char *end;
+	char *sp;
+
+	/* a long line come in many recv, go on where the last look stop */
+	if ((nl = memchr(buf + *scan, '\n', buflen - *scan)) == NULL) {
+		*scan = buflen;
+		return 0;
+	}
+	*scan = nl - buf;
+
+	if (nl == buf || nl[-1] != '\r')
+		return -1;
+
+	end = nl - 1;
+	for (n = 0, p = buf; p < end && n < TOKEN_MAX; p = sp) {
+		if (*p == ' ') {
+			sp = p + 1;
+			continue;
+		}
+		if ((sp = memchr(p, ' ', end - p)) == NULL)
+			sp = end;
+
+		tok[n].buf = p;
+		tok[n].len = sp - p;
+		n++;
+	}
+	*ntok = n;
+
+	return nl + 1 - buf;
+}
+
+/* decimal, -1 when it is not a number or past max */
+int
+token_u64(const token_t *tok, const uint64_t max, uint64_t *val)
+{
+	int      i;
+	uint64_t v;
+
+	if (tok->len == 0 || tok->len > 20)
+		return -1;
+
+	for (v = 0, i = 0; i < tok->len; i++) {
+		unsigned d = (unsigned char)tok->buf[i] - '0';
+
+		if (d > 9 || v > (max - d) / 10)
+			return -1;
+		v = v * 10 + d;
+	}
+	*val = v;
+
+	return 0;
+}
+
+/* exptime may be negative */
+int
+token_long(const token_t *tok, long *val)
+{
+	uint64_t v;
+	token_t  t = *tok;
+
+	if (t.len > 0 && t.buf[0] == '-') {
+		t.buf++;
+		t.len--;
+	}
+	if (token_u64(&t, LONG_MAX, &v) == -1)
+		return -1;
+
+	*val = (t.len < tok->len) ? -(long)v : (long)v;
+
+	return 0;
+}
+
+/* memcached exptime to unix time, negative is expired already */
+uint32_t
+exptime(long t)
+{
+	if (t < 0)
+		return 1;
+	if (t == 0)
+		return 0;
+	if (t <= EXPTIME_REL)
+		return time(NULL) + t;
+	return t;
+}
+
+#define STAT_LINE(name) do { \
+	uint64_t v = 0; \
+	for (i = 0; i < nworkers; i++) \
+		v += STAT_GET(&workers[i], name); \
+	len += snprintf(buf + len, max - len, \
+		"STAT %s %llu\r\n", #name, (unsigned long long)v); \
+	for (i = 0; i < nworkers; i++) \
+		len += snprintf(buf + len, max - len, \
+			"STAT thread.%d.%s %llu\r\n", i, #name, \
+			(unsigned long long)STAT_GET(&workers[i], name)); \
+} while (0)
+
+/* totals then every thread, appended to out, the length back */
+int
+stats(sbuf_t *out)
+{
+	int i;
+	int len;
+	int max;
+
+	char *buf;
+
+	buf = out->buf + out->len;
+	max = out->max - out->len;
+
+	len = snprintf(buf, max, "STAT threads %d\r\n", nworkers);
+
+	STAT_LINE(curr_connections);
+	STAT_LINE(total_connections);
+	STAT_LINE(cmd_get);
+	STAT_LINE(get_hits);
+	STAT_LINE(get_misses);
+	STAT_LINE(cmd_set);
+	STAT_LINE(cmd_delete);
+	STAT_LINE(bytes_read);
+	STAT_LINE(bytes_written);
+
+	len += snprintf(buf + len, max - len, "END\r\n");
+
+	return len;
+}
+
+/*
+ * room for a reply of text bytes in out and value bytes sent in
+ * place, what is queued go first when the batch is big
+ */
+int
+reply_reserve(conn_t *c, const int64_t text, const int64_t value)
+{
+	sbuf_t *out = &c->out;
+	int64_t queued;
+
+	queued = out->len + c->zbytes;
+	if (queued > 0 && queued + text + value > OUTBUF_BATCH)
+		return HANDLE_NEEDMOREOUT;
+
+	if (sbuf_reserve(&c->w->slab, out, text, OUTBUF_MAX) == -1)
+		return queued > 0 ? HANDLE_NEEDMOREOUT : HANDLE_CLOSE;
+
+	return HANDLE_FINISH;
+}
+
+/*
+ * room for a hit, text bytes and the value, a value bigger than the
+ * first read is pinned in view and big set. a hit gone meanwhile is
+ * a miss now
+ */
 int
-keylen(const char *key, const int maxlen)
+reply_hit(conn_t *c, db_aget_t *req, const int64_t text, db_view_t *view,
+	int *big)
 {
-	char *p = (char *)memchr(key, ' ', maxlen);
-	if (p == NULL)
-		p = (char *)memchr(key, '\r', maxlen);
-	if (p == NULL)
+	int reply;
+
+	*big = 0;
+	if (req->error != DB_OK)
+		return HANDLE_FINISH;
+
+	if (req->vlen > MGET_VALUE)
+		reply = reply_reserve(c, text, req->vlen);
+	else
+		reply = reply_reserve(c, text + req->vlen, 0);
+	if (reply != HANDLE_FINISH)
+		return reply;
+
+	if (req->vlen <= MGET_VALUE)
+		return HANDLE_FINISH;
+
+	pthread_rwlock_rdlock(&dblock);
+	if (db_view(c->w->db, req->key, req->klen, view) != DB_OK)
+		req->error = DB_ERROR;
+	pthread_rwlock_unlock(&dblock);
+
+	if (req->error == DB_OK) {
+		req->vlen = view->vlen;
+		req->meta = view->meta;
+		*big      = 1;
+	}
+	return HANDLE_FINISH;
+}
+
+/* the value after the text so far, copied or sent from the view */
+int
+reply_value(conn_t *c, db_aget_t *req, db_view_t *view, const int big)
+{
+	zref_t *z;
+	sbuf_t *out = &c->out;
+
+	if (!big) {
+		memcpy(out->buf + out->len, req->val, req->vlen);
+		out->len += req->vlen;
 		return 0;
-	return p - key;
+	}
+
+	if ((z = conn_zref(c)) == NULL) {
+		db_view_release(view);
+		return -1;
+	}
+	z->view    = *view;
+	c->zbytes += view->vlen;
+
+	return 0;
+}
+
+/* one key is a plain lookup, the value copied out of the mapping */
+void
+get_one(worker_t *w, db_aget_t *req)
+{
+	db_view_t view;
+
+	pthread_rwlock_rdlock(&dblock);
+	req->error = db_view(w->db, req->key, req->klen, &view);
+	pthread_rwlock_unlock(&dblock);
+
+	if (req->error != DB_OK) {
+		req->vlen = 0;
+		return;
+	}
+
+	/* the view pin the record, no lock needed to copy it */
+	memcpy(req->val, view.val, view.vlen < req->vlen ? view.vlen : req->vlen);
+	req->vlen = view.vlen;
+	req->meta = view.meta;
+	db_view_release(&view);
+}
+
+/*
+ * the batch under one read lock, a record in memory is read in place,
+ * the others overlap in io_uring
+ */
+void
+mget(worker_t *w, const int n)
+{
+	int i;
+
+	if (n == 1) {
+		get_one(w, &w->mget[0]);
+		return;
+	}
+
+	pthread_rwlock_rdlock(&dblock);
+	for (i = 0; i < n; i++) {
+		w->mget[i].error = DB_SYS_ERROR;
+		db_aget(&w->aio, &w->mget[i]);
+	}
+	while (db_aio_next(&w->aio, 1) != NULL)
+		;
+	pthread_rwlock_unlock(&dblock);
+}
+
+/*
+ * get and gets k1 ... kN, answered in key order a batch at a time,
+ * c->part keep where to go on when the output fill up
+ */
+int
+command_mget(conn_t *c, token_t *tok, char *line, const int linelen,
+	const int gets)
+{
+	worker_t *w   = c->w;
+	sbuf_t   *out = &c->out;
+
+	int i;
+	int n;
+	int reply;
+
+	char *p;
+	char *end;
+	char *next;
+
+	db_aget_t *req;
+
+	end = line + linelen - 2;	/* \r\n */
+	p   = c->part ? line + c->part : tok[1].buf;
+
+	while (p < end) {
+		for (n = 0, next = p; n < MGET_BATCH && next < end; n++) {
+			while (next < end && *next == ' ')
+				next++;
+			if (next == end)
+				break;
+
+			req = &w->mget[n];
+			req->key  = next;
+			req->val  = w->valbuf + n * MGET_VALUE;
+			req->vlen = MGET_VALUE;
+
+			if ((next = memchr(next, ' ', end - next)) == NULL)
+				next = end;
+			req->klen = next - (char *)req->key;
+		}
+		mget(w, n);
+
+		for (i = 0; i < n; i++) {
+			int       big;
+			db_view_t view;
+
+			req   = &w->mget[i];
+			reply = reply_hit(c, req, req->klen + RESPONSE_MIN, &view, &big);
+			if (reply != HANDLE_FINISH) {
+				c->part = (char *)req->key - line;
+				return reply;
+			}
+
+			STAT_ADD(w, cmd_get, 1);
+			if (req->error != DB_OK) {
+				STAT_ADD(w, get_misses, 1);
+				continue;
+			}
+			STAT_ADD(w, get_hits, 1);
+
+			out->len += sprintf(out->buf + out->len, "VALUE %.*s %u %u",
+				(int)req->klen, (char *)req->key, req->meta.flags,
+				req->vlen);
+			if (gets)
+				out->len += sprintf(out->buf + out->len, " %llu",
+					(unsigned long long)req->meta.cas);
+			out->len += sprintf(out->buf + out->len, "\r\n");
+
+			if (reply_value(c, req, &view, big) == -1)
+				return HANDLE_CLOSE;
+			out->len += sprintf(out->buf + out->len, "\r\n");
+		}
+		p = next;
+	}
+
+	if ((reply = reply_reserve(c, RESPONSE_MIN, 0)) != HANDLE_FINISH) {
+		c->part = end - line;
+		return reply;
+	}
+	out->len += sprintf(out->buf + out->len, "END\r\n");
+	c->part = 0;
+
+	return HANDLE_FINISH;
+}
+
+int
+command_get(conn_t *c, token_t *tok, int ntok, char *line, int *len)
+{
+	return command_mget(c, tok, line, *len, 0);
+}
+
+int
+command_gets(conn_t *c, token_t *tok, int ntok, char *line, int *len)
+{
+	return command_mget(c, tok, line, *len, 1);
+}
+
+/*
+ * set, add, replace, append and prepend key flags exptime bytes,
+ * cas key flags exptime bytes version, the value follow the line
+ */
+int
+command_store(conn_t *c, token_t *tok, int ntok, char *line, int *len,
+	const int mode)
+{
+	worker_t *w   = c->w;
+	sbuf_t   *in  = &c->in;
+	sbuf_t   *out = &c->out;
+
+	int error;
+	int reply;
+	int buflen;
+
+	long        t;
+	uint64_t    flags;
+	uint64_t    vlen;
+	uint64_t    cas;
+	char       *val;
+	const char *res;
+	db_meta_t   meta;
+
+	if (token_u64(&tok[2], UINT32_MAX, &flags) == -1 ||
+	    token_long(&tok[3], &t) == -1 ||
+	    token_u64(&tok[4], INBUF_MAX, &vlen) == -1 ||
+	    (mode == DB_STORE_CAS && token_u64(&tok[5], UINT64_MAX, &cas) == -1) ||
+	    (int64_t)*len + vlen + 2 > INBUF_MAX)
+	{
+		fprintf(stderr, "db-server: socket %d bad %.*s\n", c->fd,
+			tok[0].len, tok[0].buf);
+
+		return HANDLE_CLOSE;
+	}
+
+	buflen = in->buf + in->len - line;
+	if ((int64_t)*len + vlen + 2 > buflen) {
+		/* the whole value at once, not doubling up to it */
+		if (line == in->buf)
+			sbuf_reserve(&w->slab, in, (int64_t)*len + vlen + 2 - buflen,
+				INBUF_MAX);
+		return HANDLE_NEEDMOREIN;
+	}
+
+	val = line + *len;
+	if (val[vlen] != '\r' || val[vlen + 1] != '\n') {
+		fprintf(stderr, "db-server: socket %d bad data chunk\n", c->fd);
+
+		return HANDLE_CLOSE;
+	}
+
+	if ((reply = reply_reserve(c, RESPONSE_MIN, 0)) != HANDLE_FINISH)
+		return reply;
+
+	meta.flags  = flags;
+	meta.expire = exptime(t);
+	meta.cas    = mode == DB_STORE_CAS ? cas : 0;
+
+	write_lock();
+	error = db_store(w->db, mode, tok[1].buf, tok[1].len, val, vlen, &meta);
+	write_unlock();
+
+	STAT_ADD(w, cmd_set, 1);
+	switch (error) {
+	case DB_OK:
+		res = "STORED";
+		break;
+	case DB_EXISTS:
+		res = mode == DB_STORE_CAS ? "EXISTS" : "NOT_STORED";
+		break;
+	case DB_ERROR:
+		if (mode == DB_STORE_CAS) {
+			res = "NOT_FOUND";
+			break;
+		}
+		res = mode == DB_STORE_SET ? "ERROR" : "NOT_STORED";
+		break;
+	default:
+		res = "ERROR";
+		break;
+	}
+	out->len += sprintf(out->buf + out->len, "%s\r\n", res);
+	*len += vlen + 2;
+
+	return HANDLE_FINISH;
+}
+
+int
+command_set(conn_t *c, token_t *tok, int ntok, char *line, int *len)
+{
+	return command_store(c, tok, ntok, line, len, DB_STORE_SET);
+}
+
+int
+command_add(conn_t *c, token_t *tok, int ntok, char *line, int *len)
+{
+	return command_store(c, tok, ntok, line, len, DB_STORE_ADD);
+}
+
+int
+command_replace(conn_t *c, token_t *tok, int ntok, char *line, int *len)
+{
+	return command_store(c, tok, ntok, line, len, DB_STORE_REPLACE);
+}
+
+int
+command_append(conn_t *c, token_t *tok, int ntok, char *line, int *len)
+{
+	return command_store(c, tok, ntok, line, len, DB_STORE_APPEND);
+}
+
+int
+command_prepend(conn_t *c, token_t *tok, int ntok, char *line, int *len)
+{
+	return command_store(c, tok, ntok, line, len, DB_STORE_PREPEND);
+}
+
+int
+command_cas(conn_t *c, token_t *tok, int ntok, char *line, int *len)
+{
+	return command_store(c, tok, ntok, line, len, DB_STORE_CAS);
+}
+
+/* incr and decr key delta, the new value back */
+int
+command_delta(conn_t *c, token_t *tok, int ntok, const int decr)
+{
+	worker_t *w   = c->w;
+	sbuf_t   *out = &c->out;
+
+	int      error;
+	int      reply;
+	uint64_t delta;
+	uint64_t value;
+
+	if ((reply = reply_reserve(c, RESPONSE_MIN, 0)) != HANDLE_FINISH)
+		return reply;
+
+	if (token_u64(&tok[2], UINT64_MAX, &delta) == -1) {
+		out->len += sprintf(out->buf + out->len,
+			"CLIENT_ERROR invalid numeric delta argument\r\n");
+		return HANDLE_FINISH;
+	}
+
+	write_lock();
+	if (decr)
+		error = db_decr(w->db, tok[1].buf, tok[1].len, delta, &value, NULL);
+	else
+		error = db_incr(w->db, tok[1].buf, tok[1].len, delta, &value, NULL);
+	write_unlock();
+
+	STAT_ADD(w, cmd_set, 1);
+	switch (error) {
+	case DB_OK:
+		out->len += sprintf(out->buf + out->len, "%llu\r\n",
+			(unsigned long long)value);
+		break;
+	case DB_ERROR:
+		out->len += sprintf(out->buf + out->len, "NOT_FOUND\r\n");
+		break;
+	case DB_EXISTS:
+		out->len += sprintf(out->buf + out->len, "CLIENT_ERROR "
+			"cannot increment or decrement non-numeric value\r\n");
+		break;
+	default:
+		out->len += sprintf(out->buf + out->len, "ERROR\r\n");
+		break;
+	}
+
+	return HANDLE_FINISH;
+}
+
+int
+command_incr(conn_t *c, token_t *tok, int ntok, char *line, int *len)
+{
+	return command_delta(c, tok, ntok, 0);
+}
+
+int
+command_decr(conn_t *c, token_t *tok, int ntok, char *line, int *len)
+{
+	return command_delta(c, tok, ntok, 1);
+}
+
+/*
+ * db_del write a tombstone for any key and return DB_OK, look the key
+ * up first so a missing one is DB_ERROR, DB_SYS_ERROR failed
+ */
+int
+delete_key(db_t *db, const void *key, const uint32_t klen)
+{
+	int       error;
+	db_view_t view;
+
+	write_lock();
+	if ((error = db_view(db, key, klen, &view)) == DB_OK) {
+		db_view_release(&view);
+		error = db_del(db, key, klen);
+	}
+	write_unlock();
+
+	return error;
+}
+
+int
+command_delete(conn_t *c, token_t *tok, int ntok, char *line, int *len)
+{
+	worker_t *w   = c->w;
+	sbuf_t   *out = &c->out;
+
+	int error;
+	int reply;
+
+	if ((reply = reply_reserve(c, RESPONSE_MIN, 0)) != HANDLE_FINISH)
+		return reply;
+
+	error = delete_key(w->db, tok[1].buf, tok[1].len);
+
+	STAT_ADD(w, cmd_delete, 1);
+	if (error == DB_OK) {
+		out->len += sprintf(out->buf + out->len, "DELETED\r\n");
+	} else if (error == DB_ERROR) {
+		out->len += sprintf(out->buf + out->len, "NOT_FOUND\r\n");
+	} else {
+		out->len += sprintf(out->buf + out->len,
+			"SERVER_ERROR delete failed\r\n");
+	}
+
+	return HANDLE_FINISH;
+}
+
+int
+command_stats(conn_t *c, token_t *tok, int ntok, char *line, int *len)
+{
+	int reply;
+
+	reply = reply_reserve(c, (nworkers + 1) * STATS_LINES * RESPONSE_MIN, 0);
+	if (reply != HANDLE_FINISH)
+		return reply;
+
+	c->out.len += stats(&c->out);
+
+	return HANDLE_FINISH;
+}
+
+/* name length is compared first, most lookups are one memcmp */
+static const command_t commands[] = {
+	{"get",     3, 2, 0, command_get},
+	{"gets",    4, 2, 0, command_gets},
+	{"set",     3, 5, 1, command_set},
+	{"add",     3, 5, 1, command_add},
+	{"replace", 7, 5, 1, command_replace},
+	{"append",  6, 5, 1, command_append},
+	{"prepend", 7, 5, 1, command_prepend},
+	{"cas",     3, 6, 1, command_cas},
+	{"incr",    4, 3, 1, command_incr},
+	{"decr",    4, 3, 1, command_decr},
+	{"delete",  6, 2, 1, command_delete},
+	{"stats",   5, 1, 0, command_stats},
+	{NULL,      0, 0, 0, NULL}
+};
+
+const command_t *
+command_find(const token_t *tok)
+{
+	const command_t *cmd;
+
+	for (cmd = commands; cmd->name != NULL; cmd++) {
+		if (cmd->len == tok->len && memcmp(cmd->name, tok->buf, tok->len) == 0)
+			return cmd;
+	}
+	return NULL;
+}
+
+/* memcached binary protocol, the header is network order on the wire */
+void
+bin_parse(const char *buf, bin_header_t *h)
+{
+	memcpy(h, buf, BIN_HEADER);
+
+	h->klen   = ntohs(h->klen);
+	h->status = ntohs(h->status);
+	h->blen   = ntohl(h->blen);
+	h->opaque = ntohl(h->opaque);
+	h->cas    = be64toh(h->cas);
+}
+
+/* the response header for req, extlen + klen + vlen bytes of body follow */
+void
+bin_response(sbuf_t *out, const bin_header_t *req, const uint16_t status,
+	const uint64_t cas, const uint8_t extlen, const uint16_t klen,
+	const uint32_t vlen)
+{
+	bin_header_t h;
+
+	memset(&h, 0, sizeof(h));
+	h.magic  = BIN_RES;
+	h.opcode = req->opcode;
+	h.klen   = htons(klen);
+	h.extlen = extlen;
+	h.status = htons(status);
+	h.blen   = htonl(extlen + klen + vlen);
+	h.opaque = htonl(req->opaque);	/* already host order */
+	h.cas    = htobe64(cas);
+
+	memcpy(out->buf + out->len, &h, BIN_HEADER);
+	out->len += BIN_HEADER;
+}
+
+/* a bare response, or none for a quiet request that went fine */
+int
+bin_status(conn_t *c, const bin_header_t *req, const uint16_t status,
+	const int quiet)
+{
+	int reply;
+
+	if (quiet && status == BIN_OK)
+		return HANDLE_FINISH;
+
+	if ((reply = reply_reserve(c, BIN_HEADER, 0)) != HANDLE_FINISH)
+		return reply;
+
+	bin_response(&c->out, req, status, 0, 0, 0, 0);
+
+	return HANDLE_FINISH;
+}
+
+int
+bin_getop(const uint8_t opcode)
+{
+	return opcode == BIN_GET  || opcode == BIN_GETQ ||
+	       opcode == BIN_GETK || opcode == BIN_GETKQ;
+}
+
+/*
+ * a run of get, getk, getq and getkq in the input is one batched
+ * lookup, like a text multi-get, answered and consumed in order.
+ * the quiet ones say nothing on a miss, clients end the run with noop
+ */
+int
+bin_get(conn_t *c)
+{
+	worker_t *w   = c->w;
+	sbuf_t   *in  = &c->in;
+	sbuf_t   *out = &c->out;
+
+	int i;
+	int n;
+	int off;
+	int reply;
+
+	db_aget_t   *req;
+	bin_header_t h[MGET_BATCH];
+
+	for (n = 0, off = in->off; n < MGET_BATCH && in->len - off >= BIN_HEADER; n++) {
+		bin_parse(in->buf + off, &h[n]);
+
+		if (h[n].magic != BIN_REQ || !bin_getop(h[n].opcode) ||
+		    h[n].extlen != 0 || h[n].klen == 0 || h[n].klen != h[n].blen ||
+		    in->len - off < BIN_HEADER + (int64_t)h[n].blen)
+		{
+			break;
+		}
+
+		req = &w->mget[n];
+		req->key  = in->buf + off + BIN_HEADER;
+		req->klen = h[n].klen;
+		req->val  = w->valbuf + n * MGET_VALUE;
+		req->vlen = MGET_VALUE;
+
+		off += BIN_HEADER + h[n].blen;
+	}
+
+	/* the first one is not a plain get, a bad request */
+	if (n == 0) {
+		bin_parse(in->buf + in->off, &h[0]);
+		if ((reply = bin_status(c, &h[0], BIN_EINVAL, 0)) == HANDLE_FINISH)
+			in->off += BIN_HEADER + h[0].blen;
+		return reply;
+	}
+
+	mget(w, n);
+
+	for (i = 0; i < n; i++) {
+		int       big;
+		int       klen;
+		uint32_t  flags;
+		db_view_t view;
+
+		req  = &w->mget[i];
+		klen = (h[i].opcode == BIN_GETK || h[i].opcode == BIN_GETKQ) ?
+			req->klen : 0;
+
+		reply = reply_hit(c, req, BIN_HEADER + BIN_GET_EXTRAS + klen,
+			&view, &big);
+		if (reply != HANDLE_FINISH)
+			return reply;
+
+		STAT_ADD(w, cmd_get, 1);
+		if (req->error != DB_OK) {
+			STAT_ADD(w, get_misses, 1);
+
+			if (h[i].opcode == BIN_GETQ || h[i].opcode == BIN_GETKQ) {
+				in->off += BIN_HEADER + h[i].blen;
+				continue;
+			}
+			if ((reply = reply_reserve(c, BIN_HEADER + klen, 0)) != HANDLE_FINISH)
+				return reply;
+
+			bin_response(out, &h[i], BIN_NOT_FOUND, 0, 0, klen, 0);
+			memcpy(out->buf + out->len, req->key, klen);
+			out->len += klen;
+
+			in->off += BIN_HEADER + h[i].blen;
+			continue;
+		}
+		STAT_ADD(w, get_hits, 1);
+
+		flags = htonl(req->meta.flags);
+		bin_response(out, &h[i], BIN_OK, req->meta.cas, BIN_GET_EXTRAS,
+			klen, req->vlen);
+		memcpy(out->buf + out->len, &flags, BIN_GET_EXTRAS);
+		out->len += BIN_GET_EXTRAS;
+		memcpy(out->buf + out->len, req->key, klen);
+		out->len += klen;
+
+		if (reply_value(c, req, &view, big) == -1)
+			return HANDLE_CLOSE;
+
+		in->off += BIN_HEADER + h[i].blen;
+	}
+
+	return HANDLE_FINISH;
+}
+
+/* db_store mode of a binary storage opcode, -1 not one */
+int
+bin_storeop(const bin_header_t *h, int *quiet)
+{
+	*quiet = 0;
+	switch (h->opcode) {
+	case BIN_SETQ:
+		*quiet = 1;
+		/* fall through */
+	case BIN_SET:
+		return h->cas != 0 ? DB_STORE_CAS : DB_STORE_SET;
+	case BIN_ADDQ:
+		*quiet = 1;
+		/* fall through */
+	case BIN_ADD:
+		return DB_STORE_ADD;
+	case BIN_REPLACEQ:
+		*quiet = 1;
+		/* fall through */
+	case BIN_REPLACE:
+		return h->cas != 0 ? DB_STORE_CAS : DB_STORE_REPLACE;
+	case BIN_APPENDQ:
+		*quiet = 1;
+		/* fall through */
+	case BIN_APPEND:
+		return DB_STORE_APPEND;
+	case BIN_PREPENDQ:
+		*quiet = 1;
+		/* fall through */
+	case BIN_PREPEND:
+		return DB_STORE_PREPEND;
+	}
+	return -1;
+}
+
+/*
+ * set, add, replace and the quiet ones, extras are flags and exptime,
+ * append and prepend have none.  a cas in the header make set and
+ * replace a compare and swap, the new version is in the answer
+ */
+int
+bin_store(conn_t *c, const bin_header_t *h, char *body)
+{
+	worker_t *w = c->w;
+
+	int       mode;
+	int       quiet;
+	int       error;
+	int       reply;
+	int       status;
+	int       extlen;
+	uint32_t  ext[2];
+	uint32_t  vlen;
+	db_meta_t meta;
+
+	mode   = bin_storeop(h, &quiet);
+	extlen = (mode == DB_STORE_APPEND || mode == DB_STORE_PREPEND) ?
+		0 : BIN_SET_EXTRAS;
+	if (h->extlen != extlen || h->klen == 0 ||
+	    h->blen < (uint32_t)h->extlen + h->klen)
+	{
+		return bin_status(c, h, BIN_EINVAL, 0);
+	}
+
+	/* no room for the answer, nothing done yet */
+	if ((reply = reply_reserve(c, BIN_HEADER, 0)) != HANDLE_FINISH)
+		return reply;
+
+	memset(&meta, 0, sizeof(meta));
+	if (extlen != 0) {
+		memcpy(ext, body, sizeof(ext));
+		meta.flags  = ntohl(ext[0]);
+		meta.expire = exptime(ntohl(ext[1]));
+	}
+	meta.cas = h->cas;
+
+	vlen = h->blen - h->extlen - h->klen;
+
+	write_lock();
+	error = db_store(w->db, mode, body + h->extlen, h->klen,
+		body + h->extlen + h->klen, vlen, &meta);
+	write_unlock();
+
+	STAT_ADD(w, cmd_set, 1);
+	switch (error) {
+	case DB_OK:
+		if (quiet)
+			return HANDLE_FINISH;
+		bin_response(&c->out, h, BIN_OK, meta.cas, 0, 0, 0);
+		return HANDLE_FINISH;
+	case DB_EXISTS:
+		status = BIN_EXISTS;
+		break;
+	case DB_ERROR:
+		status = mode == DB_STORE_REPLACE || mode == DB_STORE_CAS ?
+			BIN_NOT_FOUND : BIN_NOT_STORED;
+		break;
+	default:
+		status = BIN_NOT_STORED;
+		break;
+	}
+
+	return bin_status(c, h, status, 0);
+}
+
+/*
+ * increment and decrement, extras are delta, initial and exptime.
+ * a missing key is created with initial unless exptime is all ones
+ */
+int
+bin_delta(conn_t *c, const bin_header_t *h, char *body)
+{
+	worker_t *w = c->w;
+
+	int       n;
+	int       decr;
+	int       quiet;
+	int       error;
+	int       reply;
+	uint64_t  delta;
+	uint64_t  value;
+	uint32_t  expire;
+	char      num[24];
+	db_meta_t meta;
+
+	decr  = h->opcode == BIN_DECR || h->opcode == BIN_DECRQ;
+	quiet = h->opcode == BIN_INCRQ || h->opcode == BIN_DECRQ;
+	if (h->extlen != BIN_INCR_EXTRAS || h->klen == 0 ||
+	    h->blen != (uint32_t)h->extlen + h->klen)
+	{
+		return bin_status(c, h, BIN_EINVAL, 0);
+	}
+
+	if ((reply = reply_reserve(c, BIN_HEADER + sizeof(value), 0)) != HANDLE_FINISH)
+		return reply;
+
+	memcpy(&delta, body, sizeof(delta));
+	memcpy(&value, body + 8, sizeof(value));
+	memcpy(&expire, body + 16, sizeof(expire));
+	delta  = be64toh(delta);
+	value  = be64toh(value);
+	expire = ntohl(expire);
+
+	write_lock();
+	if (decr)
+		error = db_decr(w->db, body + h->extlen, h->klen, delta, &value, &meta);
+	else
+		error = db_incr(w->db, body + h->extlen, h->klen, delta, &value, &meta);
+
+	if (error == DB_ERROR && expire != BIN_INCR_NONE) {
+		n = sprintf(num, "%llu", (unsigned long long)value);
+		memset(&meta, 0, sizeof(meta));
+		meta.expire = exptime(expire);
+		error = db_store(w->db, DB_STORE_ADD, body + h->extlen, h->klen,
+			num, n, &meta);
+	}
+	write_unlock();
+
+	STAT_ADD(w, cmd_set, 1);
+	switch (error) {
+	case DB_OK:
+		break;
+	case DB_ERROR:
+		return bin_status(c, h, BIN_NOT_FOUND, 0);
+	case DB_EXISTS:
+		return bin_status(c, h, BIN_BAD_DELTA, 0);
+	default:
+		return bin_status(c, h, BIN_NOT_STORED, 0);
+	}
+
+	if (quiet)
+		return HANDLE_FINISH;
+	value = htobe64(value);
+	bin_response(&c->out, h, BIN_OK, meta.cas, 0, 0, sizeof(value));
+	memcpy(c->out.buf + c->out.len, &value, sizeof(value));
+	c->out.len += sizeof(value);
+
+	return HANDLE_FINISH;
+}
+
+int
+bin_delete(conn_t *c, const bin_header_t *h, char *body)
+{
+	worker_t *w = c->w;
+
+	int error;
+	int reply;
+
+	if (h->extlen != 0 || h->klen == 0 || h->blen != h->klen)
+		return bin_status(c, h, BIN_EINVAL, 0);
+
+	if ((reply = reply_reserve(c, BIN_HEADER, 0)) != HANDLE_FINISH)
+		return reply;
+
+	error = delete_key(w->db, body, h->klen);
+
+	STAT_ADD(w, cmd_delete, 1);
+
+	return bin_status(c, h, error == DB_OK ? BIN_OK :
+		error == DB_ERROR ? BIN_NOT_FOUND : BIN_EINTERNAL,
+		h->opcode == BIN_DELETEQ);
+}
+
+/* one binary request at in->off, a get run take the ones after it too */
+int
+command_binary(conn_t *c)
+{
+	sbuf_t *in = &c->in;
+
+	int   reply;
+	int   buflen;
+	char *body;
+
+	bin_header_t h;
+
+	buflen = in->len - in->off;
+	if (buflen < BIN_HEADER)
+		return HANDLE_NEEDMOREIN;
+
+	bin_parse(in->buf + in->off, &h);
+	if (h.magic != BIN_REQ || BIN_HEADER + (int64_t)h.blen > INBUF_MAX) {
+		fprintf(stderr, "db-server: socket %d malformed request\n", c->fd);
+
+		return HANDLE_CLOSE;
+	}
+
+	if (BIN_HEADER + (int64_t)h.blen > buflen) {
+		/* the whole body at once, not doubling up to it */
+		if (in->off == 0)
+			sbuf_reserve(&c->w->slab, in, BIN_HEADER + h.blen - buflen,
+				INBUF_MAX);
+		return HANDLE_NEEDMOREIN;
+	}
+	body = in->buf + in->off + BIN_HEADER;
+
+	switch (h.opcode) {
+	case BIN_GET:
+	case BIN_GETQ:
+	case BIN_GETK:
+	case BIN_GETKQ:
+		return bin_get(c);	/* it consume what it answer */
+	case BIN_SET:
+	case BIN_SETQ:
+	case BIN_ADD:
+	case BIN_ADDQ:
+	case BIN_REPLACE:
+	case BIN_REPLACEQ:
+	case BIN_APPEND:
+	case BIN_APPENDQ:
+	case BIN_PREPEND:
+	case BIN_PREPENDQ:
+		reply = bin_store(c, &h, body);
+		break;
+	case BIN_INCR:
+	case BIN_INCRQ:
+	case BIN_DECR:
+	case BIN_DECRQ:
+		reply = bin_delta(c, &h, body);
+		break;
+	case BIN_DELETE:
+	case BIN_DELETEQ:
+		reply = bin_delete(c, &h, body);
+		break;
+	case BIN_NOOP:
+		reply = bin_status(c, &h, BIN_OK, 0);
+		break;
+	default:
+		reply = bin_status(c, &h, BIN_UNKNOWN, 0);
+		break;
+	}
+
+	if (reply == HANDLE_FINISH)
+		in->off += BIN_HEADER + h.blen;
+
+	return reply;
 }
 
+/* one command at in->off, consumed only when it is answered */
 int
-argparse(const char *buf, const ssize_t buflen,
-	int *argc, char argv[][ARGV_MAX], const int max)
+command(conn_t *c)
 {
-	int i;
+	sbuf_t *in = &c->in;
 
-	int p;
-	int c;
+	int   len;
+	int   ntok;
+	int   reply;
+	int   outlen;
+	char *line;
+
+	token_t          tok[TOKEN_MAX];
+	const command_t *cmd;
+
+	/* the first byte of a connection tell the protocol */
+	if (c->proto == PROTO_UNKNOWN) {
+		c->proto = ((uint8_t)in->buf[in->off] == BIN_REQ) ?
+			PROTO_BINARY : PROTO_TEXT;
+	}
+	if (c->proto == PROTO_BINARY)
+		return command_binary(c);
 
-	int arg;
-	int len;
+	line = in->buf + in->off;
+	if ((len = tokenize(line, in->len - in->off, &c->scan, tok, &ntok)) == 0)
+		return HANDLE_NEEDMOREIN;	/* no whole line yet */
 
-	assert(buflen > 0);
-
-	p   = 0;
-	arg = 0;
-	len = 0;
-	for (i = 0; i < buflen; i++) {
-		c = buf[i];
-
-		if (len + 1 > ARGV_MAX) 	/* 1 for '\0' */
-			goto err;
-
-		switch (c) {
-		case '\n':
-			if (p != '\r')
-				goto err;
-			goto out;
-		case '\r':
-		case ' ':
-			memcpy(argv[arg], buf + i - len, len);
-			argv[arg][len] = '\0';
-			if (arg == max)
-				goto out;
-
-			len  = 0;
-			arg += 1;;
-			break;
-		default:
-			len++;
-		}
+	if (len == -1 || ntok < 1 ||
+	    (cmd = command_find(&tok[0])) == NULL || ntok < cmd->ntok)
+	{
+		fprintf(stderr, "db-server: socket %d malformed request\n", c->fd);
 
-		p = c;
+		return HANDLE_CLOSE;
 	}
 
-	return 0;
-out:
-	*argc = arg;
-	return (i + 1);
-err:
-	return -1;
+	/* noreply, the command run but its answer is taken back */
+	outlen = c->out.len;
+	if ((reply = cmd->fn(c, tok, ntok, line, &len)) != HANDLE_FINISH)
+		return reply;
+	if (cmd->noreply && ntok > cmd->ntok &&
+	    tok[ntok - 1].len == 7 && memcmp(tok[ntok - 1].buf, "noreply", 7) == 0)
+	{
+		c->out.len = outlen;
+	}
+
+	in->off += len;
+	c->scan  = 0;
+
+	return HANDLE_FINISH;
 }
 
+/*
+ * every complete command in the input, the responses queue up in the
+ * output and go in one send, a partial command wait for the next recv.
+ * edge triggered, so recv until the socket is empty.
+ */
 int
-handle(const int fd, db_t *db, sbuf_t *in, sbuf_t *out)
+handle(conn_t *c)
 {
+	worker_t *w  = c->w;
+	sbuf_t   *in = &c->in;
+
+	const int fd = c->fd;
+
 	ssize_t err;
 	ssize_t len;
 
-	char *key;
-        uint32_t klen;
-	uint32_t vlen;
+	int cmd;
+	int more;
+	int gone;
 
-	int  argc;
-	int  arglen;
-	char argv[ARGC_MAX][ARGV_MAX];
-
-	if ((err = sbuf_recv(fd, in, &len)) <= 0 && len == 0) {
-		if (err == -1) {
-			fprintf(stdout, "db-server: socket %d recv %s\n", fd, strerror(errno));
-		}
-		return HANDLE_CLOSE;
-	}
+	more = 1;
+	gone = 0;
+	for (;;) {
+		cmd = HANDLE_NEEDMOREIN;
+		while (in->off < in->len &&
+		       (cmd = command(c)) == HANDLE_FINISH)
+			;
 
-	arglen = argparse(in->buf, in->len, &argc, argv, ARGC_MAX);
-	if (argc < 1 || arglen == -1) {
-		fprintf(stderr, "db-server: socket %d malformed request\n", fd);
+		if (cmd == HANDLE_CLOSE)
+			return HANDLE_CLOSE;
 
-		return HANDLE_CLOSE;
-	}
+		if (conn_pending(c)) {
+			if ((err = conn_send(c, &len)) <= 0 && len == 0) {
+				if (err == -1) {
+					fprintf(stdout, "db-server: socket %d send %s\n", fd, strerror(errno));
+				}
+				return HANDLE_CLOSE;
+			}
+			STAT_ADD(w, bytes_written, len);
 
-	if (strcmp(argv[0], "set") == 0 && argc >= 5) {
-		key  = argv[1];
-		klen = strlen(key);
+			if (conn_pending(c)) {
+				return HANDLE_NEEDMOREOUT;
+			}
+			conn_sent(c);
 
-		vlen = atoi(argv[4]);
-		if (vlen + arglen > in->max) {
-			fprintf(stderr, "db-server: socket %d too large value\n", fd);
+			/* output was full, go on with the rest of the input */
+			if (cmd == HANDLE_NEEDMOREOUT)
+				continue;
+		}
 
+		/* peer gone, everything it sent is answered */
+		if (gone)
 			return HANDLE_CLOSE;
-		}
 
-		if (vlen + arglen > in->len) {
-			return HANDLE_NEEDMOREIN;
-		}
+		if (!more)
+			break;
 
-		if (db_put(db, key, klen, in->buf + arglen, vlen) == DB_OK) {
-			out->len = sprintf(out->buf, "STORED\r\n");
-		} else {
-			out->len = sprintf(out->buf, "ERROR\r\n");
-		}
-	} else if (strcmp(argv[0], "get") == 0 && argc >= 2) {
-		key  = argv[1];
-		klen = strlen(key);
+		/* a partial command filling the buffer, double it */
+		sbuf_compact(in);
+		if (in->len == in->max &&
+		    sbuf_reserve(&w->slab, in, in->max > 0 ? in->max : 1, INBUF_MAX) == -1)
+		{
+			fprintf(stderr, "db-server: socket %d too large request\n", fd);
 
-		if ((vlen = db_get(db, key, klen, valbuf, VALBUF_LEN)) != 0) {
-			if (vlen > VALBUF_LEN)
-				return HANDLE_CLOSE;
+			return HANDLE_CLOSE;
+		}
 
-			out->len = snprintf(out->buf, out->max,
-			                  "VALUE %.*s %d %d\r\n%.*s\r\nEND\r\n",
-			                  klen, key, 0, vlen, vlen, valbuf);
-		} else {
-			out->len = sprintf(out->buf, "END\r\n");
+		if ((err = sbuf_recv(fd, in, &len)) == -1 && len == 0) {
+			fprintf(stdout, "db-server: socket %d recv %s\n", fd, strerror(errno));
 		}
-	} else if (strcmp(argv[0], "delete") == 0 && argc >= 2) {
-		key  = argv[1];
-		klen = strlen(key);
+		STAT_ADD(w, bytes_read, len);
 
-		if ((db_del(db, key, klen)) != 0) {
-			out->len = snprintf(out->buf, out->max, "DELETED\r\n");
-		} else {
-			out->len = snprintf(out->buf, out->max, "NOT_FOUND\r\n");
-                }
-        } else {
-		return HANDLE_CLOSE;
-	}
+		gone = (err <= 0);
+		more = (in->len == in->max);	/* stopped full, maybe more */
 
-	if ((err = sbuf_send(fd, out, &len)) <= 0 && len == 0) {
-		if (err == -1) {
-			fprintf(stdout, "db-server: socket %d send %s\n", fd, strerror(errno));
-		}
-		return HANDLE_CLOSE;
+		if (len == 0 && !gone)
+			break;
 	}
 
-	if (out->off < out->len) {
-		return HANDLE_NEEDMOREOUT;
-	}
+	sbuf_compact(in);
 
-	return HANDLE_FINISH;
+	return in->len == 0 ? HANDLE_FINISH : HANDLE_NEEDMOREIN;
 }
 
-int
-handle_write(const int fd, fd_set *readfds, fd_set *writefds)
+/* give the buffers back to the slab, unpin what was not sent */
+void
+conn_release(conn_t *c)
 {
-	sbuf_t *in;
-	sbuf_t *out;
+	worker_t *w = c->w;
 
-	ssize_t err;
-	ssize_t len;
+	conn_sent(c);
+	free(c->zref);
+	c->zref    = NULL;
+	c->maxzref = 0;
 
-	in  = &conn[fd].in;
-	out = &conn[fd].out;
+	if (c->in.buf != NULL)
+		slab_free(&w->slab, c->in.buf, c->in.max);
+	if (c->out.buf != NULL)
+		slab_free(&w->slab, c->out.buf, c->out.max);
 
-	if (out->buf == NULL || out->len == 0 || out->off >= out->len) {
-		FD_CLR(fd, writefds);
+	sbuf_release(&c->in);
+	sbuf_release(&c->out);
+}
 
-		return 0;
-	}
+/* close drop the fd from epoll too */
+void
+conn_close(conn_t *c)
+{
+	fprintf(stdout, "db-server: socket %d close\n", c->fd);
+
+	STAT_ADD(c->w, curr_connections, -1);
+	conn_release(c);
+	close(c->fd);
+	free(c);
+}
 
-	if ((err = sbuf_send(fd, out, &len)) <= 0 && len == 0) {
-		FD_CLR(fd, writefds);
+int handle_read(conn_t *c);
 
+int
+handle_write(conn_t *c)
+{
+	ssize_t err;
+	ssize_t len;
+
+	if (!conn_pending(c))
 		return 0;
-	}
-	if (out->off == out->len) {
-		inbuf  = in->buf;
-		outbuf = out->buf;
 
-		sbuf_release(in);
-		sbuf_release(out);
+	if ((err = conn_send(c, &len)) <= 0 && len == 0)
+		return -1;
+	STAT_ADD(c->w, bytes_written, len);
+
+	/* responses out, go on with the input left and what came meanwhile */
+	if (!conn_pending(c)) {
+		conn_sent(c);
+		return handle_read(c);
 	}
 	return 0;
 }
 
 int
-handle_read(const int fd, db_t *db, fd_set *readfds, fd_set *writefds)
+handle_read(conn_t *c)
 {
+	worker_t *w = c->w;
+
 	sbuf_t *in;
 	sbuf_t *out;
 
 	ssize_t err;
 
-	in  = &conn[fd].in;
-	out = &conn[fd].out;
-
-	if (in->buf == NULL) {
-		if (inbuf == NULL) {
-			inbuf = malloc(INBUF_LEN);
-		}
-		sbuf_allocate(in, inbuf, INBUF_LEN);
-
-		inbuf = NULL;
-	}
-	if (out->buf == NULL) {
-		if (outbuf == NULL) {
-			outbuf = malloc(OUTBUF_LEN);
-		}
-		sbuf_allocate(out, outbuf, OUTBUF_LEN);
+	in  = &c->in;
+	out = &c->out;
 
-		outbuf = NULL;
-	}
+	/* one batch of responses at a time, EPOLLOUT bring us back */
+	if (conn_pending(c))
+		return 0;
 
-	err = handle(fd, db, in, out);
+	/* the buffers come from the slab as the bytes do */
+	err = handle(c);
 
 	if (err == HANDLE_FINISH) {
-		if (inbuf == NULL) {
-			inbuf   = in->buf;
-			in->buf = NULL;
-		}
-		if (outbuf == NULL) {
-			outbuf   = out->buf;
-			out->buf = NULL;
-		}
-
-		free(in->buf);
-		free(out->buf);
-
-		sbuf_release(in);
-		sbuf_release(out);
+		conn_release(c);
 
 		return 0;
 	}
 
 	if (err == HANDLE_NEEDMOREIN) {
-		return 0; /* do nothing */
+		/* partial command kept, in a buffer its size */
+		sbuf_shrink(&w->slab, in);
+		sbuf_shrink(&w->slab, out);
+
+		return 0;
 	}
 
 	if (err == HANDLE_NEEDMOREOUT) {
-		FD_SET(fd, writefds);	/* writer buf full need write event */
+		sbuf_shrink(&w->slab, in);
 
-		return 0; /* do nothing */
+		return 0; /* socket full, wait EPOLLOUT */
 	}
 
 	if (err == HANDLE_CLOSE) {
-		fprintf(stdout, "db-server: socket %d close\n", fd);
-
-		if (inbuf == NULL) {
-			inbuf   = in->buf;
-			in->buf = NULL;
-		}
-		if (outbuf == NULL) {
-			outbuf   = out->buf;
-			out->buf = NULL;
-		}
-
-		free(in->buf);
-		free(out->buf);
-
-		sbuf_release(in);
-		sbuf_release(out);
-
-		close(fd);
-		FD_CLR(fd, readfds);
-		FD_CLR(fd, writefds);
-
 		return -1;
 	}
 
 	return 0;
 }
 
-int
-handle_accept(const int fd, fd_set *readfds, fd_set *writefds)
+/* NULL when no more to accept */
+conn_t *
+handle_accept(worker_t *w)
 {
+	const int fd = w->socketfd;
+
 	ss_t addr;
 	sl_t addrlen;
 	char addrstr[INET6_ADDRSTRLEN];
 	int  acceptfd;
 
-	void *in_addr;
+	void   *in_addr;
+	conn_t *c;
+
+	struct epoll_event ev;
 
 	addrlen  = sizeof(addr);
 	acceptfd = accept(fd, (sa_t *)&addr, &addrlen);
 
 	if (acceptfd == -1) {
-		fprintf(stdout, "db-server: accept: %s\n", strerror(errno));
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			fprintf(stdout, "db-server: accept: %s\n", strerror(errno));
 
-		return -1;
+		return NULL;
 	}
 
-	if (acceptfd >= FD_SETSIZE) {
-		fprintf(stdout, "db-server: socket %d closed,can't take more fd\n", fd);
+	if (fcntl(acceptfd, F_SETFL, O_NONBLOCK) == -1) {
+		fprintf(stdout, "db-server: socket %d fcntl NONBLOCK: %s\n", fd, strerror(errno));
 
 		close(acceptfd);
 
-		return -1;
+		return NULL;
 	}
 
+	if ((c = calloc(1, sizeof(conn_t))) == NULL) {
+		fprintf(stdout, "db-server: socket %d out of memory\n", acceptfd);
 
-	if (fcntl(acceptfd, F_SETFL, O_NONBLOCK) == -1) {
-		fprintf(stdout, "db-server: socket %d fcntl NONBLOCK: %s\n", fd, strerror(errno));
+		close(acceptfd);
+
+		return NULL;
+	}
+	c->fd = acceptfd;
+	c->w  = w;
+
+	/* edge triggered, both ways once, no epoll_ctl per request */
+	ev.events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = c;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, acceptfd, &ev) == -1) {
+		fprintf(stdout, "db-server: socket %d epoll_ctl: %s\n", acceptfd, strerror(errno));
 
 		close(acceptfd);
+		free(c);
 
-		return -1;
+		return NULL;
 	}
 
 	if (addr.ss_family == AF_INET) {
@@ -434,43 +1911,24 @@ handle_accept(const int fd, fd_set *readfds, fd_set *writefds)
 	if (inet_ntop(addr.ss_family, in_addr, addrstr, sizeof(addrstr)) == NULL) {
 		fprintf(stdout, "db-server: socket %d unknown address family\n", fd);
 	}
-	printf("db-server: new connection from %s on socket %d\n", addrstr, acceptfd);
+	printf("db-server: new connection from %s on socket %d thread %d\n",
+		addrstr, acceptfd, w->id);
 
-	FD_SET(acceptfd, readfds);
+	STAT_ADD(w, curr_connections, 1);
+	STAT_ADD(w, total_connections, 1);
 
-	return acceptfd;
+	return c;
 }
 
+/* every thread bind its own socket to the port, the kernel spread accepts */
 int
-main(int argc, char *argv[])
+listen_socket(void)
 {
 	int err;
-	int nfds;
 	int socketfd;
 
-        db_t db;
-        db_option_t option;
-
-	fd_set readfds;
-	fd_set writefds;
-
-	char *dbfilename;
-	char *idxfilename;
-
 	struct addrinfo hints, *ai, *p;
 
-	if (argc == 2) {
-		dbfilename  = argv[1];
-		idxfilename = NULL;
-	} else if (argc != 3) {
-		dbfilename  = argv[1];
-		idxfilename = argv[2];
-	} else {
-		fprintf(stderr, "usage: %s dbfile [indexfile]\n", argv[0]);
-
-		return 0;
-	}
-
 	memset(&hints, 0, sizeof(hints));
 	
 	hints.ai_family   = AF_UNSPEC;
@@ -480,7 +1938,7 @@ main(int argc, char *argv[])
 	if ((err = getaddrinfo(NULL, PORT, &hints, &ai)) != 0) {
 		fprintf(stderr, "db-server: getaddrinfo: %s\n", gai_strerror(err));
 
-		exit(1);
+		return -1;
 	}
 
 	for (p = ai; p != NULL; p = p->ai_next) {
@@ -488,19 +1946,31 @@ main(int argc, char *argv[])
 
 		socketfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
 		if (socketfd == -1) {
-			fprintf(stderr, "db-server: socket: %s\n", gai_strerror(err));
+			fprintf(stderr, "db-server: socket: %s\n", strerror(errno));
 
 			continue;
 		}
 		if (fcntl(socketfd, F_SETFL, O_NONBLOCK) == -1) {
 			fprintf(stderr, "db-server: fcntl NONBLOCK: %s\n", strerror(errno));
 
+			close(socketfd);
+
 			continue;
 		}
 
 		if (setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) == -1) {
 			fprintf(stderr, "db-server: setsockopt REUSEADDR: %s\n", strerror(errno));
 
+			close(socketfd);
+
+			continue;
+		}
+
+		if (setsockopt(socketfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) == -1) {
+			fprintf(stderr, "db-server: setsockopt REUSEPORT: %s\n", strerror(errno));
+
+			close(socketfd);
+
 			continue;
 		}
 
@@ -514,93 +1984,342 @@ main(int argc, char *argv[])
 		break;
 	}
 
+	freeaddrinfo(ai);
+
 	if (p == NULL) {
 		fprintf(stderr, "db-server: failed to bind: %s\n", PORT);
-		exit(1);
+
+		return -1;
 	}
 
-	freeaddrinfo(ai);
+	if (listen(socketfd, SOMAXCONN) == -1) {
+		fprintf(stderr, "db-server: listen: %s\n", strerror(errno));
+
+		close(socketfd);
+
+		return -1;
+	}
+
+	return socketfd;
+}
+
+int
+worker_open(worker_t *w, const int id, db_t *db)
+{
+	struct epoll_event ev;
+
+	memset(w, 0, sizeof(*w));
+	w->id = id;
+	w->db = db;
+
+	if ((w->socketfd = listen_socket()) == -1)
+		return -1;
+
+	if ((w->epfd = epoll_create1(0)) == -1) {
+		fprintf(stderr, "db-server: epoll_create: %s\n", strerror(errno));
+
+		return -1;
+	}
+
+	/* data.ptr NULL is the listener */
+	ev.events   = EPOLLIN | EPOLLET;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->socketfd, &ev) == -1) {
+		fprintf(stderr, "db-server: epoll_ctl: %s\n", strerror(errno));
+
+		return -1;
+	}
+
+	w->valbuf = malloc(MGET_BUF);
+	db_aio_open(db, &w->aio, MGET_BATCH);
+	if (w->valbuf == NULL) {
+		fprintf(stderr, "db-server: out of memory\n");
+
+		return -1;
+	}
+
+	return 0;
+}
+
+void *
+worker_run(void *arg)
+{
+	worker_t *w = arg;
+
+	struct epoll_event *events;
+
+	events = malloc(EVENT_MAX * sizeof(struct epoll_event));
+
+	for (;;) {
+		int i;
+		int n;
+
+		if ((n = epoll_wait(w->epfd, events, EVENT_MAX, 1000)) == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "db-server: epoll_wait: %s\n", strerror(errno));
+
+			exit(1);
+		}
+
+		for (i = 0; i < n; i++) {
+			conn_t  *c    = events[i].data.ptr;
+			uint32_t what = events[i].events;
+
+			/* edge triggered, accept until the backlog is empty */
+			if (c == NULL) {
+				while (handle_accept(w) != NULL)
+					;
+				continue;
+			}
+
+			if ((what & EPOLLOUT) && handle_write(c) == -1) {
+				conn_close(c);
+				continue;
+			}
+
+			if ((what & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) &&
+			    handle_read(c) == -1)
+			{
+				conn_close(c);
+				continue;
+			}
+
+			/* peer gone, its edge won't come again, close once answered */
+			if ((what & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) &&
+			    !conn_pending(c))
+			{
+				conn_close(c);
+			}
+		}
+	}
+	free(events);
+
+	return NULL;
+}
+
+/*
+ * maintenance thread, file growth and table resize are done ahead of
+ * the sets a slice at a time.  a resize rehash under the read lock a
+ * few slots at a time, a set wait for one slice at most and db_put
+ * copy it to the new array too.  a rehash not done is kept for the
+ * next time round.  a set that outrun the thread still grow the
+ * files, or finish the rehash of its full table, itself in db_put,
+ * so rs is only read under the lock.
+ * reap a slice every time round, the dead keys are found under the
+ * read lock and only dropped under the write lock.  sync with the
+ * lock held only to pin the files, the msync run beside the workers
+ */
+void *
+maint_run(void *arg)
+{
+	db_t *db = arg;
+
+	int         i;
+	int         busy;
+	int         error;
+	int         pending;
+	uint64_t    left;
+	time_t      now;
+	time_t      synced;
+	db_sync_t   sync;
+	db_reap_t   reap;
+	db_resize_t rs;
+
+	struct timespec ts;
+
+	pending = 0;
+	synced  = time(NULL);
+	for (;;) {
+		busy = DB_OK;
+		if (!pending) {
+			write_lock();
+			busy    = db_reserve(db, &rs, RESERVE_ROOM, RESERVE_TABLES);
+			pending = rs.len != 0;
+			write_unlock();
+		}
+
+		for (i = 0; i < RESERVE_SLICES && pending; i++) {
+			pthread_rwlock_rdlock(&dblock);
+			db_reserve_fill(db, &rs, RESERVE_BUCKETS);
+			pending = rs.len != 0;
+			left    = rs.left;
+			pthread_rwlock_unlock(&dblock);
+
+			if (pending && left == 0) {
+				write_lock();
+				db_reserve_end(db, &rs);
+				pending = rs.len != 0;
+				write_unlock();
+			}
+		}
+
+		if (busy == DB_SYS_ERROR)
+			fprintf(stderr, "db-server: reserve failed\n");
+
+		/* expired and deleted keys, the data read beside the gets */
+		pthread_rwlock_rdlock(&dblock);
+		db_reap_find(db, &reap, REAP_BUCKETS, REAP_USEC);
+		pthread_rwlock_unlock(&dblock);
+
+		if (reap.n > 0) {
+			write_lock();
+			db_reap_drop(db, &reap);
+			write_unlock();
+		}
+
+		now = time(NULL);
+
+		if (syncsec > 0 && now - synced >= syncsec) {
+			synced = now;
+
+			write_lock();
+			error = db_sync_begin(db, &sync);
+			write_unlock();
+
+			if (error == DB_OK)
+				error = db_sync_end(&sync);
+			if (error != DB_OK)
+				fprintf(stderr, "db-server: sync failed\n");
+		}
+
+		ts.tv_sec  = 0;
+		ts.tv_nsec = busy == DB_OK ? MAINT_BUSY : MAINT_IDLE;
+		nanosleep(&ts, NULL);
+	}
+
+	return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int i;
+
+        db_t db;
+        db_option_t option;
+
+	struct rlimit rl;
+
+	pthread_rwlockattr_t attr;
+	pthread_t            maint;
+
+	char *dbfilename;
+	char *idxfilename;
 
+	int      opt;
+	int      threads;
+	uint64_t memory;
+	uint64_t cache;
+
+	static struct option longopts[] = {
+		{"memory",  required_argument, NULL, 'm'},
+		{"cache",   required_argument, NULL, 'c'},
+		{"threads", required_argument, NULL, 't'},
+		{"sync",    required_argument, NULL, 's'},
+		{NULL, 0, NULL, 0}
+	};
+
+	memory  = 0;
+	cache   = 0;
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	syncsec = 1;
+	while ((opt = getopt_long(argc, argv, "m:c:t:s:", longopts, NULL)) != -1) {
+		switch (opt) {
+		case 'm':
+			memory = (uint64_t)atoi(optarg) << 20;
+			break;
+		case 'c':
+			cache = (uint64_t)atoi(optarg) << 20;
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 's':
+			syncsec = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (argc - optind == 1) {
+		dbfilename  = argv[optind];
+		idxfilename = NULL;
+	} else if (argc - optind == 2) {
+		dbfilename  = argv[optind];
+		idxfilename = argv[optind + 1];
+	} else {
+usage:
+		fprintf(stderr, "usage: %s [-m memory MB] [-c cache MB] "
+			"[-t threads] [-s sync seconds, 0 never] "
+			"dbfile [indexfile]\n", argv[0]);
+
+		return 0;
+	}
+	if (threads < 1)
+		threads = 1;
+
+        memset(&option, 0, sizeof(option));
         option.table  = 256;
         option.bucket = 256;
         option.rdonly = 0;
+        option.warmup = sysconf(_SC_NPROCESSORS_ONLN);
+        option.memory = memory;
+        option.cache  = cache;
+        option.expire = 1;	/* new db, keep memcached flags and exptime */
+        option.cas    = 1;	/* and a version for gets and cas */
         if (db_open(&db, dbfilename, idxfilename, &option) != DB_OK) {
                 fprintf(stderr, "db-server: open db %s failed\n", dbfilename);
 
                 exit(0);
         }
 
-	if (listen(socketfd, 32) == -1) {
-		fprintf(stderr, "db-server: listen: %s\n", strerror(errno));
-
-		exit(1);
+	/* a connection is a fd, take all the kernel let us */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
 	}
 
-	FD_ZERO(&readfds);
-	FD_ZERO(&writefds);
-
-	nfds = socketfd;
-	FD_SET(socketfd, &readfds);
+	/* a steady stream of gets must not starve a set */
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,
+		PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&dblock, &attr);
+	pthread_rwlockattr_destroy(&attr);
 
-	inbuf  = malloc(INBUF_LEN);
-	outbuf = malloc(OUTBUF_LEN);
-	valbuf = malloc(VALBUF_LEN);
+	if ((workers = calloc(threads, sizeof(worker_t))) == NULL) {
+		fprintf(stderr, "db-server: out of memory\n");
 
-	for (;;) {
-		int n;
-		int fd;
-		fd_set readfds_;
-		fd_set writefds_;
+		exit(1);
+	}
+	for (i = 0; i < threads; i++) {
+		if (worker_open(&workers[i], i, &db) == -1)
+			exit(1);
+	}
+	nworkers = threads;
 
-		FD_ZERO(&readfds_);
-		FD_ZERO(&writefds_);
+	if (pthread_create(&maint, NULL, maint_run, &db) != 0) {
+		fprintf(stderr, "db-server: pthread_create failed\n");
 
-#ifdef LINUX
-		memcpy(&readfds_, &readfds, sizeof(readfds));
-		memcpy(&writefds_, &writefds, sizeof(writefds));
-#else
-		FD_COPY(&readfds, &readfds_);
-		FD_COPY(&writefds, &writefds_);
-#endif
+		exit(1);
+	}
 
-		if ((n = select(nfds + 1, &readfds_, &writefds_, NULL, NULL)) == -1) {
-			fprintf(stderr, "db-server: select: %s\n", strerror(errno));
+	/* the main thread is worker 0 */
+	for (i = 1; i < threads; i++) {
+		if (pthread_create(&workers[i].tid, NULL, worker_run, &workers[i]) != 0) {
+			fprintf(stderr, "db-server: pthread_create failed\n");
 
 			exit(1);
 		}
+	}
+	worker_run(&workers[0]);
 
-		for (fd = 0; fd <= nfds && n > 0; fd++) {
-			if (FD_ISSET(fd, &writefds_)) {
-				n--;
-				handle_write(fd, &readfds, &writefds);
-			}
+	for (i = 1; i < threads; i++)
+		pthread_join(workers[i].tid, NULL);
 
-			if (FD_ISSET(fd, &readfds_)) {
-				n--;
-				if (fd == socketfd) {
-					int acceptfd;
-
-					acceptfd = handle_accept(fd, &readfds, &writefds);
-					if (acceptfd > nfds) {
-						nfds = acceptfd;
-					}
-				} else {
-					err = handle_read(fd, &db, &readfds, &writefds);
-					if (err == -1 && fd >= nfds) {
-						nfds = fd;
-						while (FD_ISSET(nfds, &readfds)  == 0 &&
-						       FD_ISSET(nfds, &writefds) == 0)
-						{
-							nfds--;
-						}
-					}
-				}
-			}
-		}
-	}
-	free(inbuf);
-	free(outbuf);
-	free(valbuf);
+	pthread_rwlock_destroy(&dblock);
+	db_close(&db);
 
 	return 0;
 }
@@ -18,6 +18,7 @@ main(int argc, char *argv[])
 		return 0;
 	}
 
+        memset(&option, 0, sizeof(option));
         option.rdonly = 1;
 	if (db_open(&db, argv[1], argv[2], &option) != DB_OK) {
 		fprintf(stderr, "open db %s failed\n", argv[1]);
@@ -36,6 +37,7 @@ main(int argc, char *argv[])
         printf("db_bucket_total: %llu\n", (long long int)stat.db_bucket_total);
         printf("db_bucket_size: %llu\n",  (long long int)stat.db_bucket_size);
         printf("db_data_size: %llu\n",    (long long int)stat.db_data_size);
+        printf("db_resident_size: %llu\n", (long long int)stat.db_resident_size);
 	
 	db_close(&db);
 
@@ -5,39 +5,76 @@
 
 #include "db.h"
 #include "hash.h"
+#include "pool.h"
+#include "uring.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <assert.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 
 #define DB_MAGIC	0x00004244
 #define DB_MAGIC_INDEX	0x58494244
 #define DB_MAGIC_DATA	0x54444244
-#define DB_VERSION	2
+#define DB_VERSION	5		/* 3 add header flags, 4 cache, 5 cas */
+#define DB_VERSION_MIN	2
 
-#define PAGE_ALIGN(ptr,pgsz)	\
-	((char *)(ptr) - (((char *)(ptr) - (char *)NULL) & ((pgsz) - 1)))
+/* bucket off top bit, read since the cache hand passed, cache mode */
+#define DB_BUCKET_REF	(UINT64_C(1) << 63)
 
-static int
-db_file_open(db_file_t *file, const char *filename, int rdonly)
-{
-	if (rdonly)
-		file->fd = open(filename, O_RDONLY, 0644);
-	else
-		file->fd = open(filename, O_RDWR | O_CREAT, 0644);
+#define DB_POOL_SIZE	(1 << 26)	/* 64MB default buffer pool */
 
-	if (file->fd == -1)
-		return DB_SYS_ERROR;
+#define DB_LOAD		50		/* bucket array load %		*/
+#define DB_LOAD_MAX	90		/* linear probe need empty slots */
+#define DB_GROWTH	200		/* bucket array growth %	*/
+#define DB_FILE_STEP	(UINT64_C(1) << 30)	/* file grow by 1GB past 1GB */
 
-	file->rdonly = rdonly;
+#define DB_REGION_SHIFT	20		/* 1MB memory budget region */
+#define DB_REGION_SIZE	(UINT64_C(1) << DB_REGION_SHIFT)
 
-	return DB_OK;
-}
+#define DB_LOG_AHEAD_SHIFT	22	/* log scan read ahead 4MB */
+#define DB_LOG_AHEAD	(UINT64_C(1) << DB_LOG_AHEAD_SHIFT)
+
+enum {DB_REGION_RESIDENT = 1,		/* touched since release */
+      DB_REGION_REF      = 2,		/* touched since last sweep */
+      DB_REGION_PIN      = 4};		/* bucket arrays, keep it */
+
+#define PAGE_ALIGN(ptr,pgsz)	\
+	((char *)(ptr) - (((char *)(ptr) - (char *)NULL) & ((pgsz) - 1)))
+
+/* access pattern hints, every backend map them to its own call */
+enum {DB_FILE_ADVISE_NORMAL,
+      DB_FILE_ADVISE_RANDOM,
+      DB_FILE_ADVISE_SEQUENTIAL,
+      DB_FILE_ADVISE_WILLNEED,
+      DB_FILE_ADVISE_DONTNEED,
+      DB_FILE_ADVISE_HUGEPAGE,
+      DB_FILE_ADVISE_POPULATE,	/* fault in now, synchronous */
+      DB_FILE_ADVISE_COLD,	/* reclaim first under pressure */
+      DB_FILE_ADVISE_PAGEOUT};	/* reclaim now */
+
+/*
+ * storage backend, all file access goes through these
+ *
+ * mmap:  map the whole file, page cache controlled by the kernel
+ * pread: pread/pwrite through db_pool, memory bounded by the pool
+ */
+typedef struct db_file_ops {
+	int (*map)(db_file_t *file);	/* (re)load after file resize */
+	int (*read)(db_file_t *file, void *buf, off_t off, size_t len);
+	int (*write)(db_file_t *file, const void *buf, off_t off, size_t len);
+	int (*compare)(db_file_t *file, const void *buf, off_t off, size_t len);
+	int (*sync)(db_file_t *file, off_t off, size_t len);
+	int (*advise)(db_file_t *file, off_t off, size_t len, int advise);
+	int (*close)(db_file_t *file);
+} db_file_ops_t;
 
 static size_t
 db_file_size(db_file_t *file)
@@ -50,44 +87,196 @@ db_file_size(db_file_t *file)
 }
 
 static int
-db_file_resize(db_file_t *file, size_t size)
+db_mmap_advise(db_file_t *file, off_t off, size_t len, int advise);
+
+/*
+ * memory budget of the mmap backend
+ *
+ * the file is cut into regions, a region counts as resident from
+ * the first touch until we release it, it's an estimate of RSS.
+ * over budget, a clock sweep release regions not touched since
+ * the last sweep until we are back under 7/8 of the budget.
+ *
+ * reads run side by side (db-server read lock, scan and warm-up
+ * threads), so region bits and resident are atomic, and one reader
+ * at a time sweep, the others go on over budget.  the region table
+ * is only reallocated by a remap, which is a write and run alone.
+ */
+static void
+db_region_evict(db_file_t *file)
 {
-	assert(!file->rdonly);
+	uint64_t i;
+	uint64_t low;
+	uint8_t *region;
+	uint8_t  bits;
 
-	if (ftruncate(file->fd, size) == -1)
+	low = (file->budget - file->budget / 8) >> DB_REGION_SHIFT;
+
+	for (i = 0; i < file->region_len * 2 &&
+	     __atomic_load_n(&file->resident, __ATOMIC_RELAXED) > low; i++)
+	{
+		region = &file->region[file->region_hand];
+		file->region_hand = (file->region_hand + 1) % file->region_len;
+
+		bits = __atomic_load_n(region, __ATOMIC_RELAXED);
+		if (!(bits & DB_REGION_RESIDENT) || (bits & DB_REGION_PIN))
+			continue;
+		if (bits & DB_REGION_REF) {
+			__atomic_fetch_and(region, (uint8_t)~DB_REGION_REF,
+				__ATOMIC_RELAXED);
+			continue;
+		}
+
+		/* a touch in between set REF, the region stay */
+		if (!__atomic_compare_exchange_n(region, &bits,
+			(uint8_t)(bits & ~DB_REGION_RESIDENT), 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		{
+			continue;
+		}
+		__atomic_sub_fetch(&file->resident, 1, __ATOMIC_RELAXED);
+
+		db_mmap_advise(file, (region - file->region) << DB_REGION_SHIFT,
+			DB_REGION_SIZE, DB_FILE_ADVISE_PAGEOUT);
+	}
+}
+
+static void
+db_region_touch(db_file_t *file, uint64_t off, size_t len)
+{
+	uint64_t i;
+	uint8_t  bits;
+
+	for (i = off >> DB_REGION_SHIFT;
+	     i <= (off + len - 1) >> DB_REGION_SHIFT && i < file->region_len; i++)
+	{
+		/* a hot region is already marked, no locked write for it */
+		bits = __atomic_load_n(&file->region[i], __ATOMIC_RELAXED);
+		if ((bits & (DB_REGION_RESIDENT | DB_REGION_REF)) ==
+		    (DB_REGION_RESIDENT | DB_REGION_REF))
+		{
+			continue;
+		}
+
+		bits = __atomic_fetch_or(&file->region[i],
+			DB_REGION_RESIDENT | DB_REGION_REF, __ATOMIC_RELAXED);
+		if (!(bits & DB_REGION_RESIDENT))
+			__atomic_add_fetch(&file->resident, 1, __ATOMIC_RELAXED);
+	}
+
+	if ((__atomic_load_n(&file->resident, __ATOMIC_RELAXED) <<
+	     DB_REGION_SHIFT) <= file->budget)
+	{
+		return;
+	}
+	if (__atomic_exchange_n(&file->region_sweep, 1, __ATOMIC_ACQUIRE) == 0) {
+		db_region_evict(file);
+		__atomic_store_n(&file->region_sweep, 0, __ATOMIC_RELEASE);
+	}
+}
+
+static void
+db_region_pin(db_file_t *file, uint64_t off, size_t len)
+{
+	uint64_t i;
+
+	if (file->region == NULL || len == 0)
+		return;
+
+	for (i = off >> DB_REGION_SHIFT;
+	     i <= (off + len - 1) >> DB_REGION_SHIFT && i < file->region_len; i++)
+	{
+		__atomic_fetch_or(&file->region[i], DB_REGION_PIN,
+			__ATOMIC_RELAXED);
+	}
+}
+
+/* the regions wholly in the range, a region shared with a live array keep it */
+static void
+db_region_unpin(db_file_t *file, uint64_t off, size_t len)
+{
+	uint64_t i;
+
+	if (file->region == NULL)
+		return;
+
+	for (i = (off + DB_REGION_SIZE - 1) >> DB_REGION_SHIFT;
+	     (i + 1) << DB_REGION_SHIFT <= off + len && i < file->region_len; i++)
+	{
+		__atomic_fetch_and(&file->region[i], ~DB_REGION_PIN,
+			__ATOMIC_RELAXED);
+	}
+}
+
+/* region table follow the file size */
+static int
+db_region_resize(db_file_t *file)
+{
+	uint64_t len;
+	uint8_t *region;
+
+	len = (file->size + DB_REGION_SIZE - 1) >> DB_REGION_SHIFT;
+	if (len <= file->region_len)
+		return DB_OK;
+
+	if ((region = realloc(file->region, len)) == NULL)
 		return DB_SYS_ERROR;
+	memset(region + file->region_len, 0, len - file->region_len);
+
+	file->region     = region;
+	file->region_len = len;
+
 	return DB_OK;
 }
 
+/* views pin a mapping, a remap only drop the file reference */
+static void
+db_map_put(db_map_t *map)
+{
+	if (__atomic_sub_fetch(&map->ref, 1, __ATOMIC_ACQ_REL) == 0) {
+		munmap(map->buf, map->len);
+		free(map);
+	}
+}
+
 static int
-db_file_read(db_file_t *file, void *buf, off_t off, size_t len)
+db_mmap_read(db_file_t *file, void *buf, off_t off, size_t len)
 {
 	assert(off + len <= file->buflen);
 
+	if (file->region != NULL)
+		db_region_touch(file, off, len);
+
 	memcpy(buf, (uint8_t *)file->buf + off, len);
 	return len;
 }
 
 static int
-db_file_write(db_file_t *file, const void *buf, off_t off, size_t len)
+db_mmap_write(db_file_t *file, const void *buf, off_t off, size_t len)
 {
 	assert(!file->rdonly);
 	assert(off + len <= file->buflen);
 
+	if (file->region != NULL)
+		db_region_touch(file, off, len);
+
 	memcpy((uint8_t *)file->buf + off, buf, len);
 	return len;
 }
 
 static int
-db_file_compare(db_file_t *file, const void *buf, off_t off, size_t len)
+db_mmap_compare(db_file_t *file, const void *buf, off_t off, size_t len)
 {
 	assert(off + len <= file->buflen);
 
+	if (file->region != NULL)
+		db_region_touch(file, off, len);
+
 	return memcmp((uint8_t *)file->buf + off, buf, len);
 }
 
 static int 
-db_file_sync(db_file_t *file, off_t off, size_t len)
+db_mmap_sync(db_file_t *file, off_t off, size_t len)
 {
 	void *ptr;
 
@@ -102,20 +291,22 @@ db_file_sync(db_file_t *file, off_t off, size_t len)
 }
 
 static int
-db_file_mmap(db_file_t *file)
+db_mmap_map(db_file_t *file)
 {
 	int prot;
 	int flags;
+	db_map_t *map;
 
 	assert(file);
 
-	if (file->buf != NULL) {
-		int error;
-		if (!file->rdonly &&
-		    (error = db_file_sync(file, 0, file->buflen)) != DB_OK)
-			return error;
-		if (munmap(file->buf, file->buflen) == -1)
-			return DB_SYS_ERROR;
+	/*
+	 * the page cache is shared, the new mapping see every write,
+	 * no msync here, getting it to disk is db_sync and db_close
+	 */
+	if (file->map != NULL) {
+		db_map_put(file->map);
+		file->map = NULL;
+		file->buf = NULL;
 	}
 
 	file->size = db_file_size(file);
@@ -127,9 +318,18 @@ db_file_mmap(db_file_t *file)
 		prot  = PROT_READ | PROT_WRITE;
 		flags = MAP_SHARED;
 	}
-	file->buf = mmap(NULL, file->size, prot, flags, file->fd, 0);
-	if (file->buf == MAP_FAILED)
+	if ((map = malloc(sizeof(db_map_t))) == NULL)
 		return DB_SYS_ERROR;
+	map->buf = mmap(NULL, file->size, prot, flags, file->fd, 0);
+	if (map->buf == MAP_FAILED) {
+		free(map);
+		return DB_SYS_ERROR;
+	}
+	map->len = file->size;
+	map->ref = 1;
+
+	file->map    = map;
+	file->buf    = map->buf;
 	file->buflen = file->size;
 
 	file->header = file->buf;
@@ -137,199 +337,725 @@ db_file_mmap(db_file_t *file)
 	return DB_OK;
 }
 
-enum {DB_FILE_ADVISE_UNLIKELY = MADV_WILLNEED,
-      DB_FILE_ADVISE_LIKELY   = MADV_WILLNEED};
-
 static int
-db_file_advise(db_file_t *file, off_t off, size_t len, int advise)
+db_mmap_advise(db_file_t *file, off_t off, size_t len, int advise)
 {
-	void *ptr;
+	char *ptr;
+	char *end;
+	int   how;
 
 	ptr = PAGE_ALIGN((uint8_t *)file->buf + off, file->pgsz);
-	if (madvise(PAGE_ALIGN(ptr, file->pgsz), len, advise) == -1)
+	end = (char *)file->buf + off + len;
+	if (end > (char *)file->buf + file->buflen)
+		end = (char *)file->buf + file->buflen;
+	if (end <= ptr)
+		return DB_OK;
+
+	switch (advise) {
+	case DB_FILE_ADVISE_NORMAL:	how = MADV_NORMAL;	break;
+	case DB_FILE_ADVISE_RANDOM:	how = MADV_RANDOM;	break;
+	case DB_FILE_ADVISE_SEQUENTIAL:	how = MADV_SEQUENTIAL;	break;
+	case DB_FILE_ADVISE_WILLNEED:	how = MADV_WILLNEED;	break;
+	case DB_FILE_ADVISE_DONTNEED:	how = MADV_DONTNEED;	break;
+	case DB_FILE_ADVISE_COLD:
+#ifdef MADV_COLD
+		how = MADV_COLD;
+		break;
+#else
+		return DB_OK;
+#endif
+	case DB_FILE_ADVISE_PAGEOUT:
+#ifdef MADV_PAGEOUT
+		if (madvise(ptr, end - ptr, MADV_PAGEOUT) == 0)
+			return DB_OK;
+#endif
+		how = MADV_DONTNEED;	/* at least leave our RSS */
+		break;
+	case DB_FILE_ADVISE_HUGEPAGE:
+#ifdef MADV_HUGEPAGE
+		how = MADV_HUGEPAGE;
+		break;
+#else
+		return DB_OK;
+#endif
+	case DB_FILE_ADVISE_POPULATE:
+#ifdef MADV_POPULATE_READ
+		if (madvise(ptr, end - ptr, MADV_POPULATE_READ) == 0)
+			return DB_OK;
+#endif
+		/* old kernel, touch every page */
+		for (; ptr < end; ptr += file->pgsz)
+			*(volatile char *)ptr;
+		return DB_OK;
+	default:
+		return DB_ERROR;
+	}
+
+	if (madvise(ptr, end - ptr, how) == -1)
 		return DB_SYS_ERROR;
 	return DB_OK;
 }
 
-#define db_file_likely(file,off,len)	\
-	db_file_advise((file), (off), (len), DB_FILE_ADVISE_LIKELY)
-
-#define db_file_unlikely(file,off,len)	\
-	db_file_advise((file), (off), (len), DB_FILE_ADVISE_LIKELY)
-
+/*
+ * 1 if every page of the range is in the page cache, so a read of
+ * the mapping won't wait for the disk.  a region we touched answer
+ * without a syscall, else mincore, a long range is not asked
+ */
+#define DB_RESIDENT_PAGES	16
 
-static uint64_t
-db_file_alloc(db_file_t *file, uint64_t len)
+static int
+db_mmap_resident(db_file_t *file, uint64_t off, size_t len)
 {
-	int error;
-	uint64_t off; 
-
-	assert(!file->rdonly);
-
-	if ((file->header->data_tail + len) > file->size) {
+	size_t         i;
+	size_t         n;
+	char          *ptr;
+	char          *end;
+	unsigned char  vec[DB_RESIDENT_PAGES];
+
+	if (file->region != NULL) {
+		for (i = off >> DB_REGION_SHIFT;
+		     i <= (off + len - 1) >> DB_REGION_SHIFT &&
+		     i < file->region_len; i++)
+		{
+			if (!(__atomic_load_n(&file->region[i], __ATOMIC_RELAXED) &
+			      DB_REGION_RESIDENT))
+			{
+				break;
+			}
+		}
+		if (i > (off + len - 1) >> DB_REGION_SHIFT)
+			return 1;
+	}
 
-		/* Changeable,time and space tradeoff */
-		size_t newsize = (file->header->data_tail + len) * 2;
+	ptr = PAGE_ALIGN((uint8_t *)file->buf + off, file->pgsz);
+	end = (char *)file->buf + off + len;
+	n   = (end - ptr + file->pgsz - 1) / file->pgsz;
+	if (n > DB_RESIDENT_PAGES || mincore(ptr, end - ptr, vec) == -1)
+		return 0;
 
-		if ((error = db_file_resize(file, newsize)) != DB_OK) {
-			file->db->db_error = error;
-			return 0;
-		}
-		if ((error = db_file_mmap(file)) != DB_OK) {
-			file->db->db_error = error;
+	for (i = 0; i < n; i++) {
+		if (!(vec[i] & 1))
 			return 0;
-		}
 	}
-
-	off = file->header->data_tail;
-	file->header->data_tail += len;
-	return off;
+	return 1;
 }
 
-static uint64_t
-db_file_calloc(db_file_t *file, uint64_t len)
+static int
+db_mmap_close(db_file_t *file)
 {
-	uint64_t off;
+        if (!file->rdonly && msync(file->buf, file->buflen, MS_SYNC) == -1)
+		return DB_SYS_ERROR;
 
-	off = db_file_alloc(file, len);
-	if (off != 0)
-		memset((uint8_t *)file->buf + off, 0, len);
+	db_map_put(file->map);
+	file->map = NULL;
 
-	return off;
+	free(file->region);
+	file->region = NULL;
+
+        if (close(file->fd) == -1)
+		return DB_SYS_ERROR;
+	return DB_OK;
 }
 
+static const db_file_ops_t db_mmap_ops = {
+	db_mmap_map,
+	db_mmap_read,
+	db_mmap_write,
+	db_mmap_compare,
+	db_mmap_sync,
+	db_mmap_advise,
+	db_mmap_close
+};
+
+/*
+ * pread backend keep the header in file->header_buf,
+ * it goes back to the pool before every flush
+ */
 static int
-db_file_init(db_file_t *file, size_t size)
+db_pread_read(db_file_t *file, void *buf, off_t off, size_t len)
 {
-	int error;
-
-	file->pgsz = sysconf(_SC_PAGESIZE);
-
-	if ((size > db_file_size(file)) && !file->rdonly)
-		if ((error = db_file_resize(file, size)) != DB_OK)
-			return error;
+	assert(off + len <= file->size);
 
-	if ((error = db_file_mmap(file)) != DB_OK)
-		return error;
-
-	return DB_OK;
+	if (db_pool_read(file->pool, file->fd, buf, off, len,
+				file->pin) != DB_OK)
+	{
+		memset(buf, 0, len);
+		file->db->db_error = DB_SYS_ERROR;
+	}
+	return len;
 }
 
 static int
-db_file_close(db_file_t *file)
+db_pread_write(db_file_t *file, const void *buf, off_t off, size_t len)
 {
-        if (!file->rdonly && msync(file->buf, file->buflen, MS_SYNC) == -1)
-		return DB_SYS_ERROR;
-
-        if (munmap(file->buf, file->buflen) == -1)
-		return DB_SYS_ERROR;
+	assert(!file->rdonly);
+	assert(off + len <= file->size);
 
-        if (close(file->fd) == -1)
-		return DB_SYS_ERROR;
-	return DB_OK;
+	if (db_pool_write(file->pool, file->fd, buf, off, len,
+				file->pin) != DB_OK)
+	{
+		file->db->db_error = DB_SYS_ERROR;
+	}
+	return len;
 }
 
 static int
-db_table_read(db_t *db, db_table_t *table, uint64_t off)
+db_pread_compare(db_file_t *file, const void *buf, off_t off, size_t len)
 {
-	return db_file_read(db->db_index, table,
-		db->db_index->header->table_off + off * sizeof(db_table_t),
-		sizeof(db_table_t));
+	assert(off + len <= file->size);
+
+	return db_pool_compare(file->pool, file->fd, buf, off, len, file->pin);
 }
 
-static int
-db_table_write(db_t *db, db_table_t *table, uint64_t off)
+static size_t
+db_header_size(const db_file_header_t *header)
 {
-	return db_file_write(db->db_index, table,
-		db->db_index->header->table_off + off * sizeof(db_table_t),
-		sizeof(db_table_t));
+	if (header->version < 3)
+		return offsetof(db_file_header_t, flags);
+	if (header->version < 4)
+		return offsetof(db_file_header_t, cache_size);
+	if (header->version < 5)
+		return offsetof(db_file_header_t, cas_next);
+	return sizeof(db_file_header_t);
 }
 
+/* header and dirty pool pages to the file, not the disk yet */
 static int
-db_bucket_read(db_t *db, db_table_t *table, db_bucket_t *bucket, uint64_t off)
+db_pread_flush(db_file_t *file)
 {
-	return db_file_read(db->db_index, bucket,
-		table->bucket_off + off * sizeof(db_bucket_t),
-		sizeof(db_bucket_t));
+	/* old header is shorter, the bytes after it are not ours */
+	if (db_pool_write(file->pool, file->fd, file->header, 0,
+				db_header_size(file->header), file->pin) != DB_OK)
+		return DB_SYS_ERROR;
+	if (db_pool_flush(file->pool, file->fd) != DB_OK)
+		return DB_SYS_ERROR;
+	return DB_OK;
 }
 
 static int
-db_bucket_write(db_t *db, db_table_t *table, db_bucket_t *bucket, uint64_t off)
+db_pread_sync(db_file_t *file, off_t off, size_t len)
 {
-	return db_file_write(db->db_index, bucket,
-		table->bucket_off + off * sizeof(db_bucket_t),
-		sizeof(db_bucket_t));
+	assert(!file->rdonly);
+
+	if (db_pread_flush(file) != DB_OK)
+		return DB_SYS_ERROR;
+	if (fdatasync(file->fd) == -1)
+		return DB_SYS_ERROR;
+	return DB_OK;
 }
 
 static int
-db_table_resize(db_t *db, uint64_t table_off, uint64_t bucket_per_table)
+db_pread_map(db_file_t *file)
 {
-	uint64_t i;
-	uint64_t off;
+	file->size   = db_file_size(file);
+	file->buflen = file->size;
 
-	uint32_t klen;
-	uint32_t vlen;
+	if (file->header == NULL) {
+		file->header = &file->header_buf;
+		if (db_pool_read(file->pool, file->fd, file->header, 0,
+				sizeof(db_file_header_t), file->pin) != DB_OK)
+			return DB_SYS_ERROR;
+	}
 
-	db_table_t old_table;
-	db_table_t new_table;
+	return DB_OK;
+}
 
-	vlen = bucket_per_table * sizeof(db_bucket_t);
-	off = db_file_calloc(db->db_index, vlen + sizeof(klen) + sizeof(vlen));
+static int
+db_pread_advise(db_file_t *file, off_t off, size_t len, int advise)
+{
+	int     how;
+	uint8_t buf[1 << 16];
+
+	switch (advise) {
+	case DB_FILE_ADVISE_NORMAL:	how = POSIX_FADV_NORMAL;	break;
+	case DB_FILE_ADVISE_RANDOM:	how = POSIX_FADV_RANDOM;	break;
+	case DB_FILE_ADVISE_SEQUENTIAL:	how = POSIX_FADV_SEQUENTIAL;	break;
+	case DB_FILE_ADVISE_WILLNEED:	how = POSIX_FADV_WILLNEED;	break;
+	case DB_FILE_ADVISE_DONTNEED:	how = POSIX_FADV_DONTNEED;	break;
+	case DB_FILE_ADVISE_HUGEPAGE:
+	case DB_FILE_ADVISE_COLD:
+	case DB_FILE_ADVISE_PAGEOUT:
+		return DB_OK;
+	case DB_FILE_ADVISE_POPULATE:
+		/* load into the pool, pinned if it is the index */
+		if (off + len > file->size)
+			len = file->size - off;
+		while (len > 0) {
+			size_t n = len < sizeof(buf) ? len : sizeof(buf);
+
+			if (db_pool_read(file->pool, file->fd, buf, off, n,
+						file->pin) != DB_OK)
+				return DB_SYS_ERROR;
+			off += n;
+			len -= n;
+		}
+		return DB_OK;
+	default:
+		return DB_ERROR;
+	}
 
-	if (off == 0)
+	if (posix_fadvise(file->fd, off, len, how) != 0)
 		return DB_SYS_ERROR;
+	return DB_OK;
+}
 
-	/* make db-data can expert data when single file */
-	/* just writer klen = 0, vlen = table size 	 */
-	klen = 0;
-	off += db_file_write(db->db_index, &klen, off, sizeof(klen));
-	off += db_file_write(db->db_index, &vlen, off, sizeof(vlen));
-
-	db_table_read(db, &old_table, table_off);
-
-	new_table.bucket_off = off;
-	new_table.bucket_key = old_table.bucket_key;
-	new_table.bucket_len = bucket_per_table;
+static int
+db_pread_close(db_file_t *file)
+{
+	if (!file->rdonly && db_pread_sync(file, 0, file->size) != DB_OK)
+		return DB_SYS_ERROR;
 
-	for (i = 0; i < old_table.bucket_len; i++) {
-		uint64_t j;
-		db_bucket_t bucket;
+        if (close(file->fd) == -1)
+		return DB_SYS_ERROR;
+	return DB_OK;
+}
 
-		db_bucket_read(db, &old_table, &bucket, i);
+static const db_file_ops_t db_pread_ops = {
+	db_pread_map,
+	db_pread_read,
+	db_pread_write,
+	db_pread_compare,
+	db_pread_sync,
+	db_pread_advise,
+	db_pread_close
+};
 
-		if (bucket.hash == 0)
-			continue;
+static int
+db_file_open(db_t *db, db_file_t *file, const char *filename,
+	const db_option_t *option)
+{
+	int flags;
 
-		for (j = bucket.hash % bucket_per_table;;
-		     j = (j + 1) % bucket_per_table)
-		{
-			db_bucket_t new_bucket;
+	if (option->rdonly)
+		flags = O_RDONLY;
+	else
+		flags = O_RDWR | O_CREAT;
 
-			db_bucket_read(db, &new_table, &new_bucket, j);
-			if (new_bucket.hash == 0) {
-				db_bucket_write(db, &new_table, &bucket, j);
-				break;
-			}
-		}
+	file->db   = db;
+	file->pgsz = sysconf(_SC_PAGESIZE);
+	file->step = option->step ? option->step : DB_FILE_STEP;
+
+	if (option->backend == DB_BACKEND_PREAD) {
+		file->ops  = &db_pread_ops;
+		file->pool = db->db_pool;
+#ifdef O_DIRECT
+		if (option->direct)
+			flags |= O_DIRECT;
+#endif
+	} else {
+		file->ops  = &db_mmap_ops;
 	}
 
-	db_table_write(db, &new_table, table_off);
+	file->fd = open(filename, flags, 0644);
+	if (file->fd == -1)
+		return DB_SYS_ERROR;
+
+	file->rdonly = option->rdonly;
 
 	return DB_OK;
 }
 
 static int
-db_index_init(db_t *db, uint64_t table, uint64_t bucket)
+db_file_resize(db_file_t *file, size_t size)
 {
-	uint64_t i;
-	uint64_t table_off;
-	assert(db && db->db_index->buf);
-
-        db->db_index->header->magic      = DB_MAGIC;
-        db->db_index->header->version    = DB_VERSION;
+	assert(!file->rdonly);
 
-	db->db_index->header->data_head  = sizeof(db_file_header_t);
-	db->db_index->header->data_tail  = db->db_index->buflen;
+	/* pool write back whole pages */
+	if (file->pool != NULL)
+		size = (size + file->pgsz - 1) & ~((size_t)file->pgsz - 1);
+
+	if (ftruncate(file->fd, size) == -1)
+		return DB_SYS_ERROR;
+	return DB_OK;
+}
+
+#define db_file_read(file,buf,off,len)	\
+	((file)->ops->read((file), (buf), (off), (len)))
+
+#define db_file_write(file,buf,off,len)	\
+	((file)->ops->write((file), (buf), (off), (len)))
+
+#define db_file_compare(file,buf,off,len)	\
+	((file)->ops->compare((file), (buf), (off), (len)))
+
+#define db_file_sync(file,off,len)	\
+	((file)->ops->sync((file), (off), (len)))
+
+#define db_file_close(file)	\
+	((file)->ops->close((file)))
+
+#define db_file_advise(file,off,len,how)	\
+	((file)->ops->advise((file), (off), (len), (how)))
+
+#define db_file_likely(file,off,len)	\
+	db_file_advise((file), (off), (len), DB_FILE_ADVISE_WILLNEED)
+
+#define db_file_unlikely(file,off,len)	\
+	db_file_advise((file), (off), (len), DB_FILE_ADVISE_DONTNEED)
+
+/*
+ * advice belong to the mapping, so set it again after every remap.
+ * data is hit at random, readahead just waste memory.
+ * index want all of it in memory, huge pages if the kernel can,
+ * only the grown tail is read ahead, the rest is resident already.
+ * single file mixin both, leave it to the kernel
+ */
+static int
+db_file_map(db_file_t *file)
+{
+	int error;
+	uint64_t old = file->size;
+
+	if ((error = file->ops->map(file)) != DB_OK)
+		return error;
+
+	if (file->budget > 0 && (error = db_region_resize(file)) != DB_OK)
+		return error;
+
+	if (file->db->db_index == file->db->db_data)
+		return DB_OK;
+
+	if (file->pin) {
+		if (file->size > old)
+			db_file_advise(file, old, file->size - old,
+				DB_FILE_ADVISE_WILLNEED);
+		db_file_advise(file, 0, file->size, DB_FILE_ADVISE_HUGEPAGE);
+	} else {
+		db_file_advise(file, 0, file->size, DB_FILE_ADVISE_RANDOM);
+	}
+
+	return DB_OK;
+}
+
+
+/* make the file at least need bytes, and no more than max if not 0 */
+static int
+db_file_grow(db_file_t *file, uint64_t need, uint64_t max)
+{
+	int error;
+	uint64_t newsize;
+
+	if (need <= file->size)
+		return DB_OK;
+
+	/* double small file, big file grow by step to bound the slack */
+	if (need < file->step)
+		newsize = need * 2;
+	else
+		newsize = (need / file->step + 1) * file->step;
+	if (max != 0 && newsize > max)
+		newsize = max;
+
+	if ((error = db_file_resize(file, newsize)) != DB_OK) {
+		file->db->db_error = error;
+		return error;
+	}
+	if ((error = db_file_map(file)) != DB_OK) {
+		file->db->db_error = error;
+		return error;
+	}
+
+	return DB_OK;
+}
+
+static uint64_t
+db_file_alloc(db_file_t *file, uint64_t len)
+{
+	uint64_t off; 
+
+	assert(!file->rdonly);
+
+	if (db_file_grow(file, file->header->data_tail + len, 0) != DB_OK)
+		return 0;
+
+	off = file->header->data_tail;
+	file->header->data_tail += len;
+	return off;
+}
+
+static uint64_t
+db_file_calloc(db_file_t *file, uint64_t len)
+{
+	uint64_t i;
+	uint64_t off;
+	static const uint8_t zero[4096];
+
+	off = db_file_alloc(file, len);
+	if (off == 0)
+		return 0;
+
+	for (i = 0; i < len; i += sizeof(zero)) {
+		db_file_write(file, zero, off + i,
+			len - i < sizeof(zero) ? len - i : sizeof(zero));
+	}
+
+	return off;
+}
+
+static int
+db_file_init(db_file_t *file, size_t size)
+{
+	int error;
+
+	if ((size > db_file_size(file)) && !file->rdonly)
+		if ((error = db_file_resize(file, size)) != DB_OK)
+			return error;
+
+	if ((error = db_file_map(file)) != DB_OK)
+		return error;
+
+	return DB_OK;
+}
+
+/* version 2 header has no flags field */
+static uint64_t
+db_file_flags(db_file_t *file)
+{
+	return file->header->version < 3 ? 0 : file->header->flags;
+}
+
+/*
+ * murmur3 fmix64 is a bijection, so in an intkey db equal hash is
+ * equal key, + 1 so only UINT64_MAX (not 0) map to the empty hash 0.
+ * 0 is returned for a key the db can't hold.
+ */
+static uint64_t
+db_key_hash(db_t *db, const void *key, uint32_t klen)
+{
+	uint64_t k;
+
+	if (!(db->db_flags & DB_FLAG_INTKEY))
+		return db_hash(key, klen);
+
+	if (klen != sizeof(k))
+		return 0;
+	memcpy(&k, key, sizeof(k));
+
+	k += 1;
+	k ^= k >> 33;
+	k *= UINT64_C(0xff51afd7ed558ccd);
+	k ^= k >> 33;
+	k *= UINT64_C(0xc4ceb9fe1a85ec53);
+	k ^= k >> 33;
+	return k;
+}
+
+/* 1 if the record at off hold key, intkey db already know from the hash */
+static int
+db_key_equal(db_t *db, uint64_t off, const void *key, uint32_t klen)
+{
+	if (db->db_flags & DB_FLAG_INTKEY)
+		return 1;
+
+	if (db_file_compare(db->db_data, &klen, off, sizeof(klen)) != 0)
+		return 0;
+	off += sizeof(klen) + sizeof(uint32_t);
+	return db_file_compare(db->db_data, key, off, klen) == 0;
+}
+
+/*
+ * first probe slot, the low bits of the hash already picked the table
+ * and bucket_len is a multiple of the table count, so version 2 index
+ * crowd every key of a table in 1/table_len of its slots
+ */
+static uint64_t
+db_bucket_slot(db_t *db, uint64_t hash, uint64_t len)
+{
+	if (db->db_flags & DB_FLAG_SPREAD)
+		hash = hash >> 32 | hash << 32;
+	return hash % len;
+}
+
+static int
+db_table_read(db_t *db, db_table_t *table, uint64_t off)
+{
+	return db_file_read(db->db_index, table,
+		db->db_index->header->table_off + off * sizeof(db_table_t),
+		sizeof(db_table_t));
+}
+
+static int
+db_table_write(db_t *db, db_table_t *table, uint64_t off)
+{
+	return db_file_write(db->db_index, table,
+		db->db_index->header->table_off + off * sizeof(db_table_t),
+		sizeof(db_table_t));
+}
+
+/* off without the cache reference bit */
+static int
+db_bucket_read(db_t *db, db_table_t *table, db_bucket_t *bucket, uint64_t off)
+{
+	int len;
+
+	len = db_file_read(db->db_index, bucket,
+		table->bucket_off + off * sizeof(db_bucket_t),
+		sizeof(db_bucket_t));
+	bucket->off &= ~DB_BUCKET_REF;
+
+	return len;
+}
+
+/* raw bucket, the reference bit kept */
+static int
+db_bucket_load(db_t *db, db_table_t *table, db_bucket_t *bucket, uint64_t off)
+{
+	return db_file_read(db->db_index, bucket,
+		table->bucket_off + off * sizeof(db_bucket_t),
+		sizeof(db_bucket_t));
+}
+
+static int
+db_bucket_write(db_t *db, db_table_t *table, db_bucket_t *bucket, uint64_t off)
+{
+	return db_file_write(db->db_index, bucket,
+		table->bucket_off + off * sizeof(db_bucket_t),
+		sizeof(db_bucket_t));
+}
+
+/* keys more than the load allow in len buckets */
+static int
+db_bucket_full(db_t *db, uint64_t keys, uint64_t len)
+{
+	return keys * 100 > len * db->db_load;
+}
+
+/* grow len by the growth factor until keys fit */
+static uint64_t
+db_bucket_grow(db_t *db, uint64_t len, uint64_t keys)
+{
+	do {
+		uint64_t next = len * db->db_growth / 100;
+
+		len = next > len ? next : len + 1;
+	} while (db_bucket_full(db, keys, len));
+
+	return len;
+}
+
+/*
+ * a bucket array of len buckets in the index file, it start with a
+ * klen 0 vlen array size filler so db-data can walk a single file
+ */
+static uint64_t
+db_bucket_alloc(db_t *db, uint64_t len)
+{
+	uint64_t off;
+
+	off = db_file_alloc(db->db_index,
+		sizeof(uint32_t) * 2 + len * sizeof(db_bucket_t));
+	if (off == 0)
+		return 0;
+
+	db_region_pin(db->db_index, off + sizeof(uint32_t) * 2,
+		len * sizeof(db_bucket_t));
+	return off;
+}
+
+/* an array no table use any more, its pool pages and regions may go */
+static void
+db_bucket_free(db_t *db, uint64_t bucket_off, uint64_t len)
+{
+	db_file_t *file = db->db_index;
+
+	db_region_unpin(file, bucket_off, len * sizeof(db_bucket_t));
+	if (file->pool != NULL)
+		db_pool_unpin(file->pool, file->fd, bucket_off,
+			len * sizeof(db_bucket_t));
+}
+
+/* write the filler and empty buckets, return the first bucket */
+static uint64_t
+db_bucket_clear(db_t *db, uint64_t off, uint64_t len)
+{
+	uint64_t i;
+	uint32_t klen;
+	uint32_t vlen;
+	static const uint8_t zero[4096];
+
+	klen = 0;
+	vlen = len * sizeof(db_bucket_t);
+	off += db_file_write(db->db_index, &klen, off, sizeof(klen));
+	off += db_file_write(db->db_index, &vlen, off, sizeof(vlen));
+
+	for (i = 0; i < vlen; i += sizeof(zero)) {
+		db_file_write(db->db_index, zero, off + i,
+			vlen - i < sizeof(zero) ? vlen - i : sizeof(zero));
+	}
+
+	return off;
+}
+
+/* bucket into the first empty slot of its run */
+static void
+db_bucket_add(db_t *db, db_table_t *table, db_bucket_t *bucket)
+{
+	uint64_t    i;
+	db_bucket_t cur;
+
+	for (i = db_bucket_slot(db, bucket->hash, table->bucket_len);;
+	     i = (i + 1) % table->bucket_len)
+	{
+		db_bucket_read(db, table, &cur, i);
+		if (cur.hash == 0) {
+			db_bucket_write(db, table, bucket, i);
+			return;
+		}
+	}
+}
+
+/* the keys of old_table slots [from, to) into the array of new_table */
+static void
+db_table_rehash(db_t *db, db_table_t *old_table, db_table_t *new_table,
+	uint64_t from, uint64_t to)
+{
+	uint64_t    i;
+	db_bucket_t bucket;
+
+	for (i = from; i < to; i++) {
+		db_bucket_load(db, old_table, &bucket, i);
+		if (bucket.hash != 0)
+			db_bucket_add(db, new_table, &bucket);
+	}
+}
+
+static int
+db_table_resize(db_t *db, uint64_t table_off, uint64_t bucket_per_table)
+{
+	uint64_t off;
+
+	db_table_t old_table;
+	db_table_t new_table;
+
+	if ((off = db_bucket_alloc(db, bucket_per_table)) == 0)
+		return DB_SYS_ERROR;
+
+	db_table_read(db, &old_table, table_off);
+
+	new_table.bucket_off = db_bucket_clear(db, off, bucket_per_table);
+	new_table.bucket_key = old_table.bucket_key;
+	new_table.bucket_len = bucket_per_table;
+
+	db_table_rehash(db, &old_table, &new_table, 0, old_table.bucket_len);
+	db_table_write(db, &new_table, table_off);
+	db_bucket_free(db, old_table.bucket_off, old_table.bucket_len);
+
+	return DB_OK;
+}
+
+static int
+db_index_init(db_t *db, uint64_t table, uint64_t bucket, uint64_t flags)
+{
+	uint64_t i;
+	uint64_t table_off;
+	assert(db && db->db_index->header);
+
+        db->db_index->header->magic      = DB_MAGIC;
+        db->db_index->header->version    = DB_VERSION;
+        db->db_index->header->flags      = flags;
+
+	db->db_index->header->data_head  = sizeof(db_file_header_t);
+	db->db_index->header->data_tail  = db->db_index->size;
 
 	table_off = db_file_calloc(db->db_index, table * sizeof(db_table_t));
 	if (table_off == 0) 
@@ -346,354 +1072,2820 @@ db_index_init(db_t *db, uint64_t table, uint64_t bucket)
 }
 
 static int
-db_data_init(db_t *db)
+db_data_init(db_t *db, uint64_t flags, uint64_t cache)
 {
-	assert(db && db->db_data->buf);
+	assert(db && db->db_data->header);
 
         db->db_data->header->magic      = DB_MAGIC;
         db->db_data->header->version    = DB_VERSION;
+        db->db_data->header->flags      = flags;
+
+	db->db_data->header->data_head  = sizeof(db_file_header_t);
+	db->db_data->header->data_tail  = db->db_data->size;
+
+	db->db_data->header->cache_size = cache;
+	db->db_data->header->cache_head = db->db_data->size;
+	db->db_data->header->cas_next   = 1;
+
+	return DB_OK;
+}
+
+typedef struct db_warmup {
+	db_t     *db;
+	uint64_t  from;
+	uint64_t  to;
+} db_warmup_t;
+
+static void *
+db_warmup_thread(void *arg)
+{
+	uint64_t    i;
+	db_table_t  table;
+	db_warmup_t *warmup = arg;
+
+	for (i = warmup->from; i < warmup->to; i++) {
+		db_table_read(warmup->db, &table, i);
+		db_file_advise(warmup->db->db_index, table.bucket_off,
+			table.bucket_len * sizeof(db_bucket_t),
+			DB_FILE_ADVISE_POPULATE);
+	}
+
+	return NULL;
+}
+
+/* fault in every bucket array, tables split across threads */
+static void
+db_warmup(db_t *db, uint64_t threads)
+{
+	uint64_t i;
+	uint64_t n;
+	pthread_t   *tid;
+	db_warmup_t *warmup;
+
+	if (threads > db->db_table_len)
+		threads = db->db_table_len;
+	if (threads == 0)
+		return;
+
+	tid    = calloc(threads, sizeof(pthread_t));
+	warmup = calloc(threads, sizeof(db_warmup_t));
+	if (tid == NULL || warmup == NULL) {
+		free(tid);
+		free(warmup);
+		return;
+	}
+
+	n = (db->db_table_len + threads - 1) / threads;
+	for (i = 0; i < threads; i++) {
+		warmup[i].db   = db;
+		warmup[i].from = i * n;
+		warmup[i].to   = (i + 1) * n;
+		if (warmup[i].to > db->db_table_len)
+			warmup[i].to = db->db_table_len;
+
+		if (pthread_create(&tid[i], NULL, db_warmup_thread,
+					&warmup[i]) != 0)
+		{
+			db_warmup_thread(&warmup[i]);
+			warmup[i].db = NULL;
+		}
+	}
+
+	for (i = 0; i < threads; i++) {
+		if (warmup[i].db != NULL)
+			pthread_join(tid[i], NULL);
+	}
+
+	free(tid);
+	free(warmup);
+}
+
+int
+db_open(db_t *db, const char *data, const char *index, const db_option_t *option)
+{
+	int init;
+	int index_init;
+	int error;
+	uint64_t flags;
+
+	memset(db, 0, sizeof(struct db));
+
+	db->db_load   = option->load ? option->load : DB_LOAD;
+	db->db_growth = option->growth ? option->growth : DB_GROWTH;
+	if (db->db_load > DB_LOAD_MAX)
+		db->db_load = DB_LOAD_MAX;
+	if (db->db_growth <= 100)
+		db->db_growth = DB_GROWTH;
+
+	if (index != NULL && strcmp(index, data) == 0)
+		index = NULL;
+	if (option->cache != 0 && index == NULL)
+		return DB_ERROR;	/* the ring would run over the tables */
+
+	if (option->backend == DB_BACKEND_PREAD) {
+		db->db_pool = db_pool_create(option->pool ? option->pool :
+				DB_POOL_SIZE, sysconf(_SC_PAGESIZE));
+		if (db->db_pool == NULL)
+			return DB_SYS_ERROR;
+	}
+
+	db->db_data = &db->db_file_data;
+	if ((error = db_file_open(db, db->db_data, data, option)) != DB_OK)
+		return error;
+	/* no budget still track the regions, db_aget read them in place */
+	if (option->backend == DB_BACKEND_MMAP)
+		db->db_data->budget = option->memory ? option->memory : UINT64_MAX;
+
+	if (index != NULL) {		/* separate index and data file */
+		db->db_index = &db->db_file_index;
+		if ((error = db_file_open(db, db->db_index, index, option)) != DB_OK)
+			return error;
+		db->db_index->pin = 1;	/* bucket arrays stay in pool */
+	} else {
+		db->db_index = &db->db_file_data;
+	}
+
+	flags = DB_FLAG_SPREAD | (option->intkey ? DB_FLAG_INTKEY : 0) |
+		(option->cache ? DB_FLAG_CACHE : 0) |
+		(option->expire ? DB_FLAG_EXPIRE : 0) |
+		(option->cas ? DB_FLAG_EXPIRE | DB_FLAG_CAS : 0);
+
+	index_init = db_file_size(db->db_index);
+	error = db_file_init(db->db_index, sizeof(db_file_header_t));
+	if (error != DB_OK)
+		return error;
+
+	if (!index_init && !option->rdonly) {
+		error = db_index_init(db, option->table, option->bucket, flags);
+		if (error != DB_OK)
+			return error;
+	}
+	db->db_table_len = db->db_index->header->table_len;
+
+	init  = db_file_size(db->db_data);
+	error = db_file_init(db->db_data, sizeof(db_file_header_t));
+	if (error != DB_OK)
+		return error;
+
+	if (!init) {
+		if ((error = db_data_init(db, flags, option->cache)) != DB_OK)
+			return error;
+	}
+
+	if (db->db_index->header->version < DB_VERSION_MIN ||
+	    db->db_index->header->version > DB_VERSION ||
+	    db->db_data->header->version < DB_VERSION_MIN ||
+	    db->db_data->header->version > DB_VERSION)
+	{
+		return DB_SYS_ERROR;
+	}
+
+	/* the data file own the flags, a new index (reindex) take them */
+	db->db_flags = db_file_flags(db->db_data);
+	if (!index_init && db->db_index != db->db_data && !option->rdonly)
+		db->db_index->header->flags = db->db_flags;
+	if (db_file_flags(db->db_index) != db->db_flags)
+		return DB_SYS_ERROR;
+
+	/* the free space at the head of the ring is a filler */
+	if (db->db_flags & DB_FLAG_CACHE) {
+		db_file_header_t *header = db->db_data->header;
+		uint32_t          len[2];
+
+		if (db->db_index == db->db_data)
+			return DB_SYS_ERROR;
+
+		db->db_data->cache_free = header->cache_head;
+		if (header->cache_head + sizeof(len) <= header->data_tail) {
+			db_file_read(db->db_data, len, header->cache_head,
+				sizeof(len));
+			if (len[0] == 0)
+				db->db_data->cache_free += sizeof(len) + len[1];
+		}
+	}
+
+	if (db->db_index->header->magic != DB_MAGIC && 
+	    db->db_index->header->magic != DB_MAGIC_INDEX)
+	{
+		return DB_SYS_ERROR;
+	}
+
+	if (db->db_data->header->magic != DB_MAGIC && 
+	    db->db_data->header->magic != DB_MAGIC_DATA)
+	{
+		return DB_SYS_ERROR;
+	}
+
+	/* single file, header and tables never leave memory */
+	if (db->db_index == db->db_data && db->db_data->region != NULL) {
+		uint64_t   i;
+		db_table_t table;
+
+		db_region_pin(db->db_data, 0, db->db_data->header->table_off +
+			db->db_table_len * sizeof(db_table_t));
+		for (i = 0; i < db->db_table_len; i++) {
+			db_table_read(db, &table, i);
+			db_region_pin(db->db_data, table.bucket_off,
+				table.bucket_len * sizeof(db_bucket_t));
+		}
+	}
+
+	if (option->warmup > 0)
+		db_warmup(db, option->warmup);
+
+	return DB_OK;
+}
+
+/*
+ * option.expire, a value is val|db_meta_t on disk, vlen count both.
+ * a delete is still vlen 0, an empty value is the meta alone.
+ * without option.cas the meta on disk stop before the version.
+ */
+static uint32_t
+db_meta_len(db_t *db)
+{
+	if (db->db_flags & DB_FLAG_CAS)
+		return sizeof(db_meta_t);
+	return db->db_flags & DB_FLAG_EXPIRE ? offsetof(db_meta_t, cas) : 0;
+}
+
+/* value length without the meta, len is vlen on disk */
+static uint32_t
+db_value_len(db_t *db, uint32_t len)
+{
+	return len >= db_meta_len(db) ? len - db_meta_len(db) : 0;
+}
+
+static void
+db_meta_read(db_t *db, uint64_t off, const uint32_t *len, db_meta_t *meta)
+{
+	memset(meta, 0, sizeof(db_meta_t));
+	if (db_meta_len(db) == 0 || len[1] < db_meta_len(db))
+		return;
+	db_file_read(db->db_data, meta, off + sizeof(uint32_t) * 2 +
+		len[0] + len[1] - db_meta_len(db), db_meta_len(db));
+}
+
+/* the meta a put write, caller meta or zero, and the next version */
+static void
+db_meta_stamp(db_t *db, const db_meta_t *meta, db_meta_t *stamp)
+{
+	if (meta != NULL)
+		*stamp = *meta;
+	else
+		memset(stamp, 0, sizeof(db_meta_t));
+
+	stamp->cas = 0;
+	if (db->db_flags & DB_FLAG_CAS)
+		stamp->cas = db->db_data->header->cas_next++;
+}
+
+static int
+db_meta_expired(const db_meta_t *meta)
+{
+	return meta->expire != 0 && meta->expire <= (uint64_t)time(NULL);
+}
+
+/* deleted or expired, len is klen|vlen of the record at off */
+static int
+db_record_dead(db_t *db, uint64_t off, const uint32_t *len)
+{
+	db_meta_t meta;
+
+	if (len[1] == 0)
+		return 1;
+	if (!(db->db_flags & DB_FLAG_EXPIRE))
+		return 0;
+
+	db_meta_read(db, off, len, &meta);
+	return db_meta_expired(&meta);
+}
+
+/*
+ * cache mode
+ *
+ * the data file is a ring of cache_size bytes from data_head. records
+ * are written at cache_head, [cache_head, cache_free) is free and the
+ * oldest records are from cache_free up to data_tail, then from
+ * data_head.  to make room the hand at cache_free take the next
+ * record: dead or not read since the last pass it is dropped from
+ * the index, read (DB_BUCKET_REF) it is moved down to cache_head
+ * with the bit clear.  the free space is always a filler record, so
+ * the file parse from data_head to data_tail like a plain log.
+ */
+static int
+db_cache_fit(db_t *db, uint64_t len)
+{
+	return !(db->db_flags & DB_FLAG_CACHE) ||
+		len <= db->db_data->header->cache_size / 2;
+}
+
+/* mark the bucket read, once, a clean page stay clean */
+static void
+db_bucket_touch(db_t *db, db_table_t *table, uint64_t off)
+{
+	db_bucket_t bucket;
+
+	if (db->db_index->rdonly)
+		return;
+
+	/* only the off word, readers mark side by side, not a change */
+	db_bucket_load(db, table, &bucket, off);
+	if (!(bucket.off & DB_BUCKET_REF)) {
+		bucket.off |= DB_BUCKET_REF;
+		db_file_write(db->db_index, &bucket.off, table->bucket_off +
+			off * sizeof(db_bucket_t) + offsetof(db_bucket_t, off),
+			sizeof(bucket.off));
+	}
+}
+
+/* the slot of the key at record off, bucket_len if it is not there */
+static uint64_t
+db_bucket_find(db_t *db, db_table_t *table, uint64_t hash, uint64_t off)
+{
+	uint64_t    i;
+	db_bucket_t bucket;
+
+	for (i = db_bucket_slot(db, hash, table->bucket_len);;
+	     i = (i + 1) % table->bucket_len)
+	{
+		db_bucket_read(db, table, &bucket, i);
+		if (bucket.hash == 0)
+			return table->bucket_len;
+		if (bucket.hash == hash && bucket.off == off)
+			return i;
+	}
+}
+
+static void
+db_bucket_unlink(db_t *db, db_table_t *table, uint64_t i);
+
+/*
+ * while db_reserve_fill rehash a table the new array, as shadow, hold
+ * the keys of the old slots below rs->next.  a put, remove or evict
+ * there make the same change to it, so the fill never start over
+ */
+static db_resize_t *
+db_reserve_of(db_t *db, db_table_t *table, db_table_t *shadow)
+{
+	db_resize_t *rs = db->db_reserve;
+
+	if (rs == NULL || rs->len == 0 || rs->next == 0 ||
+	    rs->src != table->bucket_off)
+	{
+		return NULL;
+	}
+
+	shadow->bucket_off = rs->off + sizeof(uint32_t) * 2;
+	shadow->bucket_key = 0;
+	shadow->bucket_len = rs->len;
+	return rs;
+}
+
+/* old slot i went from old to new, hash 0 is an empty slot */
+static void
+db_reserve_set(db_t *db, db_table_t *table, uint64_t i,
+	const db_bucket_t *old, const db_bucket_t *new)
+{
+	uint64_t     j;
+	db_bucket_t  bucket;
+	db_table_t   shadow;
+	db_resize_t *rs;
+
+	if ((rs = db_reserve_of(db, table, &shadow)) == NULL || i >= rs->next)
+		return;
+
+	j = shadow.bucket_len;
+	if (old->hash != 0)
+		j = db_bucket_find(db, &shadow, old->hash,
+			old->off & ~DB_BUCKET_REF);
+
+	bucket = *new;
+	if (j != shadow.bucket_len && new->hash == old->hash) {
+		db_bucket_write(db, &shadow, &bucket, j);
+		return;
+	}
+
+	if (j != shadow.bucket_len)
+		db_bucket_unlink(db, &shadow, j);
+	if (new->hash != 0)
+		db_bucket_add(db, &shadow, &bucket);
+}
+
+/* bucket pulled back from slot from to to, maybe across rs->next */
+static void
+db_reserve_move(db_t *db, db_table_t *table, const db_bucket_t *bucket,
+	uint64_t from, uint64_t to)
+{
+	db_bucket_t  none;
+	db_table_t   shadow;
+	db_resize_t *rs;
+
+	if ((rs = db_reserve_of(db, table, &shadow)) == NULL ||
+	    (from < rs->next) == (to < rs->next))
+	{
+		return;
+	}
+
+	memset(&none, 0, sizeof(none));
+	if (from < rs->next)
+		db_reserve_set(db, table, from, bucket, &none);
+	else
+		db_reserve_set(db, table, to, &none, bucket);
+}
+
+/* linear probe delete, pull back the keys after it in the run */
+static void
+db_bucket_unlink(db_t *db, db_table_t *table, uint64_t i)
+{
+	uint64_t    j;
+	uint64_t    home;
+	db_bucket_t bucket;
+
+	for (j = (i + 1) % table->bucket_len;; j = (j + 1) % table->bucket_len) {
+		db_bucket_load(db, table, &bucket, j);
+		if (bucket.hash == 0)
+			break;
+
+		/* it can't move before its home slot */
+		home = db_bucket_slot(db, bucket.hash, table->bucket_len);
+		if (i <= j ? (home > i && home <= j) : (home > i || home <= j))
+			continue;
+
+		db_bucket_write(db, table, &bucket, i);
+		db_reserve_move(db, table, &bucket, j, i);
+		i = j;
+	}
+
+	memset(&bucket, 0, sizeof(bucket));
+	db_bucket_write(db, table, &bucket, i);
+}
+
+static void
+db_bucket_remove(db_t *db, uint64_t table_off, db_table_t *table, uint64_t i)
+{
+	db_bucket_t bucket;
+	db_bucket_t none;
+
+	memset(&none, 0, sizeof(none));
+	db_bucket_load(db, table, &bucket, i);
+	db_reserve_set(db, table, i, &bucket, &none);
+
+	db_bucket_unlink(db, table, i);
+
+	table->bucket_key -= 1;
+	db_table_write(db, table, table_off);
+}
+
+/* pass the hand over the record at cache_free */
+static int
+db_cache_evict(db_t *db)
+{
+	uint64_t    i;
+	uint64_t    off;
+	uint64_t    hash;
+	uint64_t    table_off;
+	uint32_t    len[2];
+	uint64_t    rlen;
+	uint8_t     buf[512];
+	uint8_t    *rec;
+	db_table_t  table;
+	db_bucket_t bucket;
+	db_bucket_t old;
+	db_file_t  *file = db->db_data;
+
+	off = file->cache_free;
+	db_file_read(file, len, off, sizeof(len));
+	rlen = sizeof(len) + (uint64_t)len[0] + len[1];
+	file->cache_free += rlen;
+
+	if (len[0] == 0)		/* filler */
+		return DB_OK;
+
+	rec = buf;
+	if (rlen > sizeof(buf) && (rec = malloc(rlen)) == NULL)
+		return DB_SYS_ERROR;
+	db_file_read(file, rec, off, rlen);
+
+	if ((hash = db_key_hash(db, rec + sizeof(len), len[0])) == 0)
+		goto done;
+
+	table_off = hash % db->db_table_len;
+	db_table_read(db, &table, table_off);
+
+	for (i = db_bucket_slot(db, hash, table.bucket_len);;
+	     i = (i + 1) % table.bucket_len)
+	{
+		db_bucket_load(db, &table, &bucket, i);
+		if (bucket.hash == 0)
+			goto done;	/* old version, dead already */
+		if (bucket.hash == hash && (bucket.off & ~DB_BUCKET_REF) == off)
+			break;
+	}
+
+	if ((bucket.off & DB_BUCKET_REF) && !db_record_dead(db, off, len)) {
+		/* second chance */
+		old = bucket;
+		bucket.off = file->header->cache_head;
+		db_file_write(file, rec, bucket.off, rlen);
+		db_bucket_write(db, &table, &bucket, i);
+		db_reserve_set(db, &table, i, &old, &bucket);
+		file->header->cache_head += rlen;
+	} else {
+		db_bucket_remove(db, table_off, &table, i);
+	}
+
+done:
+	if (rec != buf)
+		free(rec);
+	return DB_OK;
+}
+
+/* db_file_alloc of the ring, evict until len fit at cache_head */
+static uint64_t
+db_cache_alloc(db_t *db, uint64_t len)
+{
+	uint32_t          fill[2];
+	uint64_t          off;
+	uint64_t          gap;
+	db_file_t        *file   = db->db_data;
+	db_file_header_t *header = file->header;
+
+	for (;;) {
+		/* a filler need 8 bytes, so fill the gap or leave 8 */
+		gap = file->cache_free - header->cache_head;
+		if (gap == len || gap >= len + sizeof(fill))
+			break;
+
+		if (file->cache_free < header->data_tail) {
+			if (db_cache_evict(db) != DB_OK)
+				return 0;
+			continue;
+		}
+
+		/* first lap, the ring grow like a log */
+		if (header->cache_head + len <=
+		    header->data_head + header->cache_size)
+		{
+			if (db_file_grow(file, header->cache_head + len,
+				header->data_head + header->cache_size) != DB_OK)
+				return 0;
+			header = file->header;
+			header->data_tail = header->cache_head + len;
+			file->cache_free  = header->data_tail;
+			continue;
+		}
+
+		/* end of the ring, what is after the head is dropped */
+		header->data_tail  = header->cache_head;
+		header->cache_head = header->data_head;
+		file->cache_free   = header->data_head;
+	}
+
+	off = header->cache_head;
+	header->cache_head += len;
+
+	if (gap > len) {
+		fill[0] = 0;
+		fill[1] = gap - len - sizeof(fill);
+		db_file_write(file, fill, header->cache_head, sizeof(fill));
+	}
+
+	return off;
+}
+
+/*
+ * write klen|vlen|key|val[|meta] at data tail, return its offset.
+ * val NULL is a delete, an empty val is one only without the meta
+ */
+static uint64_t
+db_record_append(db_t *db, const void *key, uint32_t klen,
+	const void *val, uint32_t vlen, const db_meta_t *meta)
+{
+	uint64_t  len;
+	uint64_t  data;
+	uint32_t  dbvlen;
+	db_meta_t zero;
+
+	dbvlen = val != NULL || vlen != 0 ? vlen + db_meta_len(db) : 0;
+	len    = sizeof(uint32_t) * 2 + klen + dbvlen;
+
+	if (db->db_flags & DB_FLAG_CACHE)
+		data = db_cache_alloc(db, len);
+	else
+		data = db_file_alloc(db->db_data, len);
+	if (data == 0)
+		return 0;
+
+	data += db_file_write(db->db_data, &klen, data, sizeof(uint32_t));
+	data += db_file_write(db->db_data, &dbvlen, data, sizeof(uint32_t));
+	data += db_file_write(db->db_data, key, data, klen);
+	data += db_file_write(db->db_data, val, data, vlen);
+
+	if (dbvlen > vlen) {
+		if (meta == NULL) {
+			memset(&zero, 0, sizeof(zero));
+			meta = &zero;
+		}
+		data += db_file_write(db->db_data, meta, data, db_meta_len(db));
+	}
+
+	return data - len;
+}
+
+/*
+ * read the table of hash, grow its bucket array first if it is full,
+ * a rehash of it under way is finished and ended here
+ */
+static int
+db_bucket_reserve(db_t *db, uint64_t hash, db_table_t *table)
+{
+	uint64_t     table_off = hash % db->db_table_len;
+	db_resize_t *rs        = db->db_reserve;
+
+	db_table_read(db, table, table_off);
+	if (!db_bucket_full(db, table->bucket_key + 1, table->bucket_len))
+		return DB_OK;
+
+	if (rs != NULL && rs->len != 0 && rs->table == table_off) {
+		db_reserve_fill(db, rs, table->bucket_len);
+		db_reserve_end(db, rs);
+
+		db_table_read(db, table, table_off);
+		if (!db_bucket_full(db, table->bucket_key + 1,
+			table->bucket_len))
+		{
+			return DB_OK;
+		}
+	}
+
+	if (db_table_resize(db, table_off, db_bucket_grow(db,
+		table->bucket_len, table->bucket_key + 1)) != DB_OK)
+	{
+		return DB_SYS_ERROR;
+	}
+	db_table_read(db, table, table_off);
+
+	return DB_OK;
+}
+
+/* point the bucket of key to the record at off */
+static int
+db_bucket_insert(db_t *db, db_table_t *table, uint64_t hash,
+	const void *key, uint32_t klen, uint64_t off)
+{
+	uint64_t    i;
+	db_bucket_t bucket;
+
+	bucket.hash = hash;
+	bucket.off  = off;
+
+	for (i = db_bucket_slot(db, hash, table->bucket_len);;
+	     i = (i + 1) % table->bucket_len)
+	{
+		db_bucket_t db_bucket;
+
+		db_bucket_read(db, table, &db_bucket, i);
+		if (db_bucket.hash != 0) {
+			if (db_bucket.hash != bucket.hash)
+				continue;
+			if (!db_key_equal(db, db_bucket.off, key, klen))
+				continue;
+		}
+
+		db_bucket_write(db, table, &bucket, i);
+		db_reserve_set(db, table, i, &db_bucket, &bucket);
+
+		if (db_bucket.hash == 0) {
+			table->bucket_key += 1;
+			db_table_write(db, table, hash % db->db_table_len);
+		}
+		return DB_OK;
+	} 
+
+	return DB_SYS_ERROR;
+}
+
+/* append the record and index it, meta is written as it is */
+static int
+db_put_record(db_t *db, const void *key, uint32_t klen,
+	const void *val, uint32_t vlen, const db_meta_t *meta)
+{
+	uint64_t   data;
+	uint64_t   hash;
+	db_table_t table;
+
+	if ((hash = db_key_hash(db, key, klen)) == 0)
+		return DB_ERROR;
+	if (vlen > UINT32_MAX - db_meta_len(db))
+		return DB_ERROR;
+	if (!db_cache_fit(db, sizeof(uint32_t) * 2 + (uint64_t)klen + vlen +
+		db_meta_len(db)))
+	{
+		return DB_ERROR;
+	}
+
+	/* append first, in cache mode it can evict from any table */
+	data = db_record_append(db, key, klen, val, vlen, meta);
+	if (data == 0)
+		return DB_SYS_ERROR;
+
+	if (db_bucket_reserve(db, hash, &table) != DB_OK)
+		return DB_SYS_ERROR;
+
+	return db_bucket_insert(db, &table, hash, key, klen, data);
+}
+
+int
+db_put(db_t *db, const void *key, uint32_t klen, const void *val, uint32_t vlen)
+{
+	return db_put_meta(db, key, klen, val, vlen, NULL);
+}
+
+int
+db_put_meta(db_t *db, const void *key, uint32_t klen,
+	const void *val, uint32_t vlen, const db_meta_t *meta)
+{
+	db_meta_t stamp;
+
+	db_meta_stamp(db, meta, &stamp);
+	return db_put_record(db, key, klen, val, vlen, &stamp);
+}
+
+/*
+ * the record is written as klen 0 (filler, skipped by the reindex
+ * scan) until db_put_end, so a crash in the middle lose the value
+ * instead of indexing half of it
+ */
+int
+db_put_begin(db_t *db, db_stream_t *stream, const void *key, uint32_t klen,
+	uint32_t vlen)
+{
+	uint32_t zero = 0;
+	uint32_t fill;
+	uint64_t data;
+
+	if ((stream->hash = db_key_hash(db, key, klen)) == 0)
+		return DB_ERROR;
+	if ((uint64_t)klen + vlen + db_meta_len(db) > UINT32_MAX)
+		return DB_ERROR;
+	if (db->db_flags & DB_FLAG_CACHE)
+		return DB_ERROR;	/* the hand would take the filler */
+
+	fill = klen + vlen + db_meta_len(db);
+	data = db_file_alloc(db->db_data, sizeof(uint32_t) * 2 + fill);
+	if (data == 0)
+		return DB_SYS_ERROR;
+
+	db_file_write(db->db_data, &zero, data, sizeof(zero));
+	db_file_write(db->db_data, &fill, data + sizeof(zero), sizeof(fill));
+	db_file_write(db->db_data, key, data + sizeof(uint32_t) * 2, klen);
+
+	stream->db   = db;
+	stream->key  = key;
+	stream->klen = klen;
+	stream->vlen = vlen;
+	stream->pos  = 0;
+	stream->off  = data;
+
+	return DB_OK;
+}
+
+int
+db_put_write(db_stream_t *stream, const void *buf, uint32_t len)
+{
+	if (len > stream->vlen - stream->pos)
+		return DB_ERROR;
+
+	db_file_write(stream->db->db_data, buf, stream->off +
+		sizeof(uint32_t) * 2 + stream->klen + stream->pos, len);
+	stream->pos += len;
+
+	return DB_OK;
+}
+
+int
+db_put_end(db_stream_t *stream)
+{
+	uint32_t   dbvlen;
+	db_meta_t  meta;
+	db_t      *db = stream->db;
+	db_table_t table;
+
+	if (stream->pos != stream->vlen)
+		return DB_ERROR;
+
+	if (db_bucket_reserve(db, stream->hash, &table) != DB_OK)
+		return DB_SYS_ERROR;
+
+	dbvlen = stream->vlen;
+	if (db_meta_len(db) != 0) {
+		db_meta_stamp(db, NULL, &meta);
+		db_file_write(db->db_data, &meta, stream->off +
+			sizeof(uint32_t) * 2 + stream->klen + dbvlen,
+			db_meta_len(db));
+		dbvlen += db_meta_len(db);
+	}
+
+	/* vlen before klen, the record turn real with its klen */
+	db_file_write(db->db_data, &dbvlen,
+		stream->off + sizeof(uint32_t), sizeof(uint32_t));
+	db_file_write(db->db_data, &stream->klen, stream->off, sizeof(uint32_t));
+
+	return db_bucket_insert(db, &table, stream->hash, stream->key,
+		stream->klen, stream->off);
+}
+
+/* offset of the record of key, 0 not found */
+static uint64_t
+db_lookup(db_t *db, const void *key, uint32_t klen)
+{
+	uint64_t i;
+
+	uint64_t    hash;
+	db_table_t  table;
+	db_bucket_t bucket;
+
+	if ((hash = db_key_hash(db, key, klen)) == 0)
+		return 0;
+	db_table_read(db, &table, hash % db->db_table_len);
+
+	for (i = db_bucket_slot(db, hash, table.bucket_len);;
+	     i = (i + 1) % table.bucket_len)
+	{
+		db_bucket_read(db, &table, &bucket, i);
+
+		if (bucket.hash == 0)
+			break;
+
+		if (bucket.hash != hash)
+			continue;
+
+		if (db_key_equal(db, bucket.off, key, klen)) {
+			if (db->db_flags & DB_FLAG_EXPIRE) {
+				uint32_t len[2];
+
+				db_file_read(db->db_data, len, bucket.off,
+					sizeof(len));
+				if (db_record_dead(db, bucket.off, len))
+					return 0;
+			}
+			if (db->db_flags & DB_FLAG_CACHE)
+				db_bucket_touch(db, &table, i);
+			return bucket.off;
+		}
+	}
+
+	return 0;
+}
+
+uint32_t
+db_get(db_t *db, const void *key, uint32_t klen, void *val, uint32_t vlen)
+{
+	return db_get_meta(db, key, klen, val, vlen, NULL);
+}
+
+uint32_t
+db_get_meta(db_t *db, const void *key, uint32_t klen,
+	void *val, uint32_t vlen, db_meta_t *meta)
+{
+	uint64_t off;
+	uint32_t len[2];
+
+	if (meta != NULL)
+		memset(meta, 0, sizeof(db_meta_t));
+	if ((off = db_lookup(db, key, klen)) == 0)
+		return 0;
+
+	db_file_read(db->db_data, len, off, sizeof(len));
+	if (meta != NULL)
+		db_meta_read(db, off, len, meta);
+	len[1] = db_value_len(db, len[1]);
+
+	if (len[1] < vlen)
+		vlen = len[1];
+
+	db_file_read(db->db_data, val, off + sizeof(len) + klen, vlen);
+	return len[1];
+}
+
+uint32_t
+db_get_range(db_t *db, const void *key, uint32_t klen, uint32_t off,
+	void *val, uint32_t vlen)
+{
+	uint64_t rec;
+	uint32_t len;
+
+	if ((rec = db_lookup(db, key, klen)) == 0)
+		return 0;
+
+	db_file_read(db->db_data, &len, rec + sizeof(klen), sizeof(len));
+	len = db_value_len(db, len);
+
+	if (off >= len)
+		return len;
+	if (len - off < vlen)
+		vlen = len - off;
+
+	db_file_read(db->db_data, val,
+		rec + sizeof(klen) + sizeof(len) + klen + off, vlen);
+	return len;
+}
+
+/*
+ * a record can be written over only when no view can see it, a view
+ * of the mmap backend pin the whole mapping, the others own a copy
+ */
+static int
+db_record_private(db_t *db)
+{
+	db_file_t *file = db->db_data;
+
+	return file->map == NULL || (db->db_flags & DB_FLAG_CACHE) ||
+		__atomic_load_n(&file->map->ref, __ATOMIC_ACQUIRE) == 1;
+}
+
+/* write val and meta over the value of the record at off */
+static void
+db_record_rewrite(db_t *db, uint64_t off, uint32_t klen,
+	const void *val, uint32_t vlen, const db_meta_t *meta)
+{
+	off += sizeof(uint32_t) * 2 + klen;
+	db_file_write(db->db_data, val, off, vlen);
+	if (db_meta_len(db) != 0)
+		db_file_write(db->db_data, meta, off + vlen, db_meta_len(db));
+}
+
+/* put val, in place if the record at off (0 none) has its length */
+static int
+db_record_update(db_t *db, uint64_t off, const uint32_t *len,
+	const void *key, uint32_t klen, const void *val, uint32_t vlen,
+	const db_meta_t *meta)
+{
+	if (off != 0 && len[1] != 0 && db_value_len(db, len[1]) == vlen &&
+	    db_record_private(db))
+	{
+		db_record_rewrite(db, off, klen, val, vlen, meta);
+		return DB_OK;
+	}
+
+	return db_put_record(db, key, klen, val, vlen, meta);
+}
+
+int
+db_store(db_t *db, int mode, const void *key, uint32_t klen,
+	const void *val, uint32_t vlen, db_meta_t *meta)
+{
+	int       error;
+	uint64_t  off;
+	uint32_t  len[2];
+	uint32_t  old;
+	uint8_t  *buf;
+	db_meta_t cur;
+	db_meta_t stamp;
+
+	/* without option.expire the lookup can stop on a delete */
+	memset(&cur, 0, sizeof(cur));
+	len[0] = len[1] = 0;
+	if ((off = db_lookup(db, key, klen)) != 0) {
+		db_file_read(db->db_data, len, off, sizeof(len));
+		db_meta_read(db, off, len, &cur);
+		if (len[1] == 0)
+			off = 0;
+	}
+
+	error = DB_OK;
+	switch (mode) {
+	case DB_STORE_SET:
+		break;
+	case DB_STORE_ADD:
+		if (off != 0)
+			error = DB_EXISTS;
+		break;
+	case DB_STORE_CAS:
+		if (off != 0 && (meta == NULL || meta->cas != cur.cas ||
+		    !(db->db_flags & DB_FLAG_CAS)))
+		{
+			error = DB_EXISTS;
+		}
+		/* fall through */
+	case DB_STORE_REPLACE:
+	case DB_STORE_APPEND:
+	case DB_STORE_PREPEND:
+		if (off == 0)
+			error = DB_ERROR;
+		break;
+	default:
+		return DB_ERROR;
+	}
+	if (error != DB_OK) {
+		if (meta != NULL)
+			meta->cas = cur.cas;
+		return error;
+	}
+
+	buf = NULL;
+	if (mode == DB_STORE_APPEND || mode == DB_STORE_PREPEND) {
+		old = db_value_len(db, len[1]);
+		if (vlen > UINT32_MAX - db_meta_len(db) - old)
+			return DB_ERROR;
+		if ((buf = malloc((size_t)old + vlen + 1)) == NULL)
+			return DB_SYS_ERROR;
+
+		db_file_read(db->db_data, mode == DB_STORE_APPEND ? buf :
+			buf + vlen, off + sizeof(len) + klen, old);
+		memcpy(mode == DB_STORE_APPEND ? buf + old : buf, val, vlen);
+		val   = buf;
+		vlen += old;
+		db_meta_stamp(db, &cur, &stamp);
+	} else {
+		db_meta_stamp(db, meta, &stamp);
+	}
+
+	error = db_record_update(db, off, len, key, klen, val, vlen, &stamp);
+	free(buf);
+
+	if (error == DB_OK && meta != NULL)
+		meta->cas = stamp.cas;
+	return error;
+}
+
+#define DB_NUMBER_LEN	20		/* digits of UINT64_MAX */
+
+/* decimal value, trailing spaces are the padding of a shorter one */
+static int
+db_number(const char *buf, uint32_t len, uint64_t *value)
+{
+	uint32_t i;
+	uint64_t v;
+
+	for (i = 0, v = 0; i < len && buf[i] >= '0' && buf[i] <= '9'; i++) {
+		if (v > (UINT64_MAX - (buf[i] - '0')) / 10)
+			return DB_ERROR;
+		v = v * 10 + (buf[i] - '0');
+	}
+	if (i == 0)
+		return DB_ERROR;
+	for (; i < len; i++)
+		if (buf[i] != ' ')
+			return DB_ERROR;
+
+	*value = v;
+	return DB_OK;
+}
+
+static int
+db_delta(db_t *db, const void *key, uint32_t klen, uint64_t delta,
+	int decr, uint64_t *value, db_meta_t *meta)
+{
+	int       error;
+	uint64_t  off;
+	uint64_t  v;
+	uint32_t  len[2];
+	uint32_t  vlen;
+	uint32_t  n;
+	char      buf[DB_NUMBER_LEN * 4];
+	char      num[DB_NUMBER_LEN];
+	db_meta_t cur;
+	db_meta_t stamp;
+
+	if (meta != NULL)
+		memset(meta, 0, sizeof(db_meta_t));
+	if ((off = db_lookup(db, key, klen)) == 0)
+		return DB_ERROR;
+
+	db_file_read(db->db_data, len, off, sizeof(len));
+	if (len[1] == 0)
+		return DB_ERROR;
+	db_meta_read(db, off, len, &cur);
+	if (meta != NULL)
+		*meta = cur;
+	vlen = db_value_len(db, len[1]);
+	if (vlen > sizeof(buf))
+		return DB_EXISTS;
+	db_file_read(db->db_data, buf, off + sizeof(len) + klen, vlen);
+	if (db_number(buf, vlen, &v) != DB_OK)
+		return DB_EXISTS;
+
+	if (decr)
+		v = v > delta ? v - delta : 0;
+	else
+		v += delta;
+	*value = v;
+
+	n = sizeof(num);
+	do {
+		num[--n] = '0' + v % 10;
+	} while ((v /= 10) != 0);
+	n = sizeof(num) - n;
+
+	/* shorter is padded, but only where the old record is reused */
+	memcpy(buf, num + sizeof(num) - n, n);
+	if (n <= vlen && db_record_private(db))
+		memset(buf + n, ' ', vlen - n);
+	else
+		vlen = n;
+
+	db_meta_stamp(db, &cur, &stamp);
+	error = db_record_update(db, off, len, key, klen, buf, vlen, &stamp);
+	if (error == DB_OK && meta != NULL)
+		*meta = stamp;
+	return error;
+}
+
+int
+db_incr(db_t *db, const void *key, uint32_t klen, uint64_t delta,
+	uint64_t *value, db_meta_t *meta)
+{
+	return db_delta(db, key, klen, delta, 0, value, meta);
+}
+
+int
+db_decr(db_t *db, const void *key, uint32_t klen, uint64_t delta,
+	uint64_t *value, db_meta_t *meta)
+{
+	return db_delta(db, key, klen, delta, 1, value, meta);
+}
+
+/*
+ * mmap backend hand out pointers into a pinned mapping (db_map_put),
+ * pread backend copy the record into a buffer owned by the view,
+ * so do cache mode, the ring write over old records in place
+ */
+static int
+db_view_record(db_t *db, uint64_t off, db_view_t *view)
+{
+	uint32_t   len[2];
+	db_file_t *file = db->db_data;
+
+	db_file_read(file, len, off, sizeof(len));
+	if (db_record_dead(db, off, len))
+		return DB_ERROR;	/* deleted or expired */
+
+	db_meta_read(db, off, len, &view->meta);
+	view->klen = len[0];
+	view->vlen = db_value_len(db, len[1]);
+	off += sizeof(len);
+
+	if (file->map != NULL && !(db->db_flags & DB_FLAG_CACHE)) {
+		if (file->region != NULL)
+			db_region_touch(file, off, (size_t)len[0] + len[1]);
+		__atomic_add_fetch(&file->map->ref, 1, __ATOMIC_RELAXED);
+
+		view->map = file->map;
+		view->buf = NULL;
+		view->key = (uint8_t *)file->map->buf + off;
+	} else {
+		if ((view->buf = malloc((size_t)len[0] + len[1])) == NULL)
+			return DB_SYS_ERROR;
+		db_file_read(file, view->buf, off, (size_t)len[0] + len[1]);
+
+		view->map = NULL;
+		view->key = view->buf;
+	}
+	view->val = (const uint8_t *)view->key + len[0];
+
+	return DB_OK;
+}
+
+int
+db_view(db_t *db, const void *key, uint32_t klen, db_view_t *view)
+{
+	uint64_t off;
+
+	if ((off = db_lookup(db, key, klen)) == 0)
+		return DB_ERROR;
+	return db_view_record(db, off, view);
+}
+
+void
+db_view_release(db_view_t *view)
+{
+	if (view->map != NULL)
+		db_map_put(view->map);
+	free(view->buf);
+
+	view->map = NULL;
+	view->buf = NULL;
+}
+
+#define DB_AIO_DEPTH	64
+
+static void
+db_aget_done(db_aio_t *aio, db_aget_t *req, int error)
+{
+	free(req->buf);
+	req->buf    = NULL;
+	req->buflen = 0;
+
+	req->error = error;
+	req->next  = NULL;
+	if (aio->done_tail != NULL)
+		aio->done_tail->next = req;
+	else
+		aio->done = req;
+	aio->done_tail = req;
+}
+
+static int
+db_aget_buffer(db_aget_t *req, size_t len, size_t align)
+{
+	void *buf;
+
+	if (len <= req->buflen)
+		return DB_OK;
+
+	if (posix_memalign(&buf, align, len) != 0)
+		return DB_SYS_ERROR;
+	free(req->buf);
+	req->buf    = buf;
+	req->buflen = len;
+
+	return DB_OK;
+}
+
+static int db_aget_probe(db_aio_t *aio, db_aget_t *req);
+
+/* buf hold len bytes of the file from req->boff, the record at req->off */
+static void
+db_aget_finish(db_aio_t *aio, db_aget_t *req, const void *buf, size_t len)
+{
+	int      dead;
+	const uint8_t *rec;
+	uint32_t klen;
+	uint32_t vlen;
+	size_t   roff;
+	size_t   n;
+
+	roff = req->off - req->boff;
+	if (len < roff + sizeof(klen) + sizeof(vlen) + req->klen) {
+		db_aget_done(aio, req, DB_SYS_ERROR);
+		return;
+	}
+
+	rec = (const uint8_t *)buf + roff;
+	memcpy(&klen, rec, sizeof(klen));
+	memcpy(&vlen, rec + sizeof(klen), sizeof(vlen));
+	rec += sizeof(klen) + sizeof(vlen);
+
+	if (klen != req->klen || memcmp(rec, req->key, klen) != 0) {
+		req->slot = (req->slot + 1) % req->table.bucket_len;
+		db_aget_probe(aio, req);
+		return;
+	}
+	rec += klen;
+
+	/* the meta is in the buffer unless the value is bigger than asked */
+	memset(&req->meta, 0, sizeof(db_meta_t));
+	dead = vlen == 0;
+	if (!dead && (aio->db->db_flags & DB_FLAG_EXPIRE)) {
+		uint32_t rlen[2];
+
+		rlen[0] = klen;
+		rlen[1] = vlen;
+		if (roff + sizeof(rlen) + klen + vlen <= len)
+			memcpy(&req->meta, rec + vlen - db_meta_len(aio->db),
+				db_meta_len(aio->db));
+		else
+			db_meta_read(aio->db, req->off, rlen, &req->meta);
+		dead = db_meta_expired(&req->meta);
+	}
+	if (dead) {
+		req->vlen = 0;
+		db_aget_done(aio, req, DB_ERROR);
+		return;
+	}
+	vlen = db_value_len(aio->db, vlen);
+	if (aio->db->db_flags & DB_FLAG_CACHE)
+		db_bucket_touch(aio->db, &req->table, req->slot);
+
+	n = vlen < req->vlen ? vlen : req->vlen;
+	if (roff + sizeof(klen) + sizeof(vlen) + klen + n > len) {
+		db_aget_done(aio, req, DB_SYS_ERROR);
+		return;
+	}
+	memcpy(req->val, rec, n);
+
+	req->vlen = vlen;
+	db_aget_done(aio, req, DB_OK);
+}
+
+/* walk the buckets from req->slot and read the next candidate */
+static int
+db_aget_probe(db_aio_t *aio, db_aget_t *req)
+{
+	uint64_t    end;
+	size_t      len;
+	db_bucket_t bucket;
+	db_t       *db   = aio->db;
+	db_file_t  *file = db->db_data;
+
+	for (;; req->slot = (req->slot + 1) % req->table.bucket_len) {
+		db_bucket_read(db, &req->table, &bucket, req->slot);
+
+		if (bucket.hash == 0) {
+			req->vlen = 0;
+			db_aget_done(aio, req, DB_ERROR);
+			return DB_OK;
+		}
+		if (bucket.hash == req->hash)
+			break;
+	}
+
+	req->off = bucket.off;
+	end = req->off + sizeof(uint32_t) * 2 + req->klen + req->vlen +
+		db_meta_len(db);
+	if (end > file->size)
+		end = file->size;
+
+	/* in memory already, parse it in the mapping, no copy, no ring */
+	if (file->map != NULL && (aio->ring == NULL ||
+	    db_mmap_resident(file, req->off, end - req->off)))
+	{
+		if (file->region != NULL)
+			db_region_touch(file, req->off, end - req->off);
+		req->boff = 0;
+		db_aget_finish(aio, req, file->buf, file->buflen);
+		return DB_OK;
+	}
+
+	/*
+	 * a pool page may be dirty (a put, an update in place) and the fd
+	 * behind it stale, one cached page send the whole read to the pool
+	 */
+	if (aio->ring == NULL || (file->pool != NULL &&
+	    db_pool_cached(file->pool, file->fd, req->off, end - req->off)))
+	{
+		len = end - req->off;
+		if (db_aget_buffer(req, len, sizeof(uint64_t)) != DB_OK) {
+			db_aget_done(aio, req, DB_SYS_ERROR);
+			return DB_SYS_ERROR;
+		}
+		req->boff = req->off;
+		db_file_read(file, req->buf, req->off, len);
+		db_aget_finish(aio, req, req->buf, len);
+		return DB_OK;
+	}
+
+	/* page aligned so the same read work with O_DIRECT */
+	req->boff = req->off & ~((uint64_t)file->pgsz - 1);
+	len = ((end + file->pgsz - 1) & ~((uint64_t)file->pgsz - 1)) - req->boff;
+	if (db_aget_buffer(req, len, file->pgsz) != DB_OK) {
+		db_aget_done(aio, req, DB_SYS_ERROR);
+		return DB_SYS_ERROR;
+	}
+
+	if (db_uring_read(aio->ring, file->fd, req->buf, len, req->boff,
+				(uint64_t)(uintptr_t)req) != DB_OK)
+	{
+		/* submission queue full, push it to the kernel and retry */
+		if (db_uring_submit(aio->ring, 0) != DB_OK ||
+		    db_uring_read(aio->ring, file->fd, req->buf, len, req->boff,
+				(uint64_t)(uintptr_t)req) != DB_OK)
+		{
+			db_aget_done(aio, req, DB_SYS_ERROR);
+			return DB_SYS_ERROR;
+		}
+	}
+	aio->inflight++;
+
+	return DB_OK;
+}
+
+static int
+db_aio_reap(db_aio_t *aio, unsigned wait)
+{
+	int res;
+	uint64_t data;
+	db_aget_t *req;
+
+	if (db_uring_submit(aio->ring, wait) != DB_OK)
+		return DB_SYS_ERROR;
+
+	while (db_uring_reap(aio->ring, &data, &res)) {
+		req = (db_aget_t *)(uintptr_t)data;
+		aio->inflight--;
+
+		if (res < 0)
+			db_aget_done(aio, req, DB_SYS_ERROR);
+		else
+			db_aget_finish(aio, req, req->buf, res);
+	}
+
+	return DB_OK;
+}
+
+int
+db_aio_open(db_t *db, db_aio_t *aio, unsigned depth)
+{
+	memset(aio, 0, sizeof(db_aio_t));
+
+	aio->db    = db;
+	aio->depth = depth ? depth : DB_AIO_DEPTH;
+	aio->ring  = db_uring_create(aio->depth);
+
+	return DB_OK;
+}
+
+int
+db_aget(db_aio_t *aio, db_aget_t *req)
+{
+	db_t *db = aio->db;
+
+	while (aio->inflight >= aio->depth) {
+		if (db_aio_reap(aio, 1) != DB_OK)
+			return DB_SYS_ERROR;
+	}
+
+	req->buf    = NULL;
+	req->buflen = 0;
+	req->next   = NULL;
+
+	if ((req->hash = db_key_hash(db, req->key, req->klen)) == 0) {
+		req->vlen = 0;
+		db_aget_done(aio, req, DB_ERROR);
+		return DB_OK;
+	}
+	db_table_read(db, &req->table, req->hash % db->db_table_len);
+	req->slot = db_bucket_slot(db, req->hash, req->table.bucket_len);
+
+	return db_aget_probe(aio, req);
+}
+
+db_aget_t *
+db_aio_next(db_aio_t *aio, int wait)
+{
+	db_aget_t *req;
+
+	if (aio->done == NULL && aio->inflight > 0)
+		db_aio_reap(aio, 0);
+
+	while (aio->done == NULL && aio->inflight > 0 && wait) {
+		if (db_aio_reap(aio, 1) != DB_OK)
+			return NULL;
+	}
+
+	if ((req = aio->done) != NULL) {
+		aio->done = req->next;
+		if (aio->done == NULL)
+			aio->done_tail = NULL;
+		req->next = NULL;
+	}
+
+	return req;
+}
+
+int
+db_aio_close(db_aio_t *aio)
+{
+	while (aio->inflight > 0) {
+		if (db_aio_reap(aio, 1) != DB_OK)
+			return DB_SYS_ERROR;
+	}
+
+	db_uring_destroy(aio->ring);
+	aio->ring = NULL;
+
+	return DB_OK;
+}
+
+int
+db_del(db_t *db, const void *key, uint32_t klen)
+{
+	return db_put(db, key, klen, NULL, 0);
+}
+
+int
+db_iput(db_t *db, uint64_t key, const void *val, uint32_t vlen)
+{
+	return db_put(db, &key, sizeof(key), val, vlen);
+}
+
+uint32_t
+db_iget(db_t *db, uint64_t key, void *val, uint32_t vlen)
+{
+	return db_get(db, &key, sizeof(key), val, vlen);
+}
+
+int
+db_idel(db_t *db, uint64_t key)
+{
+	return db_del(db, &key, sizeof(key));
+}
+
+uint64_t
+db_reap(db_t *db, uint64_t buckets)
+{
+	uint64_t  n;
+	uint64_t  passed;
+	db_reap_t reap;
+
+	for (n = 0; buckets > 0; buckets -= passed) {
+		if ((passed = db_reap_find(db, &reap, buckets, 0)) == 0)
+			break;
+		n += db_reap_drop(db, &reap);
+	}
+
+	return n;
+}
+
+static uint64_t
+db_reap_usec(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000 +
+		(now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* nothing is removed here, the hand go past every slot */
+uint64_t
+db_reap_find(db_t *db, db_reap_t *reap, uint64_t buckets, uint64_t usec)
+{
+	uint64_t    n;
+	uint32_t    len[2];
+	db_table_t  table;
+	db_table_t  shadow;
+	db_bucket_t bucket;
+
+	struct timespec start;
+
+	reap->n = 0;
+	if (db->db_index->rdonly)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (n = 0; n < buckets && reap->n < DB_REAP_MAX; n++) {
+		if (db->db_reap_table >= db->db_table_len) {
+			db->db_reap_table  = 0;
+			db->db_reap_bucket = 0;
+		}
+
+		/* a table under rehash wait for the next lap */
+		db_table_read(db, &table, db->db_reap_table);
+		if (db->db_reap_bucket >= table.bucket_len ||
+		    db_reserve_of(db, &table, &shadow) != NULL)
+		{
+			db->db_reap_table += 1;
+			db->db_reap_bucket = 0;
+			continue;
+		}
+
+		db_bucket_read(db, &table, &bucket, db->db_reap_bucket);
+		db->db_reap_bucket += 1;
+		if (bucket.hash == 0)
+			continue;
+
+		db_file_read(db->db_data, len, bucket.off, sizeof(len));
+		if (db_record_dead(db, bucket.off, len)) {
+			reap->table[reap->n] = db->db_reap_table;
+			reap->hash[reap->n]  = bucket.hash;
+			reap->off[reap->n]   = bucket.off;
+			reap->n++;
+		}
+
+		if (usec != 0 && db_reap_usec(&start) >= usec) {
+			n++;
+			break;
+		}
+	}
+
+	return n;
+}
+
+/* a put may have moved, replaced or dropped a key since the find */
+uint64_t
+db_reap_drop(db_t *db, db_reap_t *reap)
+{
+	int         i;
+	uint64_t    n;
+	uint64_t    j;
+	uint32_t    len[2];
+	db_table_t  table;
+
+	if (db->db_index->rdonly)
+		return 0;
+
+	for (n = 0, i = 0; i < reap->n; i++) {
+		db_table_read(db, &table, reap->table[i]);
+
+		j = db_bucket_find(db, &table, reap->hash[i], reap->off[i]);
+		if (j == table.bucket_len)
+			continue;
+
+		db_file_read(db->db_data, len, reap->off[i], sizeof(len));
+		if (db_record_dead(db, reap->off[i], len)) {
+			db_bucket_remove(db, reap->table[i], &table, j);
+			n++;
+		}
+	}
+	reap->n = 0;
+
+	return n;
+}
+
+/* grow file to room bytes past its tail, DB_ERROR it has them */
+static int
+db_reserve_file(db_t *db, db_file_t *file, uint64_t room)
+{
+	uint64_t          need;
+	uint64_t          max;
+	db_file_header_t *header = file->header;
+
+	need = header->data_tail + room;
+	max  = 0;
+
+	/* the ring write at cache_head and never grow past its size */
+	if (file == db->db_data && (db->db_flags & DB_FLAG_CACHE)) {
+		need = header->cache_head + room;
+		max  = header->data_head + header->cache_size;
+		if (need > max)
+			need = max;
+	}
+	if (need <= file->size)
+		return DB_ERROR;
+
+	return db_file_grow(file, need, max) == DB_OK ? DB_OK : DB_SYS_ERROR;
+}
+
+int
+db_reserve(db_t *db, db_resize_t *rs, uint64_t room, uint64_t tables)
+{
+	int        error;
+	uint64_t   off;
+	uint64_t   len;
+	uint64_t   keys;
+	db_table_t table;
+
+	rs->len = 0;
+	if (db->db_index->rdonly)
+		return DB_ERROR;
+
+	if ((error = db_reserve_file(db, db->db_data, room)) != DB_ERROR)
+		return error;
+	if (db->db_index != db->db_data &&
+	    (error = db_reserve_file(db, db->db_index, room)) != DB_ERROR)
+		return error;
+
+	/* the hand stay on a table until it is resized */
+	for (; tables > 0; tables--) {
+		if (db->db_reserve_table >= db->db_table_len)
+			db->db_reserve_table = 0;
+
+		db_table_read(db, &table, db->db_reserve_table);
+		keys = table.bucket_key + table.bucket_key / 8 + 1;
+		if (!db_bucket_full(db, keys, table.bucket_len)) {
+			db->db_reserve_table += 1;
+			continue;
+		}
+
+		len = db_bucket_grow(db, table.bucket_len, keys);
+		if ((off = db_bucket_alloc(db, len)) == 0)
+			return DB_SYS_ERROR;
+
+		rs->table = db->db_reserve_table;
+		rs->off   = off;
+		rs->len   = len;
+		rs->left  = table.bucket_len;
+		rs->src   = table.bucket_off;
+		rs->next  = 0;
+
+		db->db_reserve = rs;
+		return DB_OK;
+	}
+
+	return DB_ERROR;
+}
+
+/* the table was resized by a bulk load or a put, the array left unused */
+static int
+db_reserve_lost(db_t *db, db_resize_t *rs)
+{
+	db_bucket_free(db, rs->off + sizeof(uint32_t) * 2, rs->len);
+
+	if (db->db_reserve == rs)
+		db->db_reserve = NULL;
+	rs->len  = 0;
+	rs->left = 0;
+
+	return DB_ERROR;
+}
+
+int
+db_reserve_fill(db_t *db, db_resize_t *rs, uint64_t buckets)
+{
+	uint64_t   to;
+	db_table_t old_table;
+	db_table_t new_table;
+
+	if (rs->len == 0)
+		return DB_ERROR;
+
+	db_table_read(db, &old_table, rs->table);
+	if (old_table.bucket_off != rs->src)
+		return db_reserve_lost(db, rs);
+
+	/* nothing is mirrored into it before the first slice */
+	if (rs->next == 0)
+		db_bucket_clear(db, rs->off, rs->len);
+
+	new_table.bucket_off = rs->off + sizeof(uint32_t) * 2;
+	new_table.bucket_key = old_table.bucket_key;
+	new_table.bucket_len = rs->len;
+
+	to = old_table.bucket_len - rs->next < buckets ?
+		old_table.bucket_len : rs->next + buckets;
+
+	db_table_rehash(db, &old_table, &new_table, rs->next, to);
+	rs->next = to;
+	rs->left = old_table.bucket_len - to;
+
+	return DB_OK;
+}
+
+int
+db_reserve_end(db_t *db, db_resize_t *rs)
+{
+	db_table_t table;
+
+	if (rs->len == 0)
+		return DB_ERROR;
+
+	db_table_read(db, &table, rs->table);
+	if (table.bucket_off != rs->src)
+		return db_reserve_lost(db, rs);
+
+	if (rs->left != 0)
+		return DB_ERROR;
+
+	db_bucket_free(db, table.bucket_off, table.bucket_len);
+
+	table.bucket_off = rs->off + sizeof(uint32_t) * 2;
+	table.bucket_len = rs->len;
+	db_table_write(db, &table, rs->table);
+
+	if (db->db_reserve == rs)
+		db->db_reserve = NULL;
+	rs->len = 0;
+
+	return DB_OK;
+}
+
+int
+db_sync_begin(db_t *db, db_sync_t *sync)
+{
+	int        i;
+	db_file_t *file[2];
+
+	file[0] = db->db_data;
+	file[1] = db->db_index;
+
+	sync->n = 0;
+	if (db->db_data->rdonly)
+		return DB_OK;
+
+	/* pread backend, what is in the pool go to the file first */
+	for (i = 0; i < 2 && (i == 0 || file[1] != file[0]); i++) {
+		if (file[i]->map == NULL && db_pread_flush(file[i]) != DB_OK)
+			return DB_SYS_ERROR;
+	}
+
+	for (i = 0; i < 2 && (i == 0 || file[1] != file[0]); i++) {
+		sync->fd[i]  = file[i]->fd;
+		sync->map[i] = file[i]->map;
+		if (file[i]->map != NULL)
+			__atomic_add_fetch(&file[i]->map->ref, 1, __ATOMIC_RELAXED);
+		sync->n++;
+	}
+
+	return DB_OK;
+}
+
+/* a remap since begin leave the grown part to the next sync */
+int
+db_sync_end(db_sync_t *sync)
+{
+	int i;
+	int error = DB_OK;
+
+	for (i = 0; i < sync->n; i++) {
+		if (sync->map[i] != NULL) {
+			if (msync(sync->map[i]->buf, sync->map[i]->len,
+				MS_SYNC) == -1)
+			{
+				error = DB_SYS_ERROR;
+			}
+			db_map_put(sync->map[i]);
+		} else if (fdatasync(sync->fd[i]) == -1) {
+			error = DB_SYS_ERROR;
+		}
+	}
+	sync->n = 0;
+
+	return error;
+}
+
+int
+db_iter(db_t *db, db_iter_t *iter, const void *key, const uint32_t klen)
+{
+	uint64_t    i;
+	uint64_t    hash;
+	db_table_t  table;
+	db_bucket_t bucket;
+
+	iter->table_end = 0;
+	iter->data_off  = 0;
+	iter->data_end  = 0;
+	if (key == NULL || klen == 0) {
+		iter->table_off  = 0;
+		iter->bucket_off = 0;
+
+		return DB_OK;
+	}
+
+	if ((hash = db_key_hash(db, key, klen)) == 0)
+		return DB_ERROR;
+	db_table_read(db, &table, hash % db->db_table_len);
+
+	for (i = db_bucket_slot(db, hash, table.bucket_len);;
+	     i = (i + 1) % table.bucket_len)
+	{
+		db_bucket_read(db, &table, &bucket, i);
+
+		if (bucket.hash == 0)
+			break;
+
+		if (bucket.hash != hash)
+			continue;
+
+		if (db_key_equal(db, bucket.off, key, klen)) {
+			iter->table_off  = hash % db->db_table_len;
+			iter->bucket_off = i;
+
+			return DB_OK;
+		}
+	}
+
+	return DB_ERROR;
+}
+
+int
+db_iter_part(db_t *db, db_iter_t *iter, uint64_t part, uint64_t parts)
+{
+	if (part >= parts)
+		return DB_ERROR;
+
+	iter->table_off  = db->db_table_len * part / parts;
+	iter->table_end  = db->db_table_len * (part + 1) / parts;
+	iter->bucket_off = 0;
+	iter->data_off   = 0;
+	iter->data_end   = 0;
+
+	/* more parts than tables, an empty part */
+	if (iter->table_off == iter->table_end) {
+		iter->table_off = db->db_table_len;
+		iter->table_end = db->db_table_len;
+	}
+
+	return DB_OK;
+}
+
+int
+db_iter_log(db_t *db, db_iter_t *iter)
+{
+	db_file_header_t *header = db->db_data->header;
+
+	memset(iter, 0, sizeof(db_iter_t));
+
+	if (header->table_off != 0)	/* single file, skip table */
+		iter->data_off = header->table_off +
+			header->table_len * sizeof(db_table_t);
+	else
+		iter->data_off = header->data_head;
+	iter->data_end = header->data_tail;
+
+	db_file_likely(db->db_data, iter->data_off, DB_LOG_AHEAD);
+
+	return DB_OK;
+}
+
+/* the bucket of hash point at the record at off */
+static int
+db_record_live(db_t *db, uint64_t hash, uint64_t off)
+{
+	uint64_t    i;
+	db_table_t  table;
+	db_bucket_t bucket;
+
+	db_table_read(db, &table, hash % db->db_table_len);
+
+	for (i = db_bucket_slot(db, hash, table.bucket_len);;
+	     i = (i + 1) % table.bucket_len)
+	{
+		db_bucket_read(db, &table, &bucket, i);
+
+		if (bucket.hash == 0)
+			return 0;
+
+		if (bucket.hash == hash && bucket.off == off)
+			return 1;
+	}
+}
+
+/*
+ * next live record in log order, like db_build_scan, but an old
+ * version, a deleted key or a record not in the index is skipped
+ */
+static int
+db_iter_log_seek(db_t *db, db_iter_t *iter, uint64_t *rec)
+{
+	uint64_t off;
+	uint64_t next;
+	uint64_t hash;
+	uint32_t len[2];
+	uint8_t  buf[256];
+	uint8_t *key;
+
+	while ((off = iter->data_off) + sizeof(len) <= iter->data_end) {
+		db_file_read(db->db_data, len, off, sizeof(len));
+
+		next = off + sizeof(len) + len[0] + len[1];
+		if (next > iter->data_end)
+			break;		/* torn record at tail */
+		iter->data_off = next;
+
+		/* into the next window, read ahead the one after */
+		if ((off >> DB_LOG_AHEAD_SHIFT) != (next >> DB_LOG_AHEAD_SHIFT)) {
+			db_file_likely(db->db_data,
+				((next >> DB_LOG_AHEAD_SHIFT) + 1) << DB_LOG_AHEAD_SHIFT,
+				DB_LOG_AHEAD);
+		}
+
+		/* klen 0 is a table or filler, vlen 0 is a delete */
+		if (len[0] == 0 || db_record_dead(db, off, len))
+			continue;
+
+		/* stay on the record, the next call try it again */
+		key = buf;
+		if (len[0] > sizeof(buf) && (key = malloc(len[0])) == NULL) {
+			iter->data_off = off;
+			return DB_SYS_ERROR;
+		}
+		db_file_read(db->db_data, key, off + sizeof(len), len[0]);
+		hash = db_key_hash(db, key, len[0]);
+		if (key != buf)
+			free(key);
+
+		if (hash != 0 && db_record_live(db, hash, off)) {
+			*rec = off;
+			return DB_OK;
+		}
+	}
+	iter->data_off = iter->data_end;
+
+	return DB_ERROR;
+}
+
+/* *rec the offset of the next live record, DB_ERROR at the end */
+static int
+db_iter_seek(db_t *db, db_iter_t *iter, uint64_t *rec)
+{
+	uint64_t i;
+	uint64_t j;
+	uint64_t end;
+
+	if (iter->data_off != 0)
+		return db_iter_log_seek(db, iter, rec);
+
+	end = iter->table_end ? iter->table_end : db->db_table_len;
+
+	for (i = iter->table_off; i < end; i++) {
+		db_table_t table;
+
+		db_table_read(db, &table, i);
+
+		/* scan walk tables in order, read ahead the next one */
+		if (iter->bucket_off == 0 && i + 1 < end) {
+			db_table_t next;
+
+			db_table_read(db, &next, i + 1);
+			db_file_likely(db->db_index, next.bucket_off,
+				next.bucket_len * sizeof(db_bucket_t));
+		}
+
+		for (j = iter->bucket_off; j < table.bucket_len; j++) {
+			uint32_t    len[2];
+			db_bucket_t bucket;
+
+			db_bucket_read(db, &table, &bucket, j);
+			if (bucket.hash == 0)
+				continue;
+
+			db_file_read(db->db_data, len, bucket.off, sizeof(len));
+			if (db_record_dead(db, bucket.off, len))
+				continue;
+
+			iter->bucket_off = j + 1;
+			*rec = bucket.off;
+			return DB_OK;
+		}
+		iter->table_off += 1;
+		iter->bucket_off = 0;
+	}
+
+	return DB_ERROR;
+}
+
+int
+db_iter_next(db_t *db, db_iter_t *iter,
+        void *key, uint32_t *klen, void *val, uint32_t *vlen)
+{
+	int      error;
+	uint64_t off;
+	uint32_t dbklen;
+	uint32_t dbvlen;
+
+	if ((error = db_iter_seek(db, iter, &off)) != DB_OK)
+		return error;
+
+	off += db_file_read(db->db_data, &dbklen, off, sizeof(dbklen));
+	off += db_file_read(db->db_data, &dbvlen, off, sizeof(dbvlen));
+	dbvlen = db_value_len(db, dbvlen);
+
+	if (dbklen < *klen)
+		*klen = dbklen;
+
+	if (dbvlen < *vlen)
+		*vlen = dbvlen;
+
+	off += db_file_read(db->db_data, key, off, *klen);
+	off += db_file_read(db->db_data, val, off, *vlen);
+
+	*klen = dbklen;
+	*vlen = dbvlen;
+
+	return DB_OK;
+}
+
+int
+db_iter_view(db_t *db, db_iter_t *iter, db_view_t *view)
+{
+	int      error;
+	uint64_t off;
+
+	if ((error = db_iter_seek(db, iter, &off)) != DB_OK)
+		return error;
+	return db_view_record(db, off, view);
+}
+
+/*
+ * parallel scan, parts are a few times the threads so a slow
+ * part (big tables, cold pages) don't hold the others back
+ */
+#define DB_SCAN_PARTS	16
+
+typedef struct db_scan {
+	db_t       *db;
+	uint64_t    parts;
+	uint64_t    next;	/* next part to take	*/
+	int         error;	/* set stop every worker */
+
+	db_scan_fn  fn;		/* NULL sum sizes only	*/
+	void       *data;
+	uint64_t   *size;	/* data bytes per worker */
+} db_scan_t;
+
+typedef struct db_scan_worker {
+	db_scan_t *scan;
+	uint64_t   id;
+} db_scan_worker_t;
+
+static void *
+db_scan_thread(void *arg)
+{
+	int        error;
+	uint64_t   part;
+	uint32_t   klen;
+	uint32_t   vlen;
+	db_iter_t  iter;
+	db_view_t  view;
+	db_scan_worker_t *worker = arg;
+	db_scan_t        *scan   = worker->scan;
+
+	while (__atomic_load_n(&scan->error, __ATOMIC_RELAXED) == DB_OK) {
+		part = __atomic_fetch_add(&scan->next, 1, __ATOMIC_RELAXED);
+		if (part >= scan->parts)
+			break;
+		db_iter_part(scan->db, &iter, part, scan->parts);
+
+		if (scan->fn == NULL) {
+			klen = 0;
+			vlen = 0;
+			while ((error = db_iter_next(scan->db, &iter,
+				NULL, &klen, NULL, &vlen)) == DB_OK)
+			{
+				scan->size[worker->id] += klen;
+				scan->size[worker->id] += vlen;
+				klen = 0;
+				vlen = 0;
+			}
+			if (error == DB_SYS_ERROR)
+				__atomic_store_n(&scan->error, error,
+					__ATOMIC_RELAXED);
+			continue;
+		}
+
+		while ((error = db_iter_view(scan->db, &iter, &view)) == DB_OK) {
+			error = scan->fn(scan->data, worker->id, &view);
+			db_view_release(&view);
+			if (error != DB_OK) {
+				__atomic_store_n(&scan->error, error,
+					__ATOMIC_RELAXED);
+				break;
+			}
+		}
+		if (error == DB_SYS_ERROR)
+			__atomic_store_n(&scan->error, error, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+static int
+db_scan_run(db_scan_t *scan, uint64_t threads)
+{
+	uint64_t i;
+	pthread_t        *tid;
+	db_scan_worker_t *worker;
+
+	scan->parts = scan->db->db_table_len;
+	if (threads == 0)
+		threads = 1;
+	if (threads > scan->parts)
+		threads = scan->parts;
+	if (scan->parts > threads * DB_SCAN_PARTS)
+		scan->parts = threads * DB_SCAN_PARTS;
+	scan->next  = 0;
+	scan->error = DB_OK;
+
+	tid    = calloc(threads, sizeof(pthread_t));
+	worker = calloc(threads, sizeof(db_scan_worker_t));
+	if (tid == NULL || worker == NULL) {
+		free(tid);
+		free(worker);
+		return DB_SYS_ERROR;
+	}
+
+	for (i = 0; i < threads; i++) {
+		worker[i].scan = scan;
+		worker[i].id   = i;
+
+		if (pthread_create(&tid[i], NULL, db_scan_thread, &worker[i]) != 0) {
+			db_scan_thread(&worker[i]);
+			worker[i].scan = NULL;
+		}
+	}
+
+	for (i = 0; i < threads; i++) {
+		if (worker[i].scan != NULL)
+			pthread_join(tid[i], NULL);
+	}
+
+	free(tid);
+	free(worker);
+
+	return scan->error;
+}
+
+int
+db_scan(db_t *db, uint64_t threads, db_scan_fn fn, void *data)
+{
+	db_scan_t scan;
+
+	memset(&scan, 0, sizeof(scan));
+	scan.db   = db;
+	scan.fn   = fn;
+	scan.data = data;
+
+	return db_scan_run(&scan, threads);
+}
+
+int
+db_stat(db_t *db, db_stat_t *stat)
+{
+	int error;
+	long cpu;
+	uint64_t i;
+	uint64_t threads;
+
+	db_scan_t scan;
+
+	memset(stat, 0, sizeof(db_stat_t));
+
+	stat->db_file_size = db_file_size(db->db_data);
+	stat->db_resident_size = __atomic_load_n(&db->db_data->resident,
+		__ATOMIC_RELAXED) << DB_REGION_SHIFT;
+
+	stat->db_table_min = UINT32_MAX;
+	for (i = 0; i < db->db_table_len; i++) {
+		db_table_t table;
+		db_table_read(db, &table, i);
+
+		if (table.bucket_key > stat->db_table_max)
+			stat->db_table_max = table.bucket_key;
+
+		if (table.bucket_key < stat->db_table_min)
+			stat->db_table_min = table.bucket_key;
+		stat->db_table_total  += table.bucket_key;
+		stat->db_bucket_total += table.bucket_len;
+	}
+	stat->db_table_size  = stat->db_table_total * sizeof(db_table_t);
+	stat->db_bucket_size = stat->db_bucket_total * sizeof(db_bucket_t);
+
+	/* the data size read every record header, a thread per cpu */
+	cpu     = sysconf(_SC_NPROCESSORS_ONLN);
+	threads = cpu > 0 ? cpu : 1;
+	if (threads > db->db_table_len)
+		threads = db->db_table_len;
+
+	memset(&scan, 0, sizeof(scan));
+	scan.db   = db;
+	scan.size = calloc(threads, sizeof(uint64_t));
+	if (scan.size == NULL)
+		return DB_SYS_ERROR;
+
+	if ((error = db_scan_run(&scan, threads)) == DB_OK) {
+		for (i = 0; i < threads; i++)
+			stat->db_data_size += scan.size[i];
+	}
+	free(scan.size);
+
+	if (error != DB_OK)
+		return error;
+	return DB_OK;
+}
+
+/*
+ * index build, used by rebuild and bulk load
+ *
+ * (hash, off) of every record go to the part of its table in log
+ * order, then threads take tables round robin: drop the old version
+ * of a key and the deleted keys, size the table once and fill it.
+ */
+typedef struct db_build_part {
+	db_bucket_t *entry;
+	uint64_t     len;
+	uint64_t     max;
+
+	uint64_t     bucket_off;
+	uint64_t     bucket_len;
+} db_build_part_t;
+
+typedef struct db_build {
+	db_t            *db;
+	db_build_part_t *part;		/* one per table	*/
+	uint64_t         bucket;	/* min bucket per table	*/
+	int              error;
+} db_build_t;
+
+typedef struct db_build_worker {
+	db_build_t *build;
+	uint64_t    id;
+	uint64_t    threads;
+} db_build_worker_t;
+
+/* records at a and b have the same key */
+static int
+db_record_equal(db_t *db, uint64_t a, uint64_t b)
+{
+	uint8_t  buf[1024];
+	uint32_t alen;
+	uint32_t blen;
+	uint32_t i;
+	uint32_t n;
+
+	if (db->db_flags & DB_FLAG_INTKEY)	/* hash already matched */
+		return 1;
+
+	db_file_read(db->db_data, &alen, a, sizeof(alen));
+	db_file_read(db->db_data, &blen, b, sizeof(blen));
+	if (alen != blen)
+		return 0;
+
+	a += sizeof(uint32_t) * 2;
+	b += sizeof(uint32_t) * 2;
+	for (i = 0; i < alen; i += n) {
+		n = alen - i < sizeof(buf) ? alen - i : sizeof(buf);
+
+		db_file_read(db->db_data, buf, a + i, n);
+		if (db_file_compare(db->db_data, buf, b + i, n) != 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+static int
+db_build_init(db_build_t *build, db_t *db, uint64_t bucket, uint64_t expect)
+{
+	uint64_t i;
+
+	memset(build, 0, sizeof(db_build_t));
+
+	build->db     = db;
+	build->error  = DB_OK;
+	build->bucket = bucket ? bucket : 1;
+	build->part   = calloc(db->db_table_len, sizeof(db_build_part_t));
+	if (build->part == NULL)
+		return DB_SYS_ERROR;
+
+	/* room for the expected keys, plus a little skew */
+	expect = expect / db->db_table_len;
+	expect = expect + expect / 8;
+	for (i = 0; expect > 0 && i < db->db_table_len; i++) {
+		build->part[i].entry = malloc(expect * sizeof(db_bucket_t));
+		if (build->part[i].entry == NULL)
+			break;
+		build->part[i].max = expect;
+	}
+
+	return DB_OK;
+}
+
+static void
+db_build_free(db_build_t *build)
+{
+	uint64_t i;
+
+	for (i = 0; i < build->db->db_table_len; i++)
+		free(build->part[i].entry);
+	free(build->part);
+}
+
+static int
+db_build_add(db_build_t *build, uint64_t hash, uint64_t off)
+{
+	db_build_part_t *part;
+
+	part = &build->part[hash % build->db->db_table_len];
+	if (part->len == part->max) {
+		db_bucket_t *entry;
+		uint64_t     max = part->max ? part->max * 2 : 64;
+
+		entry = realloc(part->entry, max * sizeof(db_bucket_t));
+		if (entry == NULL)
+			return DB_SYS_ERROR;
+		part->entry = entry;
+		part->max   = max;
+	}
 
-	db->db_data->header->data_head  = sizeof(db_file_header_t);
-	db->db_data->header->data_tail  = db->db_data->buflen;
+	part->entry[part->len].hash = hash;
+	part->entry[part->len].off  = off;
+	part->len++;
 
 	return DB_OK;
 }
 
-int
-db_open(db_t *db, const char *data, const char *index, const db_option_t *option)
+/* keep the last live record of every key, in place */
+static int
+db_build_dedupe(db_build_t *build, db_build_part_t *part)
 {
-	int init;
-	int error;
+	uint64_t  i;
+	uint64_t  j;
+	uint64_t  n;
+	uint64_t  len;
+	uint64_t *slot;
+	uint32_t  rec[2];
+	db_t     *db = build->db;
+
+	for (len = 2; len < part->len * 2; len *= 2)
+		;
+	if ((slot = calloc(len, sizeof(uint64_t))) == NULL)
+		return DB_SYS_ERROR;
 
-	memset(db, 0, sizeof(struct db));
+	for (i = 0; i < part->len; i++) {
+		db_bucket_t *entry = &part->entry[i];
 
-	if (index != NULL && strcmp(index, data) == 0)
-		index = NULL;
+		for (j = entry->hash & (len - 1);; j = (j + 1) & (len - 1)) {
+			db_bucket_t *prev;
 
-	db->db_data = &db->db_file_data;
-	if ((error = db_file_open(db->db_data, data, option->rdonly)) != DB_OK)
-		return error;
+			if (slot[j] == 0) {
+				slot[j] = i + 1;
+				break;
+			}
 
-	if (index != NULL) {		/* separate index and data file */
-		db->db_index = &db->db_file_index;
-		if ((error = db_file_open(db->db_index, index, option->rdonly)) != DB_OK)
-			return error;
-	} else {
-		db->db_index = &db->db_file_data;
+			prev = &part->entry[slot[j] - 1];
+			if (prev->hash == entry->hash &&
+			    db_record_equal(db, prev->off, entry->off))
+			{
+				prev->off   = entry->off;
+				entry->hash = 0;	/* drop it */
+				break;
+			}
+		}
 	}
+	free(slot);
 
-	init  = db_file_size(db->db_index);
-	error = db_file_init(db->db_index, sizeof(db_file_header_t));
-	if (error != DB_OK)
-		return error;
+	for (i = 0, n = 0; i < part->len; i++) {
+		if (part->entry[i].hash == 0)
+			continue;
 
-	if (!init && !option->rdonly) {
-		error = db_index_init(db, option->table, option->bucket);
-		if (error != DB_OK)
-			return error;
+		db_file_read(db->db_data, rec, part->entry[i].off, sizeof(rec));
+		if (db_record_dead(db, part->entry[i].off, rec))
+			continue;	/* deleted or expired */
+
+		part->entry[n++] = part->entry[i];
 	}
-	db->db_table_len = db->db_index->header->table_len;
+	part->len = n;
 
-	init  = db_file_size(db->db_data);
-	error = db_file_init(db->db_data, sizeof(db_file_header_t));
-	if (error != DB_OK)
-		return error;
+	/* same load as db_put keep */
+	part->bucket_len = build->bucket;
+	if (db_bucket_full(db, part->len + 1, part->bucket_len))
+		part->bucket_len = db_bucket_grow(db, part->bucket_len,
+					part->len + 1);
 
-	if (!init) {
-		if ((error = db_data_init(db)) != DB_OK)
-			return error;
-	}
+	return DB_OK;
+}
 
-	if (db->db_index->header->version != DB_VERSION ||
-	    db->db_data->header->version != DB_VERSION)
-	{
-		return DB_SYS_ERROR;
-	}
+static int
+db_build_fill(db_build_t *build, db_build_part_t *part)
+{
+	uint64_t     i;
+	uint64_t     j;
+	db_bucket_t *bucket;
 
-	if (db->db_index->header->magic != DB_MAGIC && 
-	    db->db_index->header->magic != DB_MAGIC_INDEX)
-	{
+	bucket = calloc(part->bucket_len, sizeof(db_bucket_t));
+	if (bucket == NULL)
 		return DB_SYS_ERROR;
-	}
 
-	if (db->db_data->header->magic != DB_MAGIC && 
-	    db->db_data->header->magic != DB_MAGIC_DATA)
-	{
-		return DB_SYS_ERROR;
+	for (i = 0; i < part->len; i++) {
+		for (j = db_bucket_slot(build->db, part->entry[i].hash,
+				part->bucket_len);;
+		     j = (j + 1) % part->bucket_len)
+		{
+			if (bucket[j].hash == 0) {
+				bucket[j] = part->entry[i];
+				break;
+			}
+		}
 	}
 
-	db_file_likely(db->db_data, 0, sizeof(*db->db_data->header));
+	db_file_write(build->db->db_index, bucket, part->bucket_off,
+		part->bucket_len * sizeof(db_bucket_t));
+
+	free(bucket);
+	free(part->entry);
+	part->entry = NULL;
+	part->max   = 0;
 
 	return DB_OK;
 }
 
-int
-db_put(db_t *db, const void *key, uint32_t klen, const void *val, uint32_t vlen)
+static void *
+db_build_dedupe_thread(void *arg)
 {
 	uint64_t i;
-	uint64_t len;
-	uint64_t data;
+	db_build_worker_t *worker = arg;
+	db_build_t        *build  = worker->build;
 
-	uint64_t    hash;
-	db_table_t  table;
-	db_bucket_t bucket;
+	for (i = worker->id; i < build->db->db_table_len; i += worker->threads) {
+		if (db_build_dedupe(build, &build->part[i]) != DB_OK)
+			build->error = DB_SYS_ERROR;
+	}
+	return NULL;
+}
 
-	hash = db_hash(key, klen);
-	db_table_read(db, &table, hash % db->db_index->header->table_len);
+static void *
+db_build_fill_thread(void *arg)
+{
+	uint64_t i;
+	db_build_worker_t *worker = arg;
+	db_build_t        *build  = worker->build;
 
-	if (((table.bucket_key + 1) * 2) > table.bucket_len) {
-		if (db_table_resize(db, hash % db->db_table_len,
-					table.bucket_len * 2) != DB_OK)
-		{
-			return DB_SYS_ERROR;
-		}
-		db_table_read(db, &table, hash % db->db_table_len);
+	for (i = worker->id; i < build->db->db_table_len; i += worker->threads) {
+		if (db_build_fill(build, &build->part[i]) != DB_OK)
+			build->error = DB_SYS_ERROR;
 	}
+	return NULL;
+}
 
-	len  = sizeof(uint32_t) * 2 + klen + vlen;
-
-	data = db_file_alloc(db->db_data, len);
-	if (data == 0)
+static int
+db_build_run(db_build_t *build, uint64_t threads, void *(*fn)(void *))
+{
+	uint64_t i;
+	pthread_t         *tid;
+	db_build_worker_t *worker;
+
+	if (threads == 0)
+		threads = 1;
+	if (threads > build->db->db_table_len)
+		threads = build->db->db_table_len;
+
+	tid    = calloc(threads, sizeof(pthread_t));
+	worker = calloc(threads, sizeof(db_build_worker_t));
+	if (tid == NULL || worker == NULL) {
+		free(tid);
+		free(worker);
 		return DB_SYS_ERROR;
+	}
 
-	data += db_file_write(db->db_data, &klen, data, sizeof(uint32_t));
-	data += db_file_write(db->db_data, &vlen, data, sizeof(uint32_t));                       
-	data += db_file_write(db->db_data, key, data, klen);
-	data += db_file_write(db->db_data, val, data, vlen);
-
-	bucket.hash = hash;
-	bucket.off  = data - len;
-
-	for (i = hash % table.bucket_len;; i = (i + 1) % table.bucket_len) {
-		db_bucket_t db_bucket;
-
-		db_bucket_read(db, &table, &db_bucket, i);
-		if (db_bucket.hash != 0) {
-			uint64_t koff;
+	for (i = 0; i < threads; i++) {
+		worker[i].build   = build;
+		worker[i].id      = i;
+		worker[i].threads = threads;
 
-			if (db_bucket.hash != bucket.hash)
-				continue;
-			if (db_file_compare(db->db_data, &klen, db_bucket.off,
-						sizeof(klen)) != 0)
-			{
-				continue;
-			}
-			koff = db_bucket.off + sizeof(klen) + sizeof(vlen);
-			if (db_file_compare(db->db_data, key, koff, klen) != 0)
-				continue;
+		if (pthread_create(&tid[i], NULL, fn, &worker[i]) != 0) {
+			fn(&worker[i]);
+			worker[i].build = NULL;
 		}
+	}
 
-		db_bucket_write(db, &table, &bucket, i);
+	for (i = 0; i < threads; i++) {
+		if (worker[i].build != NULL)
+			pthread_join(tid[i], NULL);
+	}
 
-		if (db_bucket.hash == 0) {
-			table.bucket_key += 1;
-			db_table_write(db, &table, hash % db->db_table_len);
-		}
-		return DB_OK;
-	} 
+	free(tid);
+	free(worker);
 
-	return DB_SYS_ERROR;
+	return build->error;
 }
 
-uint32_t
-db_get(db_t *db, const void *key, uint32_t klen, void *val, uint32_t vlen)
+static int
+db_build_finish(db_build_t *build, uint64_t threads)
 {
 	uint64_t i;
+	uint64_t off;
+	uint32_t klen;
+	uint32_t vlen;
+	db_t    *db = build->db;
 
-	uint64_t    hash;
-	db_table_t  table;
-	db_bucket_t bucket;
+	if (db_build_run(build, threads, db_build_dedupe_thread) != DB_OK)
+		return DB_SYS_ERROR;
 
-	hash = db_hash(key, klen);
-	db_table_read(db, &table, hash % db->db_table_len);
+	/* allocate every table first, no remap while threads write */
+	for (i = 0; i < db->db_table_len; i++) {
+		db_build_part_t *part = &build->part[i];
 
-	for (i = hash % table.bucket_len;; i = (i + 1) % table.bucket_len) {
-		uint64_t koff;
+		vlen = part->bucket_len * sizeof(db_bucket_t);
+		off  = db_file_alloc(db->db_index, vlen + sizeof(klen) + sizeof(vlen));
+		if (off == 0)
+			return DB_SYS_ERROR;
 
-		db_bucket_read(db, &table, &bucket, i);
+		klen = 0;
+		off += db_file_write(db->db_index, &klen, off, sizeof(klen));
+		off += db_file_write(db->db_index, &vlen, off, sizeof(vlen));
 
-		if (bucket.hash == 0)
-			break;
+		db_region_pin(db->db_index, off, vlen);
+		part->bucket_off = off;
+	}
 
-		if (bucket.hash != hash)
-			continue;
+	if (db_build_run(build, threads, db_build_fill_thread) != DB_OK)
+		return DB_SYS_ERROR;
 
-		if (db_file_compare(db->db_data, &klen, bucket.off,
-					sizeof(klen)) != 0)
-		{
-			continue;
-		}
-	
-		koff = bucket.off + sizeof(klen) + sizeof(vlen);
-		if (db_file_compare(db->db_data, key, koff, klen) == 0) {
-			uint32_t len;
+	for (i = 0; i < db->db_table_len; i++) {
+		db_table_t table;
 
-			db_file_read(db->db_data, &len,
-					bucket.off + sizeof(klen), sizeof(len));
+		db_table_read(db, &table, i);
+		db_bucket_free(db, table.bucket_off, table.bucket_len);
 
-			if (len < vlen)
-				vlen = len;
-				
-			db_file_read(db->db_data, val, koff + klen, vlen);
-			return len;
-		}
+		table.bucket_off = build->part[i].bucket_off;
+		table.bucket_key = build->part[i].len;
+		table.bucket_len = build->part[i].bucket_len;
+		db_table_write(db, &table, i);
 	}
 
-	return 0;
+	return db->db_error == 0 ? DB_OK : DB_SYS_ERROR;
 }
 
-int
-db_del(db_t *db, const void *key, uint32_t klen)
+/* walk the data log from off to end, like db-data.py */
+static int
+db_build_scan_range(db_build_t *build, uint64_t off, uint64_t end)
 {
-	return db_put(db, key, klen, NULL, 0);
+	uint32_t klen;
+	uint32_t vlen;
+	uint32_t max;
+	uint8_t *key;
+	uint64_t hash;
+	db_t    *db = build->db;
+
+	max = 0;
+	key = NULL;
+
+	db_file_advise(db->db_data, off, end - off, DB_FILE_ADVISE_SEQUENTIAL);
+
+	while (off + sizeof(klen) + sizeof(vlen) <= end) {
+		db_file_read(db->db_data, &klen, off, sizeof(klen));
+		db_file_read(db->db_data, &vlen, off + sizeof(klen), sizeof(vlen));
+
+		if (off + sizeof(klen) + sizeof(vlen) + klen + vlen > end)
+			break;		/* torn record at tail */
+
+		if (klen != 0) {	/* klen 0 is table in single file */
+			if (klen > max) {
+				uint8_t *p = realloc(key, klen);
+				if (p == NULL) {
+					free(key);
+					return DB_SYS_ERROR;
+				}
+				key = p;
+				max = klen;
+			}
+			db_file_read(db->db_data, key,
+				off + sizeof(klen) + sizeof(vlen), klen);
+
+			hash = db_key_hash(db, key, klen);
+			if (hash != 0 && db_build_add(build, hash, off) != DB_OK) {
+				free(key);
+				return DB_SYS_ERROR;
+			}
+		}
+
+		off += sizeof(klen) + sizeof(vlen) + klen + vlen;
+	}
+
+	db_file_advise(db->db_data, 0, db->db_data->size, DB_FILE_ADVISE_RANDOM);
+
+	free(key);
+	return DB_OK;
 }
 
-int
-db_iter(db_t *db, db_iter_t *iter, const void *key, const uint32_t klen)
+/* log order, a ring start after its head where the oldest records are */
+static int
+db_build_scan(db_build_t *build)
 {
-	uint64_t    i;
-	uint64_t    hash;
-	db_table_t  table;
-	db_bucket_t bucket;
+	uint64_t off;
+	db_t    *db = build->db;
+	db_file_header_t *header = db->db_data->header;
 
-	if (key == NULL || klen == 0) {
-		iter->table_off  = 0;
-		iter->bucket_off = 0;
+	if (header->table_off != 0)	/* single file, skip table */
+		off = header->table_off + header->table_len * sizeof(db_table_t);
+	else
+		off = header->data_head;
 
-		return DB_OK;
-	}
+	if (!(db->db_flags & DB_FLAG_CACHE))
+		return db_build_scan_range(build, off, header->data_tail);
 
-	hash = db_hash(key, klen);
-	db_table_read(db, &table, hash % db->db_table_len);
+	if (db_build_scan_range(build, header->cache_head,
+				header->data_tail) != DB_OK)
+		return DB_SYS_ERROR;
+	return db_build_scan_range(build, off, header->cache_head);
+}
 
-	for (i = hash % table.bucket_len;; i = (i + 1) % table.bucket_len) {
-		uint64_t koff;
+int
+db_rebuild_index(const char *data, const char *index,
+	const db_option_t *option, uint64_t threads)
+{
+	int error;
+	db_t db;
+	db_build_t  build;
+	db_option_t opt;
 
-		db_bucket_read(db, &table, &bucket, i);
+	opt = *option;
+	opt.rdonly = 0;
+	opt.memory = 0;
+	opt.warmup = 0;
 
-		if (bucket.hash == 0)
-			break;
+	if (index != NULL && strcmp(index, data) == 0)
+		index = NULL;
 
-		if (bucket.hash != hash)
-			continue;
+	/* throw the old index away, db_open create an empty one */
+	if (index != NULL) {
+		int fd = open(index, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1)
+			return DB_SYS_ERROR;
+		close(fd);
+		opt.bucket = 1;
+	}
 
-		if (db_file_compare(db->db_data, &klen, bucket.off,
-					sizeof(klen)) != 0)
-		{
-			continue;
-		}
-	
-		koff = bucket.off + sizeof(klen) + sizeof(uint32_t);
-		if (db_file_compare(db->db_data, key, koff, klen) == 0) {
-			iter->table_off  = hash % table.bucket_len;
-			iter->bucket_off = i;
+	if ((error = db_open(&db, data, index, &opt)) != DB_OK)
+		return error;
 
-			return DB_OK;
-		}
+	if ((error = db_build_init(&build, &db, option->bucket, 0)) != DB_OK) {
+		db_close(&db);
+		return error;
 	}
 
-	return DB_ERROR;
+	if ((error = db_build_scan(&build)) == DB_OK)
+		error = db_build_finish(&build, threads);
+
+	db_build_free(&build);
+
+	if (db_close(&db) != DB_OK)
+		return DB_SYS_ERROR;
+	return error;
 }
 
 int
-db_iter_next(db_t *db, db_iter_t *iter,
-        void *key, uint32_t *klen, void *val, uint32_t *vlen)
+db_bulk_begin(db_t *db, db_bulk_t *bulk, uint64_t expect)
 {
 	uint64_t i;
 	uint64_t j;
+	db_table_t  table;
+	db_bucket_t bucket;
 
-	for (i = iter->table_off; i < db->db_table_len; i++) {
-		db_table_t table;
+	if (db->db_flags & DB_FLAG_CACHE)
+		return DB_ERROR;	/* unindexed records in the ring */
+
+	bulk->db    = db;
+	bulk->tail  = db->db_data->header->data_tail;
+	bulk->build = malloc(sizeof(db_build_t));
+	if (bulk->build == NULL)
+		return DB_SYS_ERROR;
+
+	if (db_build_init(bulk->build, db, 0, expect) != DB_OK) {
+		free(bulk->build);
+		return DB_SYS_ERROR;
+	}
 
+	/* keys already in, older than everything put from now */
+	for (i = 0; i < db->db_table_len; i++) {
 		db_table_read(db, &table, i);
-		for (j = iter->bucket_off; j < table.bucket_len; j++) {
-			uint64_t off;
-			uint32_t dbklen;
-			uint32_t dbvlen;
-			db_bucket_t bucket;
 
+		/* new tables are never smaller than the smallest now */
+		if (i == 0 || table.bucket_len < bulk->build->bucket)
+			bulk->build->bucket = table.bucket_len;
+
+		for (j = 0; j < table.bucket_len; j++) {
 			db_bucket_read(db, &table, &bucket, j);
 			if (bucket.hash == 0)
 				continue;
-
-			off = bucket.off;
-			off += db_file_read(db->db_data, &dbklen, off,
-						sizeof(dbklen));
-			off += db_file_read(db->db_data, &dbvlen, off,
-						sizeof(dbvlen));
-
-			if (dbvlen == 0)
-				continue;
-
-			if (dbklen < *klen)
-				*klen = dbklen;
-
-			if (dbvlen < *vlen)
-				*vlen = dbvlen;
-
-			off += db_file_read(db->db_data, key, off, *klen);
-			off += db_file_read(db->db_data, val, off, *vlen);
-
-			*klen = dbklen;
-			*vlen = dbvlen;
-
-			iter->bucket_off = j + 1;
-			return DB_OK;
+			if (db_build_add(bulk->build, bucket.hash, bucket.off) != DB_OK) {
+				db_build_free(bulk->build);
+				free(bulk->build);
+				return DB_SYS_ERROR;
+			}
 		}
-		iter->table_off += 1;
-		iter->bucket_off = 0;
 	}
 
-	return DB_SYS_ERROR;
+	return DB_OK;
 }
 
 int
-db_stat(db_t *db, db_stat_t *stat)
+db_bulk_put(db_bulk_t *bulk, const void *key, uint32_t klen,
+	const void *val, uint32_t vlen)
 {
-	int error;
-	uint64_t i;
-	uint32_t klen;
-	uint32_t vlen;
+	return db_bulk_put_meta(bulk, key, klen, val, vlen, NULL);
+}
+
+int
+db_bulk_put_meta(db_bulk_t *bulk, const void *key, uint32_t klen,
+	const void *val, uint32_t vlen, const db_meta_t *meta)
+{
+	uint64_t  data;
+	uint64_t  hash;
+	db_meta_t stamp;
 
-	db_iter_t iter;
+	if ((hash = db_key_hash(bulk->db, key, klen)) == 0)
+		return DB_ERROR;
+	if ((uint64_t)klen + vlen + db_meta_len(bulk->db) > UINT32_MAX)
+		return DB_ERROR;
 
-	memset(stat, 0, sizeof(db_stat_t));
+	db_meta_stamp(bulk->db, meta, &stamp);
+	data = db_record_append(bulk->db, key, klen, val, vlen, &stamp);
+	if (data == 0)
+		return DB_SYS_ERROR;
 
-	stat->db_file_size = db_file_size(db->db_data);
+	return db_build_add(bulk->build, hash, data);
+}
 
-	stat->db_table_min = UINT32_MAX;
-	for (i = 0; i < db->db_table_len; i++) {
-		db_table_t table;
-		db_table_read(db, &table, i);
+int
+db_bulk_end(db_bulk_t *bulk, uint64_t threads)
+{
+	int error;
 
-		if (table.bucket_key > stat->db_table_max)
-			stat->db_table_max = table.bucket_key;
+	error = db_build_finish(bulk->build, threads);
 
-		if (table.bucket_key < stat->db_table_min)
-			stat->db_table_min = table.bucket_key;
-		stat->db_table_total  += table.bucket_key;
-		stat->db_bucket_total += table.bucket_len;
-	}
-	stat->db_table_size  = stat->db_table_total * sizeof(db_table_t);
-	stat->db_bucket_size = stat->db_bucket_total * sizeof(db_bucket_t);
+	db_build_free(bulk->build);
+	free(bulk->build);
+	bulk->build = NULL;
 
-        if ((error = db_iter(db, &iter, NULL, 0)) != DB_OK)
-		return error;
+	return error;
+}
 
-	klen = 0;
-	vlen = 0;
-        while (db_iter_next(db, &iter, NULL, &klen, NULL, &vlen) == DB_OK) {
-		stat->db_data_size += klen;
-		stat->db_data_size += vlen;
-		klen = 0;
-		vlen = 0;
-        }
+void
+db_bulk_abort(db_bulk_t *bulk)
+{
+	db_build_free(bulk->build);
+	free(bulk->build);
+	bulk->build = NULL;
 
-	return DB_OK;
+	bulk->db->db_data->header->data_tail = bulk->tail;
 }
 
 int
 db_close(db_t *db)
 {
-	return db_file_close(db->db_data);
+	int error = DB_OK;
+
+	if (db->db_index != db->db_data && db_file_close(db->db_index) != DB_OK)
+		error = DB_SYS_ERROR;
+	if (db_file_close(db->db_data) != DB_OK)
+		error = DB_SYS_ERROR;
+
+	db_pool_destroy(db->db_pool);
+
+	return error;
 }
@@ -4,8 +4,21 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 enum {DB_SYS_ERROR = -1, DB_ERROR = 0, DB_OK = 1};
 
+/* db_store, db_incr: the key is there but the change was not made */
+enum {DB_EXISTS = 2};
+
+/* db_store mode, the memcached storage commands */
+enum {DB_STORE_SET, DB_STORE_ADD, DB_STORE_REPLACE,
+      DB_STORE_APPEND, DB_STORE_PREPEND, DB_STORE_CAS};
+
+enum {DB_BACKEND_MMAP = 0, DB_BACKEND_PREAD = 1};
+
 typedef struct db_table {
         uint64_t bucket_off;	/* offset in file	*/
         uint64_t bucket_key;	/* key in use		*/
@@ -17,11 +30,129 @@ typedef struct db_bucket {
         uint64_t off;		/* offset in file	*/
 } db_bucket_t;
 
+/*
+ * memcached flags and expire time of a record (option.expire),
+ * also the disk format, it follow the value.  an option.cas db
+ * add the version, bumped by every put, other db store up to it.
+ */
+typedef struct db_meta {
+	uint32_t flags;
+	uint32_t expire;	/* unix time, 0 never	*/
+	uint64_t cas;		/* option.cas db, 0 never used */
+} db_meta_t;
+
+typedef struct db_aget {
+	const void *key;	/* keep key and val until done	*/
+	uint32_t    klen;
+	void       *val;
+	uint32_t    vlen;	/* val size in, value length out */
+	int         error;	/* DB_OK, DB_ERROR not found	*/
+	db_meta_t   meta;	/* option.expire db, out	*/
+	void       *data;	/* user data			*/
+
+	/* private */
+	uint64_t    hash;
+	db_table_t  table;
+	uint64_t    slot;
+	uint64_t    off;	/* record offset		*/
+	uint64_t    boff;	/* buf offset in file		*/
+	void       *buf;
+	size_t      buflen;
+	struct db_aget *next;
+} db_aget_t;
+
+typedef struct db_aio {
+	struct db       *db;
+	struct db_uring *ring;	/* NULL fall back to sync read	*/
+
+	unsigned depth;
+	unsigned inflight;
+
+	db_aget_t *done;	/* completed, not returned yet	*/
+	db_aget_t *done_tail;
+} db_aio_t;
+
+typedef struct db_bulk {
+	struct db       *db;
+	struct db_build *build;
+	uint64_t         tail;	/* data end at begin	*/
+} db_bulk_t;
+
+/* a mapping of a file, alive until the file and every view drop it */
+typedef struct db_map {
+	void    *buf;
+	size_t   len;
+	int      ref;
+} db_map_t;
+
+/* a table resize in three steps, see db_reserve */
+typedef struct db_resize {
+	uint64_t len;		/* new bucket array, 0 none	*/
+	uint64_t left;		/* old slots not rehashed yet	*/
+
+	/* private */
+	uint64_t table;
+	uint64_t off;
+	uint64_t src;		/* the old bucket array		*/
+	uint64_t next;		/* old slots [0, next) are in it */
+} db_resize_t;
+
+/* dead keys db_reap_find saw, db_reap_drop check them again */
+#define DB_REAP_MAX	64
+
+typedef struct db_reap {
+	int      n;
+	uint64_t table[DB_REAP_MAX];
+	uint64_t hash[DB_REAP_MAX];
+	uint64_t off[DB_REAP_MAX];	/* record offset	*/
+} db_reap_t;
+
+/* the files to flush, held from db_sync_begin to db_sync_end */
+typedef struct db_sync {
+	int       n;
+	int       fd[2];
+	db_map_t *map[2];	/* mmap backend, pinned until the end */
+} db_sync_t;
+
+typedef struct db_view {
+	const void *key;
+	uint32_t    klen;
+	const void *val;
+	uint32_t    vlen;
+	db_meta_t   meta;
+
+	/* private */
+	db_map_t   *map;	/* pinned mapping, mmap backend	*/
+	void       *buf;	/* own copy, pread backend	*/
+} db_view_t;
+
+typedef struct db_stream {
+	struct db  *db;
+	const void *key;	/* keep key until db_put_end	*/
+	uint32_t    klen;
+	uint32_t    vlen;
+	uint32_t    pos;	/* val bytes written		*/
+
+	/* private */
+	uint64_t    hash;
+	uint64_t    off;	/* record offset		*/
+} db_stream_t;
+
 typedef struct db_iter {
 	uint64_t table_off;
 	uint64_t bucket_off;
+	uint64_t table_end;	/* stop before this table, 0 no limit */
+	uint64_t data_off;	/* log order cursor, 0 table order */
+	uint64_t data_end;
 } db_iter_t;
 
+/*
+ * db_scan callback, worker is 0 ~ threads - 1 and a worker call it
+ * from one thread only.  the view is released after return,
+ * return DB_OK to go on, anything else stop the scan.
+ */
+typedef int (*db_scan_fn)(void *data, uint64_t worker, const db_view_t *view);
+
 typedef struct db_stat {
 	uint64_t db_file_size;
 
@@ -35,6 +166,8 @@ typedef struct db_stat {
 	uint64_t db_bucket_size;
 
 	uint64_t db_data_size;
+
+	uint64_t db_resident_size;	/* estimate, mmap backend only */
 } db_stat_t;
 
 /* disk format */
@@ -45,22 +178,48 @@ typedef struct db_file_header {
 	uint64_t data_tail;
 	uint64_t table_off;
 	uint64_t table_len;
+	uint64_t flags;		/* version 3 and later */
+	uint64_t cache_size;	/* version 4, cache mode data bytes	*/
+	uint64_t cache_head;	/* version 4, cache mode next write	*/
+	uint64_t cas_next;	/* version 5, next record version	*/
 } db_file_header_t;
 
 typedef struct db_file {
 	struct db *db;
 
+	const struct db_file_ops *ops;	/* storage backend	*/
+	struct db_pool           *pool;	/* pread backend only	*/
+
 	void	 *buf;
         uint64_t  buflen;
+	db_map_t *map;		/* mmap backend, buf is map->buf */
 
 	int	 fd;
 	int	 pgsz;
+	int	 pin;		/* index file, keep it resident	*/
 	uint64_t size;
         int      rdonly;
 
 	db_file_header_t *header;
+	db_file_header_t  header_buf;	/* header when not mapped */
+
+	uint64_t  step;		/* fixed growth above this size	*/
+	uint64_t  cache_free;	/* cache mode, free up to here from head */
+
+	uint64_t  budget;	/* resident bytes allowed, UINT64_MAX track only */
+	uint8_t  *region;	/* per region clock state, atomic */
+	uint64_t  region_len;
+	uint64_t  region_hand;	/* the sweeper only	*/
+	uint64_t  resident;	/* regions touched, not released */
+	int       region_sweep;	/* 1 a reader is sweeping */
 } db_file_t;
 
+/* db_flags */
+enum {DB_FLAG_INTKEY = 1,		/* keys are uint64_t		*/
+      DB_FLAG_SPREAD = 2,		/* slot from the high hash bits	*/
+      DB_FLAG_CACHE  = 4,		/* data file is a ring		*/
+      DB_FLAG_EXPIRE = 8,		/* db_meta_t after every value	*/
+      DB_FLAG_CAS    = 16};		/* and the meta has a version	*/
 
 typedef struct db {
 	int 	   db_mode;
@@ -72,18 +231,54 @@ typedef struct db {
 	db_file_t db_file_index;
 	db_file_t db_file_data;
 
+	struct db_pool *db_pool;
+
+	uint64_t db_load;
+	uint64_t db_growth;
+	uint64_t db_flags;	/* from the header, fixed at create */
+
+	uint64_t db_reap_table;	/* db_reap hand		*/
+	uint64_t db_reap_bucket;
+	uint64_t db_reserve_table;	/* db_reserve hand	*/
+	db_resize_t *db_reserve;	/* rehash under way, NULL none	*/
+
 	uint64_t db_table_len;
 } db_t;
 
+/*
+ * zero is the default for every field but table and bucket,
+ * memset the option before set the fields you need
+ */
 typedef struct db_option {
 	uint64_t table;
 	uint64_t bucket;
 	uint64_t rdonly;
+
+	uint64_t backend;	/* DB_BACKEND_MMAP or DB_BACKEND_PREAD	*/
+	uint64_t pool;		/* pread buffer pool bytes, 0 default	*/
+	uint64_t direct;	/* pread backend use O_DIRECT		*/
+	uint64_t warmup;	/* threads fault in index on open, 0 off */
+	uint64_t memory;	/* mmap data resident budget bytes, 0 off */
+
+	uint64_t load;		/* bucket array max load %, 0 is 50	*/
+	uint64_t growth;	/* bucket array grow to growth % of it, 0 is 200 */
+	uint64_t step;		/* file double up to step then grow by step, 0 is 1GB */
+
+	uint64_t intkey;	/* new db only, every key is a uint64_t */
+	uint64_t cache;		/* new db only, data bytes kept, 0 no limit */
+	uint64_t expire;	/* new db only, records carry a db_meta_t */
+	uint64_t cas;		/* new db only, expire and a record version */
 } db_option_t;
 
 /*
  * if index is NULL or same data
  * is the single file mode (mixin data and index)
+ *
+ * option.cache make the data file a ring of that many bytes, a put
+ * past it overwrite the oldest records, a record read since the
+ * hand last passed it is moved up instead (CLOCK).  it needs a
+ * separate index file, and as a put can overwrite any record, a
+ * view is only good until the next put.  no streaming or bulk put.
  */
 int
 db_open(db_t *db, const char *data, const char *index, const db_option_t *option);
@@ -98,12 +293,201 @@ db_put(db_t *db, const void *key, uint32_t klen, const void *val, uint32_t vlen)
 uint32_t
 db_get(db_t *db, const void *key, uint32_t klen, void *val, uint32_t vlen);
 
+/*
+ * copy value bytes off ~ off + vlen into val,
+ * return value length, 0 not found
+ */
+uint32_t
+db_get_range(db_t *db, const void *key, uint32_t klen, uint32_t off,
+	void *val, uint32_t vlen);
+
+/*
+ * streaming put, space for vlen bytes is reserved at begin,
+ * db_put_write add the value in pieces and db_put_end publish
+ * the key once all vlen bytes are in. no other put of the same
+ * key should run between begin and end.
+ */
+int
+db_put_begin(db_t *db, db_stream_t *stream, const void *key, uint32_t klen,
+	uint32_t vlen);
+
+int
+db_put_write(db_stream_t *stream, const void *buf, uint32_t len);
+
+int
+db_put_end(db_stream_t *stream);
+
 int
 db_del(db_t *db, const void *key, uint32_t klen);
 
+/*
+ * put and get with the record db_meta_t, an option.expire db only,
+ * other db ignore it and get zero.  a record past its expire time is
+ * not found by any get or iter, db_reap drop it from the index.
+ * an option.expire db keep an empty value, in others it is a delete
+ */
+int
+db_put_meta(db_t *db, const void *key, uint32_t klen,
+	const void *val, uint32_t vlen, const db_meta_t *meta);
+
+uint32_t
+db_get_meta(db_t *db, const void *key, uint32_t klen,
+	void *val, uint32_t vlen, db_meta_t *meta);
+
+/*
+ * read-modify-write put, mode is one of DB_STORE_*.  add need the key
+ * missing, replace, append, prepend and cas need it there, cas also
+ * need meta->cas to be its version (an option.cas db only).  append
+ * and prepend keep the old flags and expire time.
+ * return DB_OK and meta->cas the new version, DB_ERROR not found,
+ * DB_EXISTS not stored and meta->cas the current version.
+ *
+ * a value of the same length is written over the old one when no
+ * view holds the mapping, else a new record is appended like a put.
+ * a crash in the middle of that can leave the value half written.
+ */
+int
+db_store(db_t *db, int mode, const void *key, uint32_t klen,
+	const void *val, uint32_t vlen, db_meta_t *meta);
+
+/*
+ * memcached incr and decr of a decimal value, incr wrap at 2^64,
+ * decr stop at 0.  a shorter result is padded with spaces in place.
+ * return DB_OK and *value, DB_ERROR not found, DB_EXISTS the value
+ * is not a number.  meta (can be NULL) get the record meta.
+ */
+int
+db_incr(db_t *db, const void *key, uint32_t klen, uint64_t delta,
+	uint64_t *value, db_meta_t *meta);
+
+int
+db_decr(db_t *db, const void *key, uint32_t klen, uint64_t delta,
+	uint64_t *value, db_meta_t *meta);
+
+/*
+ * move the reap hand over up to buckets index slots, the expired and
+ * deleted keys are dropped, return how many.  call it from time to
+ * time.  a cache db reuse their data space, other db don't reclaim
+ * it online (db-reindex neither), db-export and db-import to a new
+ * db compact it, flags and expire time kept
+ */
+uint64_t
+db_reap(db_t *db, uint64_t buckets);
+
+/*
+ * db_reap in two steps.  db_reap_find move the hand like db_reap and
+ * keep the dead keys in reap, it read the data of every key so it can
+ * run beside gets (one at a time), it stop after buckets slots, a full
+ * reap or usec microseconds (0 no limit), return the slots it passed.
+ * db_reap_drop run like a put, it drop the keys of reap still in the
+ * index and still dead, return how many
+ */
+uint64_t
+db_reap_find(db_t *db, db_reap_t *reap, uint64_t buckets, uint64_t usec);
+
+uint64_t
+db_reap_drop(db_t *db, db_reap_t *reap);
+
+/*
+ * the slow part of a put, done ahead of it a slice at a time from a
+ * maintenance thread.  db_reserve run like a put, it grow the data
+ * and index file when less than room bytes are left, else look at up
+ * to tables index tables, and for the first one within 1/8 of its
+ * load set rs->len and make room for a bigger bucket array.
+ * db_reserve_fill rehash up to buckets slots of the table into it,
+ * call it until rs->left is 0, it can run beside gets but no put.
+ * db_reserve_end switch the table over, like a put again.  rs must
+ * stay until then, one at a time, a put or reap between two fills
+ * change the slots already rehashed in both arrays.  a put that find
+ * the table full finish the rehash and end it itself, rs->len 0, and
+ * a table resized by other means make fill and end give up with
+ * DB_ERROR and rs->len 0.  read rs only under the lock.
+ * return DB_OK did something, DB_ERROR nothing to do
+ */
+int
+db_reserve(db_t *db, db_resize_t *rs, uint64_t room, uint64_t tables);
+
+int
+db_reserve_fill(db_t *db, db_resize_t *rs, uint64_t buckets);
+
+int
+db_reserve_end(db_t *db, db_resize_t *rs);
+
+/*
+ * flush the files to disk in two steps, db_sync_begin must run alone
+ * like a put, it pin the mappings (pread backend write back its pool).
+ * db_sync_end do the msync or fdatasync and can run beside anything
+ * but db_close, call it once for every begin that return DB_OK
+ */
+int
+db_sync_begin(db_t *db, db_sync_t *sync);
+
+int
+db_sync_end(db_sync_t *sync);
+
+/*
+ * integer key db (option.intkey), the bucket hash is an invertible mix
+ * of the key, so a hash match is a key match and a lookup never compare
+ * keys in the data file.  UINT64_MAX is reserved.  db_put/db_get work
+ * too with klen == sizeof(uint64_t) and the key in host byte order.
+ */
+int
+db_iput(db_t *db, uint64_t key, const void *val, uint32_t vlen);
+
+uint32_t
+db_iget(db_t *db, uint64_t key, void *val, uint32_t vlen);
+
+int
+db_idel(db_t *db, uint64_t key);
+
+/*
+ * asynchronous get, index probe is synchronous and record read
+ * go through io_uring, up to depth reads in flight.
+ * db_aio_next return a finished request, NULL if no more,
+ * wait = 0 don't block.
+ * when io_uring is not there every db_aget finish at once
+ */
+int
+db_aio_open(db_t *db, db_aio_t *aio, unsigned depth);
+
+int
+db_aget(db_aio_t *aio, db_aget_t *req);
+
+db_aget_t *
+db_aio_next(db_aio_t *aio, int wait);
+
+int
+db_aio_close(db_aio_t *aio);
+
 int
 db_iter(db_t *db, db_iter_t *iter, const void *key, const uint32_t klen);
 
+/*
+ * cursor over part part of parts disjoint slices of the tables,
+ * every live record is in exactly one part.  read with db_iter_next
+ * or db_iter_view, one cursor per thread can run in parallel
+ */
+int
+db_iter_part(db_t *db, db_iter_t *iter, uint64_t part, uint64_t parts);
+
+/*
+ * cursor in data file order, from data_head to the data_tail of now,
+ * a record is returned only if it is still the live version of its
+ * key (the index point at it).  reads are sequential, no seek for
+ * every record, the way to scan a data file bigger than memory.
+ * read with db_iter_next or db_iter_view
+ */
+int
+db_iter_log(db_t *db, db_iter_t *iter);
+
+/*
+ * every live record to fn, tables are cut in parts that threads
+ * take one by one.  no put or del while it runs.
+ * return DB_OK, or what fn returned to stop it
+ */
+int
+db_scan(db_t *db, uint64_t threads, db_scan_fn fn, void *data);
+
 /* 
  * klen is pointer of key buffer length
  * vlen is pointer of val buffer length
@@ -111,16 +495,78 @@ db_iter(db_t *db, db_iter_t *iter, const void *key, const uint32_t klen);
  * when function finish: 
  * klen will set db's key length
  * vlen will set db's val length
+ * return DB_OK, DB_ERROR at the end, DB_SYS_ERROR failed
  */
 int
 db_iter_next(db_t *db, db_iter_t *iter,
 	void *key, uint32_t *klen, void *val, uint32_t *vlen);
 
+/*
+ * borrow key and val without copy, valid until db_view_release even
+ * after puts grow the file, DB_OK found, DB_ERROR not found
+ */
+int
+db_view(db_t *db, const void *key, uint32_t klen, db_view_t *view);
+
+/* like db_iter_next, DB_ERROR at the end, DB_SYS_ERROR failed */
+int
+db_iter_view(db_t *db, db_iter_t *iter, db_view_t *view);
+
+void
+db_view_release(db_view_t *view);
+
 int
 db_stat(db_t *db, db_stat_t *stat);
 
+/*
+ * bulk load, records are appended to the data file but the index
+ * is not touched (db_get don't see them) until db_bulk_end,
+ * which merge them with the keys already in and build every table
+ * once at its final size, threads dedupe and fill tables in parallel.
+ * db_bulk_put hash and append on the calling thread, the hash is a
+ * tenth of the put next to the copy, and one writer keep the data
+ * log sequential.  expect is the number of keys you are going to
+ * put, 0 unknown
+ */
+int
+db_bulk_begin(db_t *db, db_bulk_t *bulk, uint64_t expect);
+
+int
+db_bulk_put(db_bulk_t *bulk, const void *key, uint32_t klen,
+	const void *val, uint32_t vlen);
+
+/* with flags and expire like db_put_meta, the version is a new one */
+int
+db_bulk_put_meta(db_bulk_t *bulk, const void *key, uint32_t klen,
+	const void *val, uint32_t vlen, const db_meta_t *meta);
+
+int
+db_bulk_end(db_bulk_t *bulk, uint64_t threads);
+
+/*
+ * give up a bulk load, the index is left as it was and the data file
+ * go back to where it was at db_bulk_begin, so a later reindex don't
+ * bring the records back.  no other put between begin and abort
+ */
+void
+db_bulk_abort(db_bulk_t *bulk);
+
+/*
+ * build the index again from the data file,
+ * the last record of a key win, deleted keys are dropped.
+ * separate index file is truncated and created again,
+ * tables are sized once and filled by threads in parallel
+ */
+int
+db_rebuild_index(const char *data, const char *index,
+	const db_option_t *option, uint64_t threads);
+
 int
 db_close(db_t *db);
 
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* __DB_H__ */
@@ -0,0 +1,433 @@
+#ifndef __DB_HPP__
+#define __DB_HPP__
+
+/*
+ * C++17 interface, header only
+ *
+ *	dbpp::Database db("data.db", "data.idx");
+ *
+ *	db.put("key", "val");
+ *	if (dbpp::View v = db.get("key"))
+ *		use(v.value());		// string_view into the mapping
+ *
+ *	for (dbpp::View &rec : db)
+ *		use(rec.key(), rec.value());
+ *
+ * keys and values are anything with contiguous data() and size()
+ * (std::string_view, std::string, std::vector, std::array ...).
+ * a View borrow the record, it stays valid until the View is gone,
+ * even when later puts grow and remap the file.
+ * system errors throw dbpp::Error, not found is an empty View.
+ */
+
+#include "db.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+namespace dbpp {
+
+class Error : public std::runtime_error {
+public:
+	using std::runtime_error::runtime_error;
+};
+
+template <class T>
+inline std::string_view
+bytes(const T &buf)
+{
+	return std::string_view(reinterpret_cast<const char *>(std::data(buf)),
+		std::size(buf) * sizeof(*std::data(buf)));
+}
+
+inline std::string_view
+bytes(std::string_view buf)
+{
+	return buf;
+}
+
+inline std::string_view
+bytes(const char *buf)
+{
+	return std::string_view(buf);
+}
+
+/* zero is the default, like the C option, but table and bucket are set */
+struct Options : db_option_t {
+	Options() : db_option_t()
+	{
+		table  = 256;
+		bucket = 256;
+	}
+};
+
+class View {
+public:
+	View() noexcept : view_() {}
+	~View() { reset(); }
+
+	View(View &&other) noexcept : view_(other.view_)
+	{
+		other.view_ = db_view_t();
+	}
+
+	View &
+	operator=(View &&other) noexcept
+	{
+		if (this != &other) {
+			reset();
+			view_ = other.view_;
+			other.view_ = db_view_t();
+		}
+		return *this;
+	}
+
+	View(const View &) = delete;
+	View &operator=(const View &) = delete;
+
+	explicit operator bool() const noexcept { return view_.key != nullptr; }
+
+	std::string_view
+	key() const noexcept
+	{
+		return std::string_view(static_cast<const char *>(view_.key),
+			view_.klen);
+	}
+
+	std::string_view
+	value() const noexcept
+	{
+		return std::string_view(static_cast<const char *>(view_.val),
+			view_.vlen);
+	}
+
+	/* flags and expire time, option.expire db only */
+	const db_meta_t &meta() const noexcept { return view_.meta; }
+
+	/* copy out when the value must outlive the view */
+	std::string str() const { return std::string(value()); }
+
+	void
+	reset() noexcept
+	{
+		if (view_.key != nullptr)
+			db_view_release(&view_);
+		view_ = db_view_t();
+	}
+
+private:
+	friend class Database;
+	friend class Iterator;
+
+	db_view_t view_;
+};
+
+/* input iterator over live records, table order */
+class Iterator {
+public:
+	using iterator_category = std::input_iterator_tag;
+	using value_type        = View;
+	using difference_type   = std::ptrdiff_t;
+	using pointer           = View *;
+	using reference         = View &;
+
+	Iterator() noexcept : db_(nullptr), iter_() {}
+
+	explicit Iterator(db_t *db) : db_(db), iter_()
+	{
+		db_iter(db_, &iter_, nullptr, 0);
+		next();
+	}
+
+	View &operator*() noexcept { return view_; }
+	View *operator->() noexcept { return &view_; }
+
+	Iterator &
+	operator++()
+	{
+		next();
+		return *this;
+	}
+
+	/* only the end compare equal, every live iterator is its own */
+	bool operator==(const Iterator &other) const noexcept { return db_ == other.db_; }
+	bool operator!=(const Iterator &other) const noexcept { return db_ != other.db_; }
+
+private:
+	void
+	next()
+	{
+		int error;
+
+		view_.reset();
+		if ((error = db_iter_view(db_, &iter_, &view_.view_)) != DB_OK) {
+			db_ = nullptr;
+			if (error == DB_SYS_ERROR)
+				throw Error("db_iter_view");
+		}
+	}
+
+	db_t     *db_;
+	db_iter_t iter_;
+	View      view_;
+};
+
+class Database {
+public:
+	/* index empty is the single file mode */
+	explicit
+	Database(const std::string &data, const std::string &index = std::string(),
+		const Options &option = Options())
+	{
+		std::unique_ptr<db_t> db(new db_t());
+
+		if (db_open(db.get(), data.c_str(),
+			index.empty() ? nullptr : index.c_str(), &option) != DB_OK)
+		{
+			throw Error("db_open " + data);
+		}
+		db_.reset(db.release());
+	}
+
+	Database(Database &&) noexcept = default;
+	Database &operator=(Database &&) noexcept = default;
+
+	template <class K, class V>
+	void
+	put(const K &key, const V &val)
+	{
+		std::string_view k = bytes(key);
+		std::string_view v = bytes(val);
+
+		if (!check(db_put(db_.get(), k.data(), size(k), v.data(), size(v)),
+			"db_put"))
+		{
+			throw std::invalid_argument("db_put key");
+		}
+	}
+
+	template <class K>
+	View
+	get(const K &key) const
+	{
+		View view;
+		std::string_view k = bytes(key);
+
+		check(db_view(db_.get(), k.data(), size(k), &view.view_), "db_view");
+		return view;
+	}
+
+	template <class K>
+	bool
+	contains(const K &key) const
+	{
+		return static_cast<bool>(get(key));
+	}
+
+	template <class K>
+	void
+	del(const K &key)
+	{
+		std::string_view k = bytes(key);
+
+		check(db_del(db_.get(), k.data(), size(k)), "db_del");
+	}
+
+	/* option.intkey db */
+	template <class V>
+	void
+	iput(uint64_t key, const V &val)
+	{
+		put(std::string_view(reinterpret_cast<const char *>(&key),
+			sizeof(key)), val);
+	}
+
+	View
+	iget(uint64_t key) const
+	{
+		return get(std::string_view(reinterpret_cast<const char *>(&key),
+			sizeof(key)));
+	}
+
+	void
+	idel(uint64_t key)
+	{
+		check(db_idel(db_.get(), key), "db_idel");
+	}
+
+	/*
+	 * f(key, value) for every key of a container, value is empty when
+	 * not found and only good during the call.  the reads go through
+	 * db_aget, up to depth in flight, f is called as they finish
+	 */
+	template <class Keys, class F>
+	void
+	get_batch(const Keys &keys, F &&f, unsigned depth = 64) const
+	{
+		using Key = std::remove_reference_t<decltype(*std::begin(keys))>;
+
+		struct Slot {
+			db_aget_t   req;
+			const Key  *key;
+			std::string val;
+		};
+
+		/* the reads in flight point into slot, drain them first */
+		struct Aio {
+			db_aio_t aio;
+			~Aio() { db_aio_close(&aio); }
+		};
+
+		std::vector<Slot>   slot(depth > 0 ? depth : 1);
+		std::vector<Slot *> idle;
+		Aio                 aio;
+
+		db_aio_open(db_.get(), &aio.aio, static_cast<unsigned>(slot.size()));
+		for (Slot &s : slot) {
+			s.val.resize(256);
+			idle.push_back(&s);
+		}
+
+		auto submit = [&](Slot *s) {
+			std::string_view k = bytes(*s->key);
+
+			s->req      = db_aget_t();
+			s->req.key  = k.data();
+			s->req.klen = size(k);
+			s->req.val  = s->val.data();
+			s->req.vlen = static_cast<uint32_t>(s->val.size());
+			s->req.data = s;
+			if (db_aget(&aio.aio, &s->req) == DB_SYS_ERROR)
+				throw Error("db_aget");
+		};
+
+		/* a value bigger than the buffer is read again, whole */
+		auto finish = [&](db_aget_t *req) {
+			Slot *s = static_cast<Slot *>(req->data);
+
+			if (req->error == DB_SYS_ERROR)
+				throw Error("db_aget");
+			if (req->error == DB_OK && req->vlen > s->val.size()) {
+				s->val.resize(req->vlen);
+				submit(s);
+				return;
+			}
+			if (req->error == DB_OK)
+				f(*s->key, std::optional<std::string_view>(
+					std::string_view(s->val.data(), req->vlen)));
+			else
+				f(*s->key, std::optional<std::string_view>());
+			idle.push_back(s);
+		};
+
+		for (const auto &key : keys) {
+			while (idle.empty())
+				finish(next(&aio.aio));
+
+			Slot *s = idle.back();
+
+			idle.pop_back();
+			s->key = &key;
+			submit(s);
+		}
+		while (idle.size() < slot.size())
+			finish(next(&aio.aio));
+	}
+
+	/* range of (key, value) pairs */
+	template <class Pairs>
+	void
+	put_batch(const Pairs &pairs)
+	{
+		for (const auto &[key, val] : pairs)
+			put(key, val);
+	}
+
+	/* big loads, append everything and build the index once at the end */
+	template <class Pairs>
+	void
+	load(const Pairs &pairs, uint64_t expect = 0, uint64_t threads = 1)
+	{
+		db_bulk_t bulk;
+
+		check(db_bulk_begin(db_.get(), &bulk, expect), "db_bulk_begin");
+		for (const auto &[key, val] : pairs) {
+			std::string_view k = bytes(key);
+			std::string_view v = bytes(val);
+
+			if (db_bulk_put(&bulk, k.data(), size(k),
+				v.data(), size(v)) == DB_SYS_ERROR)
+			{
+				db_bulk_abort(&bulk);
+				throw Error("db_bulk_put");
+			}
+		}
+		check(db_bulk_end(&bulk, threads), "db_bulk_end");
+	}
+
+	Iterator begin() const { return Iterator(db_.get()); }
+	Iterator end() const noexcept { return Iterator(); }
+
+	db_stat_t
+	stat() const
+	{
+		db_stat_t stat;
+
+		check(db_stat(db_.get(), &stat), "db_stat");
+		return stat;
+	}
+
+	/* for the C calls not wrapped here */
+	db_t *handle() const noexcept { return db_.get(); }
+
+private:
+	struct Close {
+		void
+		operator()(db_t *db) const noexcept
+		{
+			db_close(db);
+			delete db;
+		}
+	};
+
+	static db_aget_t *
+	next(db_aio_t *aio)
+	{
+		db_aget_t *req;
+
+		if ((req = db_aio_next(aio, 1)) == nullptr)
+			throw Error("db_aio_next");
+		return req;
+	}
+
+	static uint32_t
+	size(std::string_view buf)
+	{
+		if (buf.size() > UINT32_MAX)
+			throw std::length_error("db record over 4GB");
+		return static_cast<uint32_t>(buf.size());
+	}
+
+	/* DB_ERROR (not found, bad key) is for the caller, only system error throw */
+	static bool
+	check(int error, const char *what)
+	{
+		if (error == DB_SYS_ERROR)
+			throw Error(what);
+		return error == DB_OK;
+	}
+
+	std::unique_ptr<db_t, Close> db_;
+};
+
+} /* namespace dbpp */
+
+#endif /* __DB_HPP__ */
@@ -0,0 +1,684 @@
+#include "db.h"
+#include "hash.h"
+#include "dump.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#define DB_DUMP_VERSION	2		/* 2 add DB_DUMP_META */
+
+/* records are cut in blocks of about this size, bigger records get own block */
+#define DB_DUMP_BLOCK	(1 << 20)
+
+/* a stored block larger than this is a broken length, not a record */
+#define DB_DUMP_BLOCK_MAX	(UINT32_MAX >> 1)
+
+static const uint8_t db_dump_magic[8] = {0x89, 'D', 'B', 'D', 'U', 'M', 'P', '\n'};
+
+typedef struct db_dump_header {
+	uint8_t  magic[8];
+	uint32_t version;
+	uint32_t flags;
+} db_dump_header_t;
+
+typedef struct db_dump_bheader {
+	uint32_t len;		/* stored payload bytes	*/
+	uint32_t raw;		/* payload bytes	*/
+	uint32_t flags;
+	uint32_t count;		/* records		*/
+	uint64_t sum;
+} db_dump_bheader_t;
+
+typedef struct db_dump_block {
+	db_dump_bheader_t head;
+
+	uint8_t *raw;		/* records			*/
+	size_t   rawlen;
+	size_t   rawmax;
+
+	uint8_t *buf;		/* compressed or read payload	*/
+	size_t   bufmax;
+
+	size_t   pos;		/* reader cursor		*/
+	uint32_t users;		/* writers copying in		*/
+	int      sealed;
+
+	struct db_dump_block *next;
+} db_dump_block_t;
+
+struct db_dump {
+	FILE *fp;
+	int   mode;
+	int   flags;
+
+	int   error;
+	int   eof;		/* end block seen, under lock	*/
+	int   end;		/* same, under io		*/
+	int   stop;
+
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	pthread_mutex_t io;	/* fp is shared by workers */
+
+	db_dump_block_t  *fill;
+	db_dump_block_t  *queue;	/* writer: to encode, reader: decoded */
+	db_dump_block_t **queue_tail;
+	db_dump_block_t  *free;
+
+	uint32_t nblock;
+	uint32_t maxblock;
+	uint32_t busy;			/* reader workers holding a block */
+
+	pthread_t *worker;
+	int        nworker;
+};
+
+static int
+db_dump_reserve(uint8_t **buf, size_t *max, size_t len)
+{
+	uint8_t *p;
+
+	if (len <= *max)
+		return DB_OK;
+	if ((p = realloc(*buf, len)) == NULL)
+		return DB_SYS_ERROR;
+	*buf = p;
+	*max = len;
+	return DB_OK;
+}
+
+static void
+db_dump_block_free(db_dump_block_t *block)
+{
+	free(block->raw);
+	free(block->buf);
+	free(block);
+}
+
+/* caller hold lock, wait for a free block when maxblock are out */
+static db_dump_block_t *
+db_dump_block_get(db_dump_t *dump, size_t size)
+{
+	db_dump_block_t *block;
+
+	while (dump->free == NULL && dump->nblock >= dump->maxblock &&
+	       dump->error == DB_OK && !dump->stop)
+	{
+		pthread_cond_wait(&dump->cond, &dump->lock);
+	}
+	if (dump->error != DB_OK || dump->stop)
+		return NULL;
+
+	if ((block = dump->free) != NULL) {
+		dump->free = block->next;
+	} else {
+		if ((block = calloc(1, sizeof(db_dump_block_t))) == NULL)
+			return NULL;
+		dump->nblock++;
+	}
+
+	if (db_dump_reserve(&block->raw, &block->rawmax,
+		size > DB_DUMP_BLOCK ? size : DB_DUMP_BLOCK) != DB_OK)
+	{
+		block->next = dump->free;
+		dump->free  = block;
+		return NULL;
+	}
+
+	memset(&block->head, 0, sizeof(block->head));
+	block->rawlen = 0;
+	block->pos    = 0;
+	block->users  = 0;
+	block->sealed = 0;
+	block->next   = NULL;
+	return block;
+}
+
+/* caller hold lock */
+static void
+db_dump_block_put(db_dump_t *dump, db_dump_block_t *block)
+{
+	block->next = dump->free;
+	dump->free  = block;
+	pthread_cond_broadcast(&dump->cond);
+}
+
+static void
+db_dump_fail(db_dump_t *dump)
+{
+	pthread_mutex_lock(&dump->lock);
+	dump->error = DB_SYS_ERROR;
+	pthread_cond_broadcast(&dump->cond);
+	pthread_mutex_unlock(&dump->lock);
+}
+
+static int
+db_dump_encode(db_dump_t *dump, db_dump_block_t *block)
+{
+	const uint8_t *payload = block->raw;
+	size_t len = block->rawlen;
+
+	block->head.flags = 0;
+#ifdef HAVE_ZLIB
+	if (dump->flags & DB_DUMP_ZLIB) {
+		uLongf zlen = compressBound(block->rawlen);
+
+		if (db_dump_reserve(&block->buf, &block->bufmax, zlen) != DB_OK)
+			return DB_SYS_ERROR;
+		if (compress2(block->buf, &zlen, block->raw, block->rawlen,
+			Z_BEST_SPEED) == Z_OK && zlen < block->rawlen)
+		{
+			payload = block->buf;
+			len     = zlen;
+			block->head.flags = DB_DUMP_ZLIB;
+		}
+	}
+#endif
+
+	block->head.len = len;
+	block->head.raw = block->rawlen;
+	block->head.sum = db_hash(payload, len);
+
+	pthread_mutex_lock(&dump->io);
+	if (fwrite(&block->head, sizeof(block->head), 1, dump->fp) != 1 ||
+	    fwrite(payload, 1, len, dump->fp) != len)
+	{
+		pthread_mutex_unlock(&dump->io);
+		return DB_SYS_ERROR;
+	}
+	pthread_mutex_unlock(&dump->io);
+
+	return DB_OK;
+}
+
+/* the meta bytes after every val */
+static size_t
+db_dump_meta_len(db_dump_t *dump)
+{
+	return dump->flags & DB_DUMP_META ? sizeof(db_meta_t) : 0;
+}
+
+/* records must fill the payload exactly, so db_dump_get trust it */
+static int
+db_dump_verify(db_dump_t *dump, db_dump_block_t *block)
+{
+	uint32_t i;
+	size_t off  = 0;
+	size_t meta = db_dump_meta_len(dump);
+
+	for (i = 0; i < block->head.count; i++) {
+		uint32_t len[2];
+
+		if (block->rawlen - off < sizeof(len))
+			return DB_SYS_ERROR;
+		memcpy(len, block->raw + off, sizeof(len));
+		off += sizeof(len);
+		if ((uint64_t)len[0] + len[1] + meta > block->rawlen - off)
+			return DB_SYS_ERROR;
+		off += (size_t)len[0] + len[1] + meta;
+	}
+
+	return off == block->rawlen ? DB_OK : DB_SYS_ERROR;
+}
+
+static int
+db_dump_decode(db_dump_t *dump, db_dump_block_t *block)
+{
+	uint8_t *tmp;
+	size_t   max;
+
+	if (db_hash(block->buf, block->head.len) != block->head.sum)
+		return DB_SYS_ERROR;
+
+	if (block->head.flags == 0) {
+		if (block->head.raw != block->head.len)
+			return DB_SYS_ERROR;
+
+		/* stored as is, just swap the buffers */
+		tmp = block->raw;
+		max = block->rawmax;
+		block->raw    = block->buf;
+		block->rawmax = block->bufmax;
+		block->buf    = tmp;
+		block->bufmax = max;
+#ifdef HAVE_ZLIB
+	} else if (block->head.flags == DB_DUMP_ZLIB) {
+		uLongf rawlen = block->head.raw;
+
+		if (db_dump_reserve(&block->raw, &block->rawmax,
+			block->head.raw) != DB_OK)
+		{
+			return DB_SYS_ERROR;
+		}
+		if (uncompress(block->raw, &rawlen, block->buf,
+			block->head.len) != Z_OK || rawlen != block->head.raw)
+		{
+			return DB_SYS_ERROR;
+		}
+#endif
+	} else {
+		return DB_SYS_ERROR;
+	}
+
+	block->rawlen = block->head.raw;
+	block->pos    = 0;
+	return db_dump_verify(dump, block);
+}
+
+/* 1 block read, 0 end of dump, -1 error */
+static int
+db_dump_read(db_dump_t *dump, db_dump_block_t *block)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&dump->io);
+	if (dump->end) {
+		ret = 0;
+	} else if (fread(&block->head, sizeof(block->head), 1, dump->fp) == 1) {
+		db_dump_bheader_t *head = &block->head;
+
+		if (head->len == 0 && head->raw == 0 && head->count == 0 &&
+		    head->flags == 0 && head->sum == 0)
+		{
+			dump->end = 1;
+			ret = 0;
+		} else if (head->len <= DB_DUMP_BLOCK_MAX &&
+			   head->raw <= DB_DUMP_BLOCK_MAX &&
+			   db_dump_reserve(&block->buf, &block->bufmax,
+				head->len) == DB_OK &&
+			   fread(block->buf, 1, head->len, dump->fp) == head->len)
+		{
+			ret = 1;
+		}
+	}
+	pthread_mutex_unlock(&dump->io);
+
+	/* a short read means the end block never came, truncated dump */
+	return ret;
+}
+
+static void
+db_dump_queue(db_dump_t *dump, db_dump_block_t *block)
+{
+	*dump->queue_tail = block;
+	dump->queue_tail  = &block->next;
+	block->next = NULL;
+	pthread_cond_broadcast(&dump->cond);
+}
+
+static db_dump_block_t *
+db_dump_dequeue(db_dump_t *dump)
+{
+	db_dump_block_t *block;
+
+	if ((block = dump->queue) == NULL)
+		return NULL;
+	if ((dump->queue = block->next) == NULL)
+		dump->queue_tail = &dump->queue;
+	return block;
+}
+
+/* caller hold lock, a sealed block with no writer goes out */
+static void
+db_dump_seal(db_dump_t *dump, db_dump_block_t *block)
+{
+	block->sealed = 1;
+	if (dump->fill == block)
+		dump->fill = NULL;
+	if (block->users > 0)
+		return;
+
+	if (dump->nworker > 0) {
+		db_dump_queue(dump, block);
+		return;
+	}
+
+	if (db_dump_encode(dump, block) != DB_OK)
+		dump->error = DB_SYS_ERROR;
+	db_dump_block_put(dump, block);
+}
+
+static void *
+db_dump_encoder(void *arg)
+{
+	db_dump_t *dump = arg;
+	db_dump_block_t *block;
+
+	pthread_mutex_lock(&dump->lock);
+	for (;;) {
+		if ((block = db_dump_dequeue(dump)) == NULL) {
+			if (dump->stop)
+				break;
+			pthread_cond_wait(&dump->cond, &dump->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&dump->lock);
+
+		if (db_dump_encode(dump, block) != DB_OK)
+			db_dump_fail(dump);
+
+		pthread_mutex_lock(&dump->lock);
+		db_dump_block_put(dump, block);
+	}
+	pthread_mutex_unlock(&dump->lock);
+
+	return NULL;
+}
+
+static void *
+db_dump_decoder(void *arg)
+{
+	int ret;
+	db_dump_t *dump = arg;
+	db_dump_block_t *block;
+
+	pthread_mutex_lock(&dump->lock);
+	while (!dump->eof && !dump->stop && dump->error == DB_OK) {
+		if ((block = db_dump_block_get(dump, 0)) == NULL) {
+			if (!dump->stop)
+				dump->error = DB_SYS_ERROR;
+			break;
+		}
+		dump->busy++;
+		pthread_mutex_unlock(&dump->lock);
+
+		ret = db_dump_read(dump, block);
+		if (ret > 0 && db_dump_decode(dump, block) != DB_OK)
+			ret = -1;
+
+		pthread_mutex_lock(&dump->lock);
+		dump->busy--;
+		if (ret > 0) {
+			db_dump_queue(dump, block);
+		} else {
+			if (ret < 0)
+				dump->error = DB_SYS_ERROR;
+			else
+				dump->eof = 1;
+			db_dump_block_put(dump, block);
+		}
+	}
+	pthread_cond_broadcast(&dump->cond);
+	pthread_mutex_unlock(&dump->lock);
+
+	return NULL;
+}
+
+int
+db_dump_probe(FILE *fp)
+{
+	int c;
+
+	/* 0x89 is never the first byte of a hex dump */
+	if ((c = getc(fp)) == EOF)
+		return 0;
+	ungetc(c, fp);
+
+	return c == db_dump_magic[0];
+}
+
+db_dump_t *
+db_dump_open(FILE *fp, int mode, int flags, int threads)
+{
+	int i;
+	db_dump_t *dump;
+	db_dump_header_t header;
+
+#ifndef HAVE_ZLIB
+	if (flags & DB_DUMP_ZLIB)
+		return NULL;
+#endif
+
+	memset(&header, 0, sizeof(header));
+	if (mode == DB_DUMP_WRITE) {
+		memcpy(header.magic, db_dump_magic, sizeof(header.magic));
+		header.version = DB_DUMP_VERSION;
+		header.flags   = flags;
+		if (fwrite(&header, sizeof(header), 1, fp) != 1)
+			return NULL;
+	} else {
+		if (fread(&header, sizeof(header), 1, fp) != 1 ||
+		    memcmp(header.magic, db_dump_magic, sizeof(header.magic)) != 0 ||
+		    header.version < 1 || header.version > DB_DUMP_VERSION)
+		{
+			return NULL;
+		}
+		flags = header.flags;
+	}
+
+	if ((dump = calloc(1, sizeof(db_dump_t))) == NULL)
+		return NULL;
+
+	dump->fp       = fp;
+	dump->mode     = mode;
+	dump->flags    = flags;
+	dump->error    = DB_OK;
+	dump->maxblock = threads > 0 ? threads * 2 + 2 : 1;
+	dump->queue_tail = &dump->queue;
+
+	pthread_mutex_init(&dump->lock, NULL);
+	pthread_mutex_init(&dump->io, NULL);
+	pthread_cond_init(&dump->cond, NULL);
+
+	if (threads > 0 && (dump->worker = calloc(threads, sizeof(pthread_t))) != NULL) {
+		for (i = 0; i < threads; i++) {
+			if (pthread_create(&dump->worker[i], NULL,
+				mode == DB_DUMP_WRITE ? db_dump_encoder : db_dump_decoder,
+				dump) != 0)
+			{
+				break;
+			}
+		}
+		dump->nworker = i;
+	}
+	if (dump->nworker == 0)
+		dump->maxblock = 1;
+
+	return dump;
+}
+
+int
+db_dump_flags(db_dump_t *dump)
+{
+	return dump->flags;
+}
+
+int
+db_dump_put(db_dump_t *dump, const void *key, uint32_t klen,
+	const void *val, uint32_t vlen, const db_meta_t *meta)
+{
+	uint8_t *p;
+	size_t size;
+	db_meta_t zero;
+	db_dump_block_t *block;
+
+	if (meta == NULL) {
+		memset(&zero, 0, sizeof(zero));
+		meta = &zero;
+	}
+
+	size = sizeof(klen) + sizeof(vlen) + (size_t)klen + vlen +
+		db_dump_meta_len(dump);
+	if (size > DB_DUMP_BLOCK_MAX)
+		return DB_ERROR;
+
+	pthread_mutex_lock(&dump->lock);
+	for (;;) {
+		if (dump->error != DB_OK) {
+			pthread_mutex_unlock(&dump->lock);
+			return DB_SYS_ERROR;
+		}
+
+		block = dump->fill;
+		if (block != NULL && block->rawlen > 0 &&
+		    block->rawlen + size > block->rawmax)
+		{
+			db_dump_seal(dump, block);
+			continue;
+		}
+		if (block != NULL)
+			break;
+
+		/* the wait drop the lock, someone else may have set fill */
+		if ((block = db_dump_block_get(dump, size)) == NULL) {
+			dump->error = DB_SYS_ERROR;
+			continue;
+		}
+		if (dump->fill != NULL) {
+			db_dump_block_put(dump, block);
+			continue;
+		}
+		dump->fill = block;
+	}
+
+	/* reserve the space and copy outside the lock */
+	p = block->raw + block->rawlen;
+	block->rawlen += size;
+	block->head.count++;
+	block->users++;
+	if (block->rawlen >= DB_DUMP_BLOCK)
+		db_dump_seal(dump, block);
+	pthread_mutex_unlock(&dump->lock);
+
+	memcpy(p, &klen, sizeof(klen));
+	p += sizeof(klen);
+	memcpy(p, &vlen, sizeof(vlen));
+	p += sizeof(vlen);
+	memcpy(p, key, klen);
+	p += klen;
+	memcpy(p, val, vlen);
+	p += vlen;
+	memcpy(p, meta, db_dump_meta_len(dump));
+
+	pthread_mutex_lock(&dump->lock);
+	if (--block->users == 0 && block->sealed) {
+		block->sealed = 0;
+		db_dump_seal(dump, block);
+	}
+	pthread_mutex_unlock(&dump->lock);
+
+	return DB_OK;
+}
+
+int
+db_dump_get(db_dump_t *dump, const void **key, uint32_t *klen,
+	const void **val, uint32_t *vlen, db_meta_t *meta)
+{
+	int ret;
+	db_dump_block_t *block;
+
+	pthread_mutex_lock(&dump->lock);
+	for (;;) {
+		if ((block = dump->fill) != NULL) {
+			if (block->pos < block->rawlen) {
+				const uint8_t *p = block->raw + block->pos;
+
+				memcpy(klen, p, sizeof(*klen));
+				p += sizeof(*klen);
+				memcpy(vlen, p, sizeof(*vlen));
+				p += sizeof(*vlen);
+				*key = p;
+				*val = p + *klen;
+
+				memset(meta, 0, sizeof(db_meta_t));
+				memcpy(meta, p + *klen + *vlen, db_dump_meta_len(dump));
+
+				block->pos += sizeof(*klen) + sizeof(*vlen) +
+					(size_t)*klen + *vlen + db_dump_meta_len(dump);
+				pthread_mutex_unlock(&dump->lock);
+				return DB_OK;
+			}
+			dump->fill = NULL;
+			db_dump_block_put(dump, block);
+		}
+
+		if ((dump->fill = db_dump_dequeue(dump)) != NULL)
+			continue;
+
+		if (dump->error != DB_OK) {
+			ret = DB_SYS_ERROR;
+			break;
+		}
+		if (dump->eof && dump->busy == 0) {
+			ret = DB_ERROR;
+			break;
+		}
+
+		if (dump->nworker > 0) {
+			pthread_cond_wait(&dump->cond, &dump->lock);
+			continue;
+		}
+
+		/* no worker, read in the caller */
+		if ((block = db_dump_block_get(dump, 0)) == NULL) {
+			dump->error = DB_SYS_ERROR;
+			continue;
+		}
+		ret = db_dump_read(dump, block);
+		if (ret > 0 && db_dump_decode(dump, block) != DB_OK)
+			ret = -1;
+		if (ret > 0) {
+			dump->fill = block;
+		} else {
+			if (ret < 0)
+				dump->error = DB_SYS_ERROR;
+			else
+				dump->eof = 1;
+			db_dump_block_put(dump, block);
+		}
+	}
+	pthread_mutex_unlock(&dump->lock);
+
+	return ret;
+}
+
+int
+db_dump_close(db_dump_t *dump)
+{
+	int i;
+	int error;
+	db_dump_block_t *block;
+	db_dump_bheader_t end;
+
+	pthread_mutex_lock(&dump->lock);
+	if (dump->mode == DB_DUMP_WRITE && dump->fill != NULL)
+		db_dump_seal(dump, dump->fill);
+	dump->stop = 1;
+	pthread_cond_broadcast(&dump->cond);
+	pthread_mutex_unlock(&dump->lock);
+
+	/* encoders drain the queue before they quit */
+	for (i = 0; i < dump->nworker; i++)
+		pthread_join(dump->worker[i], NULL);
+	free(dump->worker);
+
+	error = dump->error;
+	if (dump->mode == DB_DUMP_WRITE && error == DB_OK) {
+		memset(&end, 0, sizeof(end));
+		if (fwrite(&end, sizeof(end), 1, dump->fp) != 1 ||
+		    fflush(dump->fp) != 0)
+		{
+			error = DB_SYS_ERROR;
+		}
+	}
+
+	if (dump->fill != NULL)
+		db_dump_block_free(dump->fill);
+	while ((block = db_dump_dequeue(dump)) != NULL)
+		db_dump_block_free(block);
+	while ((block = dump->free) != NULL) {
+		dump->free = block->next;
+		db_dump_block_free(block);
+	}
+
+	pthread_cond_destroy(&dump->cond);
+	pthread_mutex_destroy(&dump->io);
+	pthread_mutex_destroy(&dump->lock);
+	free(dump);
+
+	return error;
+}
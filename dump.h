@@ -0,0 +1,65 @@
+#ifndef __DB_DUMP_H__
+#define __DB_DUMP_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "db.h"
+
+/*
+ * binary dump format
+ *
+ * header: "\x89DBDUMP\n" version(u32) flags(u32)
+ * block:  len(u32) raw(u32) flags(u32) count(u32) sum(u64) payload
+ *         payload is count records klen(u32)|vlen(u32)|key|val,
+ *         and db_meta_t after val when the header has DB_DUMP_META,
+ *         zlib compressed when flags say so, sum is db_hash of it
+ * end:    a block with every field 0, no end means truncated file
+ *
+ * version 1 dumps have no meta, they are read as they were
+ *
+ * workers checksum and (de)compress blocks in parallel,
+ * blocks may be written and read back in any order
+ */
+enum {DB_DUMP_READ = 0, DB_DUMP_WRITE = 1};
+
+/* META an option.expire db keep flags and expire, CAS it was option.cas */
+enum {DB_DUMP_ZLIB = 1, DB_DUMP_META = 2, DB_DUMP_CAS = 4};
+
+typedef struct db_dump db_dump_t;
+
+/* 1 if the stream start with a dump header, fp is not consumed */
+int
+db_dump_probe(FILE *fp);
+
+/* threads 0 do everything in the caller */
+db_dump_t *
+db_dump_open(FILE *fp, int mode, int flags, int threads);
+
+/* a reader get the flags of the header */
+int
+db_dump_flags(db_dump_t *dump);
+
+/*
+ * thread safe, many producers can put at the same time.
+ * meta is kept when the dump was opened with DB_DUMP_META, NULL zero
+ */
+int
+db_dump_put(db_dump_t *dump, const void *key, uint32_t klen,
+	const void *val, uint32_t vlen, const db_meta_t *meta);
+
+/*
+ * key and val point into the dump, valid until next call, meta is
+ * zero when the dump has none
+ * DB_OK a record, DB_ERROR end of dump, DB_SYS_ERROR broken dump
+ */
+int
+db_dump_get(db_dump_t *dump, const void **key, uint32_t *klen,
+	const void **val, uint32_t *vlen, db_meta_t *meta);
+
+/* writer: flush and write end, DB_OK only if all went to fp */
+int
+db_dump_close(db_dump_t *dump);
+
+#endif /* __DB_DUMP_H__ */
@@ -0,0 +1,353 @@
+#include "db.h"
+#include "pool.h"
+
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define DB_POOL_NIL	UINT32_MAX
+
+/*
+ * pages enter the pool with ref = 0 and gain one on every hit,
+ * so a page touched once by a scan is the first thing the clock
+ * hand takes, while pages hit again survive DB_POOL_REF_MAX sweeps
+ */
+#define DB_POOL_REF_MAX	3
+
+enum {DB_POOL_READ, DB_POOL_WRITE, DB_POOL_COMPARE};
+
+typedef struct db_pool_page {
+	int      fd;
+	uint64_t pgno;
+	uint8_t *buf;
+	uint32_t next;		/* hash chain		*/
+	uint8_t  ref;		/* clock counter	*/
+	uint8_t  dirty;
+	uint8_t  pin;
+} db_pool_page_t;
+
+struct db_pool {
+	pthread_mutex_t lock;
+
+	size_t   pgsz;
+	uint32_t npage;
+	uint32_t nused;
+	uint32_t npin;
+	uint32_t hand;
+
+	uint32_t  hashlen;	/* power of 2 */
+	uint32_t *hash;
+
+	void           *mem;
+	db_pool_page_t *page;
+};
+
+static uint32_t
+db_pool_slot(db_pool_t *pool, int fd, uint64_t pgno)
+{
+	uint64_t h;
+
+	h = (pgno ^ ((uint64_t)fd << 48)) * UINT64_C(0x9e3779b97f4a7c15);
+	return (uint32_t)(h >> 32) & (pool->hashlen - 1);
+}
+
+static uint32_t
+db_pool_lookup(db_pool_t *pool, int fd, uint64_t pgno)
+{
+	uint32_t i;
+
+	for (i = pool->hash[db_pool_slot(pool, fd, pgno)];
+	     i != DB_POOL_NIL; i = pool->page[i].next)
+	{
+		if (pool->page[i].fd == fd && pool->page[i].pgno == pgno)
+			return i;
+	}
+	return DB_POOL_NIL;
+}
+
+static void
+db_pool_unlink(db_pool_t *pool, uint32_t n)
+{
+	uint32_t *i;
+	db_pool_page_t *page = &pool->page[n];
+
+	for (i = &pool->hash[db_pool_slot(pool, page->fd, page->pgno)];
+	     *i != DB_POOL_NIL; i = &pool->page[*i].next)
+	{
+		if (*i == n) {
+			*i = page->next;
+			return;
+		}
+	}
+}
+
+static int
+db_pool_writeback(db_pool_t *pool, db_pool_page_t *page)
+{
+	ssize_t len;
+
+	len = pwrite(page->fd, page->buf, pool->pgsz, page->pgno * pool->pgsz);
+	if (len != (ssize_t)pool->pgsz)
+		return DB_SYS_ERROR;
+
+	page->dirty = 0;
+	return DB_OK;
+}
+
+static uint32_t
+db_pool_evict(db_pool_t *pool)
+{
+	uint32_t i;
+	uint32_t n;
+	db_pool_page_t *page;
+
+	if (pool->nused < pool->npage)
+		return pool->nused++;
+
+	/* every unpinned page is taken within DB_POOL_REF_MAX + 1 sweeps */
+	for (i = 0; i < pool->npage * (DB_POOL_REF_MAX + 1); i++) {
+		n    = pool->hand;
+		page = &pool->page[n];
+
+		pool->hand = (pool->hand + 1) % pool->npage;
+
+		if (page->pin)
+			continue;
+		if (page->ref > 0) {
+			page->ref--;
+			continue;
+		}
+		if (page->dirty && db_pool_writeback(pool, page) != DB_OK)
+			return DB_POOL_NIL;
+
+		db_pool_unlink(pool, n);
+		return n;
+	}
+
+	return DB_POOL_NIL;
+}
+
+static db_pool_page_t *
+db_pool_get(db_pool_t *pool, int fd, uint64_t pgno, int pin)
+{
+	uint32_t n;
+	ssize_t  len;
+	uint32_t slot;
+	db_pool_page_t *page;
+
+	if ((n = db_pool_lookup(pool, fd, pgno)) != DB_POOL_NIL) {
+		page = &pool->page[n];
+		if (page->ref < DB_POOL_REF_MAX)
+			page->ref++;
+	} else {
+		if ((n = db_pool_evict(pool)) == DB_POOL_NIL)
+			return NULL;
+		page = &pool->page[n];
+
+		/* a short read is the end of the file, an error is not cached */
+		len = pread(fd, page->buf, pool->pgsz, pgno * pool->pgsz);
+		if (len < 0) {
+			page->fd    = -1;
+			page->ref   = 0;
+			page->dirty = 0;
+			return NULL;
+		}
+		memset(page->buf + len, 0, pool->pgsz - len);
+
+		page->fd    = fd;
+		page->pgno  = pgno;
+		page->ref   = 0;
+		page->dirty = 0;
+
+		slot = db_pool_slot(pool, fd, pgno);
+		page->next = pool->hash[slot];
+		pool->hash[slot] = n;
+	}
+
+	/* keep at least half of the pool for the evictable pages */
+	if (pin && !page->pin && pool->npin < pool->npage / 2) {
+		page->pin = 1;
+		pool->npin++;
+	}
+
+	return page;
+}
+
+static int
+db_pool_access(db_pool_t *pool, int fd, uint8_t *buf,
+	uint64_t off, size_t len, int pin, int op)
+{
+	int cmp = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while (len > 0) {
+		size_t n;
+		size_t pgoff;
+		db_pool_page_t *page;
+
+		if ((page = db_pool_get(pool, fd, off / pool->pgsz, pin)) == NULL) {
+			cmp = DB_SYS_ERROR;
+			break;
+		}
+
+		pgoff = off % pool->pgsz;
+		n = pool->pgsz - pgoff;
+		if (n > len)
+			n = len;
+
+		if (op == DB_POOL_READ) {
+			memcpy(buf, page->buf + pgoff, n);
+		} else if (op == DB_POOL_WRITE) {
+			memcpy(page->buf + pgoff, buf, n);
+			page->dirty = 1;
+		} else if ((cmp = memcmp(page->buf + pgoff, buf, n)) != 0) {
+			break;
+		}
+
+		buf += n;
+		off += n;
+		len -= n;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (op == DB_POOL_COMPARE)
+		return cmp;
+	return cmp == 0 ? DB_OK : DB_SYS_ERROR;
+}
+
+db_pool_t *
+db_pool_create(size_t size, size_t pgsz)
+{
+	uint32_t i;
+	db_pool_t *pool;
+
+	assert(pgsz > 0 && (pgsz & (pgsz - 1)) == 0);
+
+	if ((pool = calloc(1, sizeof(db_pool_t))) == NULL)
+		return NULL;
+
+	pool->pgsz  = pgsz;
+	pool->npage = size / pgsz;
+	if (pool->npage < 16)
+		pool->npage = 16;
+
+	for (pool->hashlen = 1; pool->hashlen < pool->npage * 2;)
+		pool->hashlen <<= 1;
+
+	pool->hash = malloc(pool->hashlen * sizeof(uint32_t));
+	pool->page = calloc(pool->npage, sizeof(db_pool_page_t));
+	if (pool->hash == NULL || pool->page == NULL ||
+	    posix_memalign(&pool->mem, pgsz, pool->npage * pgsz) != 0)
+	{
+		free(pool->hash);
+		free(pool->page);
+		free(pool);
+		return NULL;
+	}
+
+	for (i = 0; i < pool->hashlen; i++)
+		pool->hash[i] = DB_POOL_NIL;
+	for (i = 0; i < pool->npage; i++)
+		pool->page[i].buf = (uint8_t *)pool->mem + (size_t)i * pgsz;
+
+	pthread_mutex_init(&pool->lock, NULL);
+
+	return pool;
+}
+
+int
+db_pool_read(db_pool_t *pool, int fd, void *buf,
+	uint64_t off, size_t len, int pin)
+{
+	return db_pool_access(pool, fd, buf, off, len, pin, DB_POOL_READ);
+}
+
+int
+db_pool_write(db_pool_t *pool, int fd, const void *buf,
+	uint64_t off, size_t len, int pin)
+{
+	return db_pool_access(pool, fd, (uint8_t *)buf, off, len, pin,
+		DB_POOL_WRITE);
+}
+
+int
+db_pool_compare(db_pool_t *pool, int fd, const void *buf,
+	uint64_t off, size_t len, int pin)
+{
+	return db_pool_access(pool, fd, (uint8_t *)buf, off, len, pin,
+		DB_POOL_COMPARE);
+}
+
+void
+db_pool_unpin(db_pool_t *pool, int fd, uint64_t off, size_t len)
+{
+	uint64_t i;
+	uint32_t n;
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = (off + pool->pgsz - 1) / pool->pgsz;
+	     (i + 1) * pool->pgsz <= off + len; i++)
+	{
+		if ((n = db_pool_lookup(pool, fd, i)) == DB_POOL_NIL ||
+		    !pool->page[n].pin)
+		{
+			continue;
+		}
+		pool->page[n].pin = 0;
+		pool->page[n].ref = 0;
+		pool->npin--;
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+int
+db_pool_cached(db_pool_t *pool, int fd, uint64_t off, size_t len)
+{
+	uint64_t i;
+	int cached = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = off / pool->pgsz; i * pool->pgsz < off + len; i++) {
+		if (db_pool_lookup(pool, fd, i) != DB_POOL_NIL) {
+			cached = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return cached;
+}
+
+int
+db_pool_flush(db_pool_t *pool, int fd)
+{
+	uint32_t i;
+	int error = DB_OK;
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < pool->nused; i++) {
+		db_pool_page_t *page = &pool->page[i];
+
+		if (!page->dirty || (fd != -1 && page->fd != fd))
+			continue;
+		if (db_pool_writeback(pool, page) != DB_OK)
+			error = DB_SYS_ERROR;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return error;
+}
+
+void
+db_pool_destroy(db_pool_t *pool)
+{
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->mem);
+	free(pool->hash);
+	free(pool->page);
+	free(pool);
+}
@@ -0,0 +1,48 @@
+#ifndef __DB_POOL_H__
+#define __DB_POOL_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct db_pool db_pool_t;
+
+/*
+ * buffer pool used by the pread backend
+ *
+ * size is the memory budget in bytes, pgsz is the frame size,
+ * frames are aligned to pgsz so the pool works with O_DIRECT.
+ * pages read with pin set stay resident (up to half the pool),
+ * everything else is evicted by a scan resistant CLOCK.
+ */
+db_pool_t *
+db_pool_create(size_t size, size_t pgsz);
+
+int
+db_pool_read(db_pool_t *pool, int fd, void *buf,
+	uint64_t off, size_t len, int pin);
+
+int
+db_pool_write(db_pool_t *pool, int fd, const void *buf,
+	uint64_t off, size_t len, int pin);
+
+/* same result as memcmp, I/O error compare as not equal */
+int
+db_pool_compare(db_pool_t *pool, int fd, const void *buf,
+	uint64_t off, size_t len, int pin);
+
+/* the pages wholly in the range lose their pin, first to go */
+void
+db_pool_unpin(db_pool_t *pool, int fd, uint64_t off, size_t len);
+
+/* 1 if any page of the range is in the pool, it may be dirty */
+int
+db_pool_cached(db_pool_t *pool, int fd, uint64_t off, size_t len);
+
+/* write back dirty pages of fd, fd == -1 for all files */
+int
+db_pool_flush(db_pool_t *pool, int fd);
+
+void
+db_pool_destroy(db_pool_t *pool);
+
+#endif /* __DB_POOL_H__ */
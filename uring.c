@@ -0,0 +1,227 @@
+#include "db.h"
+#include "uring.h"
+
+#ifdef LINUX
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(LINUX) && defined(__NR_io_uring_setup)
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+struct db_uring {
+	int fd;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned  sq_entries;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+
+	void  *sq_ptr;
+	size_t sq_len;
+	void  *cq_ptr;
+	size_t cq_len;
+	size_t sqe_len;
+
+	unsigned pending;	/* queued, not submitted yet */
+};
+
+db_uring_t *
+db_uring_create(unsigned depth)
+{
+	db_uring_t *ring;
+	struct io_uring_params params;
+
+	if ((ring = calloc(1, sizeof(db_uring_t))) == NULL)
+		return NULL;
+
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, depth, &params);
+	if (ring->fd == -1) {
+		free(ring);
+		return NULL;
+	}
+
+	ring->sq_len  = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_len  = params.cq_off.cqes +
+			params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqe_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_len > ring->sq_len)
+			ring->sq_len = ring->cq_len;
+		ring->cq_len = ring->sq_len;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+		goto err_sq;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED)
+			goto err_cq;
+	}
+
+	ring->sqes = mmap(NULL, ring->sqe_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto err_sqes;
+
+	ring->sq_head    = (unsigned *)((char *)ring->sq_ptr + params.sq_off.head);
+	ring->sq_tail    = (unsigned *)((char *)ring->sq_ptr + params.sq_off.tail);
+	ring->sq_mask    = (unsigned *)((char *)ring->sq_ptr + params.sq_off.ring_mask);
+	ring->sq_array   = (unsigned *)((char *)ring->sq_ptr + params.sq_off.array);
+	ring->sq_entries = params.sq_entries;
+
+	ring->cq_head    = (unsigned *)((char *)ring->cq_ptr + params.cq_off.head);
+	ring->cq_tail    = (unsigned *)((char *)ring->cq_ptr + params.cq_off.tail);
+	ring->cq_mask    = (unsigned *)((char *)ring->cq_ptr + params.cq_off.ring_mask);
+	ring->cqes       = (struct io_uring_cqe *)
+			((char *)ring->cq_ptr + params.cq_off.cqes);
+
+	return ring;
+
+err_sqes:
+	if (ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_len);
+err_cq:
+	munmap(ring->sq_ptr, ring->sq_len);
+err_sq:
+	close(ring->fd);
+	free(ring);
+	return NULL;
+}
+
+int
+db_uring_read(db_uring_t *ring, int fd, void *buf, size_t len,
+	uint64_t off, uint64_t data)
+{
+	unsigned head;
+	unsigned tail;
+	unsigned index;
+	struct io_uring_sqe *sqe;
+
+	tail = *ring->sq_tail;
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (tail - head >= ring->sq_entries)
+		return DB_ERROR;
+
+	index = tail & *ring->sq_mask;
+	sqe   = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode    = IORING_OP_READ;
+	sqe->fd        = fd;
+	sqe->addr      = (uint64_t)(uintptr_t)buf;
+	sqe->len       = len;
+	sqe->off       = off;
+	sqe->user_data = data;
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	ring->pending++;
+	return DB_OK;
+}
+
+int
+db_uring_submit(db_uring_t *ring, unsigned wait)
+{
+	int n;
+
+	do {
+		n = syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait,
+			wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (n == -1 && errno == EINTR);
+
+	if (n == -1)
+		return DB_SYS_ERROR;
+
+	ring->pending -= n;
+	return DB_OK;
+}
+
+int
+db_uring_reap(db_uring_t *ring, uint64_t *data, int *res)
+{
+	unsigned head;
+	unsigned tail;
+	struct io_uring_cqe *cqe;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	if (head == tail)
+		return 0;
+
+	cqe   = &ring->cqes[head & *ring->cq_mask];
+	*data = cqe->user_data;
+	*res  = cqe->res;
+
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+void
+db_uring_destroy(db_uring_t *ring)
+{
+	if (ring == NULL)
+		return;
+
+	munmap(ring->sqes, ring->sqe_len);
+	if (ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_len);
+	munmap(ring->sq_ptr, ring->sq_len);
+	close(ring->fd);
+	free(ring);
+}
+
+#else /* no io_uring, the caller fall back to synchronous read */
+
+db_uring_t *
+db_uring_create(unsigned depth)
+{
+	return NULL;
+}
+
+int
+db_uring_read(db_uring_t *ring, int fd, void *buf, size_t len,
+	uint64_t off, uint64_t data)
+{
+	return DB_SYS_ERROR;
+}
+
+int
+db_uring_submit(db_uring_t *ring, unsigned wait)
+{
+	return DB_SYS_ERROR;
+}
+
+int
+db_uring_reap(db_uring_t *ring, uint64_t *data, int *res)
+{
+	return 0;
+}
+
+void
+db_uring_destroy(db_uring_t *ring)
+{
+}
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef __DB_URING_H__
+#define __DB_URING_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct db_uring db_uring_t;
+
+/*
+ * minimal io_uring, only what the async read path need
+ * db_uring_create return NULL if the kernel (or the os) has no io_uring
+ */
+db_uring_t *
+db_uring_create(unsigned depth);
+
+/* queue a read, DB_ERROR when the submission queue is full */
+int
+db_uring_read(db_uring_t *ring, int fd, void *buf, size_t len,
+	uint64_t off, uint64_t data);
+
+/* submit queued reads and wait at least wait completions */
+int
+db_uring_submit(db_uring_t *ring, unsigned wait);
+
+/* pop one completion, return 0 when none */
+int
+db_uring_reap(db_uring_t *ring, uint64_t *data, int *res);
+
+void
+db_uring_destroy(db_uring_t *ring);
+
+#endif /* __DB_URING_H__ */